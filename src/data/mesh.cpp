@@ -1,6 +1,7 @@
 #include "data/mesh.h"
 #include <cstring>
 #include <cmath>
+#include <algorithm>
 #include "util/misc_math.h"
 #include "util/random_pool.h"
 
@@ -161,14 +162,25 @@ void Mesh::loadMeshFromOBJFile(std::string filepath)
     this->needsRecalculation[RecalculationFlags::BoundingBox] = true;
     this->needsRecalculation[RecalculationFlags::FaceNormals] = true;
     this->needsRecalculation[RecalculationFlags::Volume] = true;
+    this->needsRecalculation[RecalculationFlags::Hierarchy] = true;
 }
 
-void Mesh::writeMeshToOBJFile(std::string filepath)
+void Mesh::swapVerticesAndFaces(std::vector<Vector3D<float>>& vertices, std::vector<int>& faces)
+{
+    this->vertices.swap(vertices);
+    this->faces.swap(faces);
+
+    for (uint i = 0; i < NR_RECALC_FLAGS; i++) {
+        this->needsRecalculation[i] = true;
+    }
+}
+
+long Mesh::writeMeshToOBJFile(std::string filepath)
 {
     FILE* file = fopen(filepath.c_str(), "w");
     if (file == NULL) {
         printf("Can't open mesh file %s to write!\n", filepath.c_str());
-        return;
+        return 0;
     }
 
     for (uint i = 0; i < this->vertices.size(); i++) {
@@ -191,7 +203,9 @@ void Mesh::writeMeshToOBJFile(std::string filepath)
         );
     }
 
+    long bytes = ftell(file);
     fclose(file);
+    return bytes;
 }
 
 void Mesh::centerOnOrigin()
@@ -215,6 +229,7 @@ void Mesh::centerOn(Vector3D<float> point) {
     }
 
     this->needsRecalculation[RecalculationFlags::BoundingBox] = true;
+    this->needsRecalculation[RecalculationFlags::Hierarchy] = true;
 }
 
 void Mesh::scaleTo(float scale)
@@ -238,6 +253,7 @@ void Mesh::scaleTo(float scale)
 
     this->needsRecalculation[RecalculationFlags::BoundingBox] = true;
     this->needsRecalculation[RecalculationFlags::Volume] = true;
+    this->needsRecalculation[RecalculationFlags::Hierarchy] = true;
 }
 
 void Mesh::rotate(float* matrix)
@@ -279,6 +295,7 @@ void Mesh::rotate(float* matrix)
     }
 
     this->needsRecalculation[RecalculationFlags::BoundingBox] = true;
+    this->needsRecalculation[RecalculationFlags::Hierarchy] = true;
 }
 
 bool Mesh::pointIsInsideMesh(Vector3D<float>& x)
@@ -286,11 +303,228 @@ bool Mesh::pointIsInsideMesh(Vector3D<float>& x)
     // @TODO check if point is on faces first, can be omitted
     // for increased performance
 
-    // now check ray in random direction with length of bounding
-    // box diagonal. if no or even number of intersections, the
-    // point is on the outside of the mesh
+    this->prepare();
+
+    // now check the ray from the point. if no or even number of
+    // intersections, the point is on the outside of the mesh. only the
+    // faces in the nodes of the hierarchy the ray passes through are tested
     int intersections = 0;
 
+    Vector3D<float> r = this->ray;
+    float inverseRay[3] = {1.f / r.getX(), 1.f / r.getY(), 1.f / r.getZ()};
+
+    // the hierarchy is balanced, so its depth is about log2 of the number
+    // of faces and the stack can not overflow
+    int stack[64];
+    int top = 0;
+
+    if (!this->hierarchy.empty()) {
+        stack[top++] = 0;
+    }
+
+    while (top > 0) {
+        MeshHierarchyNode& node = this->hierarchy[stack[--top]];
+
+        if (!this->rayIntersectsBounds(x, inverseRay, node.bounds)) {
+            continue;
+        }
+
+        if (node.count > 0) {
+            for (int k = node.first; k < node.first + node.count; k++) {
+                if (this->rayIntersectsFace(x, r, this->hierarchyFaces[k])) {
+                    intersections++;
+                }
+            }
+        } else {
+            stack[top++] = node.first;
+            stack[top++] = node.first + 1;
+        }
+    }
+
+    return intersections > 0 && intersections % 2 == 1;
+}
+
+float Mesh::distanceToMesh(Vector3D<float>& x)
+{
+    this->prepare();
+
+    // the nodes are visited nearest first and skipped if they are further
+    // away than the closest face found so far
+    float closest = INFINITY;
+    int stack[64];
+    float stackDistances[64];
+    int top = 0;
+
+    if (!this->hierarchy.empty()) {
+        stack[top] = 0;
+        stackDistances[top] = this->distanceToBoundsSquared(x, this->hierarchy[0].bounds);
+        top++;
+    }
+
+    while (top > 0) {
+        top--;
+        if (stackDistances[top] >= closest) {
+            continue;
+        }
+
+        MeshHierarchyNode& node = this->hierarchy[stack[top]];
+
+        if (node.count > 0) {
+            for (int k = node.first; k < node.first + node.count; k++) {
+                closest = std::min(closest, this->distanceToFaceSquared(x, this->hierarchyFaces[k]));
+            }
+        } else {
+            float near = this->distanceToBoundsSquared(x, this->hierarchy[node.first].bounds);
+            float far = this->distanceToBoundsSquared(x, this->hierarchy[node.first + 1].bounds);
+            int nearChild = node.first;
+            int farChild = node.first + 1;
+
+            if (far < near) {
+                std::swap(near, far);
+                std::swap(nearChild, farChild);
+            }
+
+            stack[top] = farChild;
+            stackDistances[top] = far;
+            top++;
+            stack[top] = nearChild;
+            stackDistances[top] = near;
+            top++;
+        }
+    }
+
+    return sqrt(closest);
+}
+
+void Mesh::prepare()
+{
+    // the queries only read the mesh once the hierarchy is built, so it has
+    // to be built before they are run concurrently
+    if (this->needsRecalculation[RecalculationFlags::Hierarchy]) {
+        this->calculateHierarchy();
+    }
+}
+
+float Mesh::distanceToBoundsSquared(Vector3D<float>& x, float* bounds)
+{
+    float point[3] = {x.getX(), x.getY(), x.getZ()};
+    float sum = 0.f;
+
+    for (int k = 0; k < 3; k++) {
+        float d = std::max(std::max(bounds[k] - point[k], point[k] - bounds[k + 3]), 0.f);
+        sum += d * d;
+    }
+
+    return sum;
+}
+
+// This finds the closest point on the triangle by the regions of its
+// vertices and edges, see Ericson, Real-Time Collision Detection, 5.1.5
+float Mesh::distanceToFaceSquared(Vector3D<float>& x, int faceIdx)
+{
+    Vector3D<float> a = this->vertices[this->faces[faceIdx * 3]];
+    Vector3D<float> b = this->vertices[this->faces[faceIdx * 3 + 1]];
+    Vector3D<float> c = this->vertices[this->faces[faceIdx * 3 + 2]];
+    Vector3D<float> ab = b - a;
+    Vector3D<float> ac = c - a;
+    Vector3D<float> closest;
+
+    Vector3D<float> ap = x - a;
+    float d1 = ab * ap;
+    float d2 = ac * ap;
+    Vector3D<float> bp = x - b;
+    float d3 = ab * bp;
+    float d4 = ac * bp;
+    Vector3D<float> cp = x - c;
+    float d5 = ab * cp;
+    float d6 = ac * cp;
+
+    float va = d3 * d6 - d5 * d4;
+    float vb = d5 * d2 - d1 * d6;
+    float vc = d1 * d4 - d3 * d2;
+
+    if (d1 <= 0.f && d2 <= 0.f) {
+        closest = a;
+    } else if (d3 >= 0.f && d4 <= d3) {
+        closest = b;
+    } else if (d6 >= 0.f && d5 <= d6) {
+        closest = c;
+    } else if (vc <= 0.f && d1 >= 0.f && d3 <= 0.f) {
+        closest = a + ab * (d1 / (d1 - d3));
+    } else if (vb <= 0.f && d2 >= 0.f && d6 <= 0.f) {
+        closest = a + ac * (d2 / (d2 - d6));
+    } else if (va <= 0.f && d4 - d3 >= 0.f && d5 - d6 >= 0.f) {
+        closest = b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+    } else {
+        float denominator = 1.f / (va + vb + vc);
+        closest = a + ab * (vb * denominator) + ac * (vc * denominator);
+    }
+
+    Vector3D<float> d = x - closest;
+    return d * d;
+}
+
+// This is the slab test, which clips the ray to the space between the two
+// planes of the box in each direction. NaN from a ray parallel to the planes
+// is ignored by std::min and std::max, so such a box is never missed
+bool Mesh::rayIntersectsBounds(Vector3D<float>& x, float* inverseRay, float* bounds)
+{
+    float origin[3] = {x.getX(), x.getY(), x.getZ()};
+    float tNear = 0.f;
+    float tFar = INFINITY;
+
+    for (int k = 0; k < 3; k++) {
+        float t1 = (bounds[k] - origin[k]) * inverseRay[k];
+        float t2 = (bounds[k + 3] - origin[k]) * inverseRay[k];
+
+        if (t1 > t2) {
+            std::swap(t1, t2);
+        }
+
+        tNear = std::max(tNear, t1);
+        tFar = std::min(tFar, t2);
+    }
+
+    return tNear <= tFar;
+}
+
+void Mesh::calculateHierarchy()
+{
+    int nrOfFaces = this->faces.size() / 3;
+
+    // the centers of the faces, three values each
+    std::vector<float> centers = std::vector<float>(nrOfFaces * 3);
+    this->hierarchyFaces.resize(nrOfFaces);
+
+    for (int i = 0; i < nrOfFaces; i++) {
+        Vector3D<float> center = Vector3D<float>(
+            (
+                this->vertices[this->faces[i * 3]]
+                + this->vertices[this->faces[i * 3 + 1]]
+                + this->vertices[this->faces[i * 3 + 2]]
+            ) / 3.f
+        );
+        centers[i * 3] = center.getX();
+        centers[i * 3 + 1] = center.getY();
+        centers[i * 3 + 2] = center.getZ();
+        this->hierarchyFaces[i] = i;
+    }
+
+    // a binary tree with at least one face per leaf has less than twice
+    // as many nodes as faces
+    this->hierarchy.clear();
+    this->hierarchy.reserve(2 * nrOfFaces);
+
+    if (nrOfFaces > 0) {
+        MeshHierarchyNode root;
+        root.first = 0;
+        root.count = nrOfFaces;
+        this->hierarchy.push_back(root);
+        this->splitHierarchyNode(0, centers);
+    }
+
+    // the ray goes in a fixed random direction with the length of the
+    // bounding box diagonal, drawn once here instead of for each query
     // @TODO check if hardcoded seed is fine
     RandomPool pool = RandomPool(long(12345));
     float* box = this->getBoundingBox();
@@ -302,19 +536,94 @@ bool Mesh::pointIsInsideMesh(Vector3D<float>& x)
 
     // @TODO this random direction is not isotropic on a sphere,
     // but isotropic on a cube. Does this matter?
-    Vector3D<float> dx = Vector3D<float>(
+    this->ray = Vector3D<float>(
         pool.nextFloat(0.0, 2.0) * rayLength,
         pool.nextFloat(0.0, 2.0) * rayLength,
         pool.nextFloat(0.0, 2.0) * rayLength
     );
 
-    for (uint i = 0, k = 0; k < this->faces.size(); k = 3 * ++i) {
-        if (this->rayIntersectsFace(x, dx, i)) {
-            intersections++;
+    this->needsRecalculation[RecalculationFlags::Hierarchy] = false;
+}
+
+void Mesh::splitHierarchyNode(int node, std::vector<float>& centers)
+{
+    int first = this->hierarchy[node].first;
+    int count = this->hierarchy[node].count;
+
+    float bounds[6] = {1e9, 1e9, 1e9, -1e9, -1e9, -1e9};
+    float centerBounds[6] = {1e9, 1e9, 1e9, -1e9, -1e9, -1e9};
+
+    for (int k = first; k < first + count; k++) {
+        int face = this->hierarchyFaces[k];
+
+        for (int v = 0; v < 3; v++) {
+            Vector3D<float>& vertex = this->vertices[this->faces[face * 3 + v]];
+            float coords[3] = {vertex.getX(), vertex.getY(), vertex.getZ()};
+            for (int d = 0; d < 3; d++) {
+                bounds[d] = std::min(bounds[d], coords[d]);
+                bounds[d + 3] = std::max(bounds[d + 3], coords[d]);
+            }
+        }
+
+        for (int d = 0; d < 3; d++) {
+            centerBounds[d] = std::min(centerBounds[d], centers[face * 3 + d]);
+            centerBounds[d + 3] = std::max(centerBounds[d + 3], centers[face * 3 + d]);
         }
     }
 
-    return intersections > 0 && intersections % 2 == 1;
+    // the bounds are padded a little, so rounding in the slab test can not
+    // miss a face lying on them
+    float pad = 0.f;
+    for (int d = 0; d < 3; d++) {
+        pad = std::max(pad, bounds[d + 3] - bounds[d]);
+        pad = std::max(pad, std::max(std::fabs(bounds[d]), std::fabs(bounds[d + 3])));
+    }
+    pad *= 1e-5f;
+
+    for (int d = 0; d < 3; d++) {
+        this->hierarchy[node].bounds[d] = bounds[d] - pad;
+        this->hierarchy[node].bounds[d + 3] = bounds[d + 3] + pad;
+    }
+
+    // split the faces at the median of their centers along the widest
+    // direction, unless few enough are left or the centers are all equal
+    int axis = 0;
+    for (int d = 1; d < 3; d++) {
+        if (centerBounds[d + 3] - centerBounds[d] > centerBounds[axis + 3] - centerBounds[axis]) {
+            axis = d;
+        }
+    }
+
+    if (count <= 4 || centerBounds[axis + 3] <= centerBounds[axis]) {
+        return;
+    }
+
+    int half = count / 2;
+    std::nth_element(
+        this->hierarchyFaces.begin() + first,
+        this->hierarchyFaces.begin() + first + half,
+        this->hierarchyFaces.begin() + first + count,
+        [&](int a, int b) {
+            return centers[a * 3 + axis] < centers[b * 3 + axis];
+        }
+    );
+
+    int left = this->hierarchy.size();
+    MeshHierarchyNode child;
+
+    child.first = first;
+    child.count = half;
+    this->hierarchy.push_back(child);
+
+    child.first = first + half;
+    child.count = count - half;
+    this->hierarchy.push_back(child);
+
+    this->hierarchy[node].first = left;
+    this->hierarchy[node].count = 0;
+
+    this->splitHierarchyNode(left, centers);
+    this->splitHierarchyNode(left + 1, centers);
 }
 
 // This is the Möller–Trumbore intersection algorithm
@@ -4,11 +4,21 @@
 #include "util/random_pool.h"
 #include "data/vector3D.h"
 
-#define NR_RECALC_FLAGS 3
+#define NR_RECALC_FLAGS 4
 enum RecalculationFlags : int {
     BoundingBox = 0,
     FaceNormals = 1,
-    Volume = 2
+    Volume = 2,
+    Hierarchy = 3
+};
+
+// a node of the bounding volume hierarchy over the faces. inner nodes have
+// their two children at first and first + 1, leaves hold count faces
+// starting at first in the face order of the hierarchy
+struct MeshHierarchyNode {
+    float bounds[6];
+    int first;
+    int count;
 };
 
 class Mesh
@@ -21,9 +31,18 @@ protected:
     float volume;
     bool* needsRecalculation;
 
+    std::vector<MeshHierarchyNode> hierarchy;
+    std::vector<int> hierarchyFaces;
+    Vector3D<float> ray;
+
     void calculateFaceNormals();
     void calculateBoundingBox();
     void calculateVolume();
+    void calculateHierarchy();
+    void splitHierarchyNode(int node, std::vector<float>& centers);
+    bool rayIntersectsBounds(Vector3D<float>& x, float* inverseRay, float* bounds);
+    float distanceToBoundsSquared(Vector3D<float>& x, float* bounds);
+    float distanceToFaceSquared(Vector3D<float>& x, int faceIdx);
 
 public:
     Mesh();
@@ -32,12 +51,16 @@ public:
     std::vector<int>& getFaces() {return this->faces;}
     std::vector<Vector3D<float>>& getVertices() {return this->vertices;}
 
+    // swaps the given vertices and faces into the mesh, so the vectors hold
+    // the previous ones afterwards and their memory can be reused
+    void swapVerticesAndFaces(std::vector<Vector3D<float>>& vertices, std::vector<int>& faces);
+
     float getVolume();
     float* getBoundingBox();
     std::vector<Vector3D<float>>& getFaceNormals();
 
     void loadMeshFromOBJFile(std::string filepath);
-    void writeMeshToOBJFile(std::string filepath);
+    long writeMeshToOBJFile(std::string filepath);
 
     void centerOnOrigin();
     void centerOn(Vector3D<float> point);
@@ -45,7 +68,13 @@ public:
     void scaleTo(float scale);
     void rotate(float* matrix);
 
+    // builds what the queries below need, which they otherwise do on the
+    // first call after the mesh changed. must be called before the mesh is
+    // queried by several threads at once
+    void prepare();
+
     bool pointIsInsideMesh(Vector3D<float>& x);
+    float distanceToMesh(Vector3D<float>& x);
     bool rayIntersectsFace(Vector3D<float>& x, Vector3D<float>& r, int faceIdx);
     bool lineIntersectsFace(
         Vector3D<float>& start,
@@ -4,76 +4,351 @@
 #include <cmath>
 #include <iostream>
 
-Neighbors::Neighbors(float h, int N, float* bbox) {
+const uint64_t Neighbors::EMPTY_KEY;
+const int Neighbors::HASHED_OFFSET;
+
+Neighbors::Neighbors(float h, int N, float* bbox, bool hashed) {
     this->h = h;
     this->N = N;
-    this->size_x = std::ceil((bbox[3] - bbox[0]) / h);
-    this->size_y = std::ceil((bbox[4] - bbox[1]) / h);
-    this->size_z = std::ceil((bbox[5] - bbox[2]) / h);
+    this->hashed = hashed;
 
     this->lx = bbox[0];
     this->ly = bbox[1];
     this->lz = bbox[2];
 
-    this->grid = std::vector<std::vector<int>>();
     this->indices = new int[3 * N];
+    this->sortedIndices = new int[N];
 
-    for (int i = 0; i < size_x; i++) {
-        for (int j = 0; j < size_y; j++) {
-            for (int k = 0; k < size_z; k++) {
-                this->grid.push_back(std::vector<int>());
-            }
+    // the histogram depends on the number of threads, which we only know
+    // once the particles are sorted for the first time
+    this->counts = NULL;
+    this->partialSums = NULL;
+    this->nrOfThreads = 0;
+
+    if (hashed) {
+        // the hashed grid covers 2^20 cells in each dimension around the
+        // origin and there can be no more occupied cells than particles
+        this->size_x = 2 * HASHED_OFFSET;
+        this->size_y = 2 * HASHED_OFFSET;
+        this->size_z = 2 * HASHED_OFFSET;
+        this->nrOfCells = 0;
+        this->nrOfBlocks = 0;
+
+        this->cellIndex = NULL;
+        this->cellStart = new int[N];
+        this->cellEnd = new int[N];
+        this->cellCoords = new int[3 * N];
+        this->cellSlot = new int[N];
+        this->blockStart = new int[N + 1];
+        this->colourStart = new int[9];
+        this->sortKeys = new std::pair<uint64_t, int>[N];
+        this->sortBuffer = new std::pair<uint64_t, int>[N];
+
+        // the hash table has at least twice as many slots as there can be
+        // occupied cells, so the probe sequences stay short
+        int bits = 1;
+        while ((1 << bits) < 2 * N) {
+            bits++;
+        }
+        this->hashShift = 64 - bits;
+        this->hashKeys = new uint64_t[1 << bits];
+        this->hashValues = new int[1 << bits];
+        for (int i = 0; i < (1 << bits); i++) {
+            this->hashKeys[i] = EMPTY_KEY;
         }
+
+    } else {
+        this->size_x = std::ceil((bbox[3] - bbox[0]) / h);
+        this->size_y = std::ceil((bbox[4] - bbox[1]) / h);
+        this->size_z = std::ceil((bbox[5] - bbox[2]) / h);
+        this->nrOfCells = size_x * size_y * size_z;
+
+        this->cellIndex = new int[N];
+        this->cellStart = new int[nrOfCells];
+        this->cellEnd = new int[nrOfCells];
+        this->cellCoords = NULL;
+        this->cellSlot = NULL;
+        this->blockStart = NULL;
+        this->colourStart = NULL;
+        this->sortKeys = NULL;
+        this->sortBuffer = NULL;
+        this->hashKeys = NULL;
+        this->hashValues = NULL;
+        this->hashShift = 0;
     }
 }
 
 Neighbors::~Neighbors() {
     delete[] this->indices;
+    delete[] this->cellIndex;
+    delete[] this->sortedIndices;
+    delete[] this->cellStart;
+    delete[] this->cellEnd;
+    delete[] this->counts;
+    delete[] this->partialSums;
+    delete[] this->cellCoords;
+    delete[] this->cellSlot;
+    delete[] this->blockStart;
+    delete[] this->colourStart;
+    delete[] this->sortKeys;
+    delete[] this->sortBuffer;
+    delete[] this->hashKeys;
+    delete[] this->hashValues;
 }
 
 void Neighbors::sortParticlesIntoGrid(float* positions, ParallelBounds& pBounds) {
-    // clear old data
-    // we must use a different bounds instance here because the grid size
-    // is different from the number of particles
-    ParallelBounds gBounds = ParallelBounds(pBounds.getNrOfThreads(), grid.size());
-
     #pragma omp parallel
-    {
-        int threadNum = omp_get_thread_num();
+    this->sortParticlesIntoGridInRegion(positions, pBounds, omp_get_thread_num());
+}
+
+void Neighbors::sortParticlesIntoGridInRegion(float* positions, ParallelBounds& pBounds, int threadNum) {
+    if (this->hashed) {
+        this->sortParticlesIntoHashedGrid(positions, pBounds, threadNum);
+    } else {
+        this->sortParticlesIntoDenseGrid(positions, pBounds, threadNum);
+    }
+}
+
+void Neighbors::sortParticlesIntoHashedGrid(float* positions, ParallelBounds& pBounds, int threadNum) {
+    int T = pBounds.getNrOfThreads();
+    int maxCoord = 2 * HASHED_OFFSET - 1;
+
+    float invh = 1.f / h;
 
-        for (int i = gBounds.lower(threadNum); i < gBounds.upper(threadNum); i++) {
-            this->grid.at(i).clear();
+    // The sort key consists of the colour (3 bits), the z coordinate
+    // (20 bits), the block coordinates in y and x (19 bits each) and the
+    // position of the cell within the block (2 bits). Blocks are 2x2x1
+    // cells and the colour is the parity of the block coordinates
+    for (int i = pBounds.lower(threadNum); i < pBounds.upper(threadNum); i++) {
+        int idx_x = (int)std::floor((positions[i * 3] - lx) * invh) + HASHED_OFFSET;
+        int idx_y = (int)std::floor((positions[i * 3 + 1] - ly) * invh) + HASHED_OFFSET;
+        int idx_z = (int)std::floor((positions[i * 3 + 2] - lz) * invh) + HASHED_OFFSET;
+
+        idx_x = std::min(maxCoord, std::max(0, idx_x));
+        idx_y = std::min(maxCoord, std::max(0, idx_y));
+        idx_z = std::min(maxCoord, std::max(0, idx_z));
+
+        this->indices[i * 3] = idx_x;
+        this->indices[i * 3 + 1] = idx_y;
+        this->indices[i * 3 + 2] = idx_z;
+
+        uint64_t bx = idx_x >> 1, by = idx_y >> 1, bz = idx_z;
+        uint64_t colour = (bx & 1) | ((by & 1) << 1) | ((bz & 1) << 2);
+        uint64_t key = (colour << 60) | (bz << 40) | (by << 21) | (bx << 2)
+            | ((uint64_t)(idx_y & 1) << 1) | (uint64_t)(idx_x & 1);
+
+        this->sortKeys[i] = std::make_pair(key, i);
+    }
+
+    // sort the keys of each thread, then merge the sorted ranges
+    // pairwise until only one is left
+    std::sort(this->sortKeys + pBounds.lower(threadNum), this->sortKeys + pBounds.upper(threadNum));
+
+    std::pair<uint64_t, int>* source = this->sortKeys;
+    std::pair<uint64_t, int>* target = this->sortBuffer;
+
+    for (int width = 1; width < T; width *= 2) {
+        #pragma omp barrier
+
+        if (threadNum % (2 * width) == 0) {
+            int first = pBounds.lower(threadNum);
+            int middle = threadNum + width < T ? pBounds.lower(threadNum + width) : N;
+            int last = threadNum + 2 * width < T ? pBounds.lower(threadNum + 2 * width) : N;
+            std::merge(source + first, source + middle, source + middle, source + last, target + first);
         }
+
+        std::swap(source, target);
     }
 
-    // sort particles into grid
-    #pragma omp parallel
-    {
-        float invh = 1.f / h;
-        int threadNum = omp_get_thread_num();
+    #pragma omp barrier
+
+    for (int i = pBounds.lower(threadNum); i < pBounds.upper(threadNum); i++) {
+        this->sortedIndices[i] = source[i].second;
+    }
+
+    // Find the cells, blocks and colours in the sorted keys and put the cells
+    // into the hash table. This is linear in the number of particles, so
+    // it is done by one thread. all threads did the same swaps, so the
+    // sorted keys are in the same array for all of them
+    #pragma omp single
+    this->buildHashedCells(source);
+}
+
+void Neighbors::buildHashedCells(std::pair<uint64_t, int>* sorted) {
+    int mask = (int)((~0ull) >> this->hashShift);
+
+    for (int c = 0; c < this->nrOfCells; c++) {
+        this->hashKeys[this->cellSlot[c]] = EMPTY_KEY;
+    }
+
+    this->nrOfCells = 0;
+    this->nrOfBlocks = 0;
+    int nrOfColours = 0;
+
+    for (int k = 0; k < N; k++) {
+        uint64_t key = sorted[k].first;
+
+        if (k > 0 && key == sorted[k - 1].first) {
+            continue;
+        }
+
+        int c = this->nrOfCells++;
+        int p = sorted[k].second;
+        this->cellStart[c] = k;
+        if (c > 0) {
+            this->cellEnd[c - 1] = k;
+        }
+
+        this->cellCoords[c * 3] = this->indices[p * 3];
+        this->cellCoords[c * 3 + 1] = this->indices[p * 3 + 1];
+        this->cellCoords[c * 3 + 2] = this->indices[p * 3 + 2];
 
-        for (int i = pBounds.lower(threadNum); i < pBounds.upper(threadNum); i++) {
-            int idx_x = std::floor((positions[i * 3] - lx) * invh);
-            int idx_y = std::floor((positions[i * 3 + 1] - ly) * invh);
-            int idx_z = std::floor((positions[i * 3 + 2] - lz) * invh);
+        uint64_t hashKey = this->cellKey(
+            this->indices[p * 3],
+            this->indices[p * 3 + 1],
+            this->indices[p * 3 + 2]
+        );
+        int slot = this->hashSlot(hashKey);
+        while (this->hashKeys[slot] != EMPTY_KEY) {
+            slot = (slot + 1) & mask;
+        }
+        this->hashKeys[slot] = hashKey;
+        this->hashValues[slot] = c;
+        this->cellSlot[c] = slot;
 
-            this->indices[i * 3] = idx_x;
-            this->indices[i * 3 + 1] = idx_y;
-            this->indices[i * 3 + 2] = idx_z;
+        // a new block starts if anything but the position within the block
+        // changes, and a new colour might start with it
+        if (k == 0 || (key >> 2) != (sorted[k - 1].first >> 2)) {
+            this->blockStart[this->nrOfBlocks++] = c;
 
-            this->grid.at(idx_z * size_y * size_x + idx_y * size_x + idx_x).push_back(i);
+            int colour = (int)(key >> 60);
+            while (nrOfColours <= colour) {
+                this->colourStart[nrOfColours++] = this->nrOfBlocks - 1;
+            }
         }
     }
+
+    if (this->nrOfCells > 0) {
+        this->cellEnd[this->nrOfCells - 1] = N;
+    }
+    this->blockStart[this->nrOfBlocks] = this->nrOfCells;
+    while (nrOfColours <= 8) {
+        this->colourStart[nrOfColours++] = this->nrOfBlocks;
+    }
+}
+
+void Neighbors::sortParticlesIntoDenseGrid(float* positions, ParallelBounds& pBounds, int threadNum) {
+    int T = pBounds.getNrOfThreads();
+
+    #pragma omp single
+    if (this->nrOfThreads != T) {
+        delete[] this->counts;
+        delete[] this->partialSums;
+        this->counts = new int[nrOfCells * T];
+        this->partialSums = new int[T];
+        this->nrOfThreads = T;
+    }
+
+    // we must use a different bounds instance here because the histogram size
+    // is different from the number of particles
+    ParallelBounds cBounds = ParallelBounds(T, nrOfCells * T);
+
+    float invh = 1.f / h;
+
+    // clear the histogram
+    for (int i = cBounds.lower(threadNum); i < cBounds.upper(threadNum); i++) {
+        this->counts[i] = 0;
+    }
+
+    #pragma omp barrier
+
+    // count the particles of this thread per cell. particles outside of
+    // the grid are clamped to the outermost cells
+    for (int i = pBounds.lower(threadNum); i < pBounds.upper(threadNum); i++) {
+        int idx_x = std::floor((positions[i * 3] - lx) * invh);
+        int idx_y = std::floor((positions[i * 3 + 1] - ly) * invh);
+        int idx_z = std::floor((positions[i * 3 + 2] - lz) * invh);
+
+        idx_x = std::min(size_x - 1, std::max(0, idx_x));
+        idx_y = std::min(size_y - 1, std::max(0, idx_y));
+        idx_z = std::min(size_z - 1, std::max(0, idx_z));
+
+        this->indices[i * 3] = idx_x;
+        this->indices[i * 3 + 1] = idx_y;
+        this->indices[i * 3 + 2] = idx_z;
+
+        int cell = idx_z * size_y * size_x + idx_y * size_x + idx_x;
+        this->cellIndex[i] = cell;
+        this->counts[cell * T + threadNum]++;
+    }
+
+    #pragma omp barrier
+
+    // exclusive prefix sum over the histogram, first the sum of each
+    // chunk, then the offsets of the chunks and finally the scan within
+    // each chunk
+    int sum = 0;
+    for (int i = cBounds.lower(threadNum); i < cBounds.upper(threadNum); i++) {
+        sum += this->counts[i];
+    }
+    this->partialSums[threadNum] = sum;
+
+    #pragma omp barrier
+
+    #pragma omp single
+    {
+        int offset = 0;
+        for (int t = 0; t < T; t++) {
+            int tmp = this->partialSums[t];
+            this->partialSums[t] = offset;
+            offset += tmp;
+        }
+    }
+
+    int offset = this->partialSums[threadNum];
+    for (int i = cBounds.lower(threadNum); i < cBounds.upper(threadNum); i++) {
+        int tmp = this->counts[i];
+        this->counts[i] = offset;
+
+        // the offset of the first thread of a cell is where the cell
+        // starts and where the previous cell ends
+        if (i % T == 0) {
+            this->cellStart[i / T] = offset;
+            if (i > 0) {
+                this->cellEnd[i / T - 1] = offset;
+            }
+        }
+
+        offset += tmp;
+    }
+
+    if (threadNum == T - 1) {
+        this->cellEnd[nrOfCells - 1] = N;
+    }
+
+    #pragma omp barrier
+
+    // scatter the particles into the sorted index array
+    for (int i = pBounds.lower(threadNum); i < pBounds.upper(threadNum); i++) {
+        this->sortedIndices[this->counts[this->cellIndex[i] * T + threadNum]++] = i;
+    }
+
+    #pragma omp barrier
 }
 
 void Neighbors::getNeighbors(int idx, std::vector<int>& list) {
-    for (int i = std::max(0, this->indices[idx * 3] - 1); i <= std::min(size_x - 1, this->indices[idx * 3] + 1); i++) {
-        for (int j = std::max(0, this->indices[idx * 3 + 1] - 1); j <= std::min(size_y - 1, this->indices[idx * 3 + 1] + 1); j++) {
-            for (int k = std::max(0, this->indices[idx * 3 + 2] - 1); k <= std::min(size_z - 1, this->indices[idx * 3 + 2] + 1); k++) {
-                for (uint l = 0; l < this->grid.at(k * size_y * size_x + j * size_x + i).size(); l++) {
-                    list.push_back(this->grid.at(k * size_y * size_x + j * size_x + i).at(l));
+    for (int k = this->indices[idx * 3 + 2] - 1; k <= this->indices[idx * 3 + 2] + 1; k++) {
+        for (int j = this->indices[idx * 3 + 1] - 1; j <= this->indices[idx * 3 + 1] + 1; j++) {
+            for (int i = this->indices[idx * 3] - 1; i <= this->indices[idx * 3] + 1; i++) {
+                int cell = this->findCell(i, j, k);
+                if (cell < 0) {
+                    continue;
+                }
+
+                for (int l = this->cellStart[cell]; l < this->cellEnd[cell]; l++) {
+                    list.push_back(this->sortedIndices[l]);
                 }
             }
         }
     }
-}
\ No newline at end of file
+}
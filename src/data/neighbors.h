@@ -1,25 +1,354 @@
 #pragma once
 
 #include <vector>
+#include <algorithm>
+#include <utility>
+#include <cstdint>
 #include "util/parallel_bounds.h"
 
 class Neighbors {
 private:
-    std::vector<std::vector<int>> grid;
+    /// @var indices int* The cell coordinates (x, y and z) of each particle
     int* indices;
+
+    /// @var cellIndex int* The linear index of the cell of each particle.
+    ///     Only used by the dense grid.
+    int* cellIndex;
+
+    /// @var sortedIndices int* The particle indices sorted by cell, so the
+    ///     particles of cell c are sortedIndices[cellStart[c]] up to
+    ///     (excluding) sortedIndices[cellEnd[c]]
+    int* sortedIndices;
+
+    /// @var cellStart int* The first position in sortedIndices for each cell
+    int* cellStart;
+
+    /// @var cellEnd int* The position after the last one in sortedIndices
+    ///     for each cell
+    int* cellEnd;
+
+    /// @var counts int* The per-thread histogram of particles per cell, laid
+    ///     out cell by cell so the prefix sum over it directly yields the
+    ///     scatter offsets of each thread. Allocated on the first sort, as it
+    ///     depends on the number of threads. Only used by the dense grid.
+    int* counts;
+
+    /// @var partialSums int* The per-thread partial sums of the prefix sum
+    int* partialSums;
+
+    /// @var nrOfThreads int The number of threads the histogram was
+    ///     allocated for
+    int nrOfThreads;
+
+    /// @var hashed bool Flag if the cells are stored in a hash table
+    ///     instead of a dense grid spanning the bounding box. The hashed grid
+    ///     only stores occupied cells and is not limited to the bounding box.
+    bool hashed;
+
+    /// @var sortKeys std::pair<uint64_t, int>* The sort key and index of each
+    ///     particle. Only used by the hashed grid.
+    std::pair<uint64_t, int>* sortKeys;
+
+    /// @var sortBuffer std::pair<uint64_t, int>* A buffer for merging the
+    ///     sorted keys. Only used by the hashed grid.
+    std::pair<uint64_t, int>* sortBuffer;
+
+    /// @var cellCoords int* The coordinates of each occupied cell. Only used
+    ///     by the hashed grid.
+    int* cellCoords;
+
+    /// @var cellSlot int* The slot in the hash table of each occupied cell.
+    ///     Only used by the hashed grid.
+    int* cellSlot;
+
+    /// @var blockStart int* The first cell of each block of cells, with one
+    ///     more entry for the end of the last block. Only used by the hashed
+    ///     grid.
+    int* blockStart;
+
+    /// @var colourStart int* The first block of each of the eight colours,
+    ///     with one more entry for the end of the last colour. Only used by
+    ///     the hashed grid.
+    int* colourStart;
+
+    /// @var nrOfBlocks int The number of occupied blocks of cells. Only used
+    ///     by the hashed grid.
+    int nrOfBlocks;
+
+    /// @var hashKeys uint64_t* The keys of the hash table, which are the
+    ///     packed coordinates of the cells. Empty slots have the key
+    ///     EMPTY_KEY. Only used by the hashed grid.
+    uint64_t* hashKeys;
+
+    /// @var hashValues int* The cell index of each slot of the hash table.
+    ///     Only used by the hashed grid.
+    int* hashValues;
+
+    /// @var hashShift int The shift turning a hashed key into a slot of the
+    ///     hash table, which has 2^(64 - hashShift) slots
+    int hashShift;
+
     float h;
     int N;
     int size_x;
     int size_y;
     int size_z;
+
+    /// @var nrOfCells int The number of cells. For the hashed grid this is
+    ///     the number of occupied cells.
+    int nrOfCells;
     float lx, ly, lz;
 
+    /// Sorts the particles into the dense grid with a parallel counting sort.
+    /// Must be called by all threads of a parallel region.
+    ///
+    /// @param positions float* The particle positions
+    /// @param pBounds ParallelBounds& The iteration bounds of the particles
+    /// @param threadNum int The thread number of the calling thread
+    void sortParticlesIntoDenseGrid(float* positions, ParallelBounds& pBounds, int threadNum);
+
+    /// Sorts the particles into the hashed grid. The particles are sorted by
+    /// a key that orders the cells by colour, then by block and then by
+    /// cell, so the cells of each block and the blocks of each colour are
+    /// consecutive. The occupied cells are then put into the hash table.
+    /// Must be called by all threads of a parallel region.
+    ///
+    /// @param positions float* The particle positions
+    /// @param pBounds ParallelBounds& The iteration bounds of the particles
+    /// @param threadNum int The thread number of the calling thread
+    void sortParticlesIntoHashedGrid(float* positions, ParallelBounds& pBounds, int threadNum);
+
+    /// Finds the cells, blocks and colours in the sorted keys and puts the
+    /// occupied cells into the hash table.
+    ///
+    /// @param sorted std::pair<uint64_t, int>* The sorted keys
+    void buildHashedCells(std::pair<uint64_t, int>* sorted);
+
+    /// Returns the packed coordinates of a cell, which are the keys of the
+    /// hash table.
+    ///
+    /// @param x int The x coordinate of the cell
+    /// @param y int The y coordinate of the cell
+    /// @param z int The z coordinate of the cell
+    /// @return uint64_t The key of the cell
+    uint64_t cellKey(int x, int y, int z) {
+        return ((uint64_t)z << 40) | ((uint64_t)y << 20) | (uint64_t)x;
+    }
+
+    /// Returns the slot of the hash table at which the search for the given
+    /// key starts.
+    ///
+    /// @param key uint64_t The key of the cell
+    /// @return int The slot
+    int hashSlot(uint64_t key) {
+        return (int)((key * 0x9e3779b97f4a7c15ull) >> this->hashShift);
+    }
+
 public:
-    Neighbors(float h, int N, float* bbox);
+    /// Constructor.
+    ///
+    /// @param h float The size of the cells
+    /// @param N int The number of particles
+    /// @param bbox float* The bounding box as lower x, y and z coordinates
+    ///     followed by the upper ones. The hashed grid only uses the lower
+    ///     coordinates as origin of the cells
+    /// @param hashed bool Flag if the occupied cells are stored in a hash
+    ///     table instead of a dense grid spanning the bounding box
+    Neighbors(float h, int N, float* bbox, bool hashed);
 
     ~Neighbors();
 
+    /// Sorts the particles into the cells of the grid. For the dense grid
+    /// this is a parallel counting sort: each thread builds a histogram of
+    /// the cells of its particles, a prefix sum over all histograms gives the
+    /// offsets of each cell and thread, then each thread scatters its
+    /// particles into the sorted index array. Particles within a cell keep
+    /// ascending order. Particles outside of the dense grid are clamped to
+    /// the outermost cells.
+    ///
+    /// @param positions float* The particle positions
+    /// @param pBounds ParallelBounds& The iteration bounds of the particles
     void sortParticlesIntoGrid(float* positions, ParallelBounds& pBounds);
 
+    /// Same as sortParticlesIntoGrid, but must be called by all threads of an
+    /// enclosing parallel region instead of starting its own. The grid is
+    /// complete for all threads once this returns.
+    ///
+    /// @param positions float* The particle positions
+    /// @param pBounds ParallelBounds& The iteration bounds of the particles
+    /// @param threadNum int The thread number of the calling thread
+    void sortParticlesIntoGridInRegion(float* positions, ParallelBounds& pBounds, int threadNum);
+
+    /// Returns the index of the cell with the given coordinates, or -1 if
+    /// there is no such cell or the cell is not occupied in the hashed grid.
+    ///
+    /// @param x int The x coordinate of the cell
+    /// @param y int The y coordinate of the cell
+    /// @param z int The z coordinate of the cell
+    /// @return int The index of the cell
+    int findCell(int x, int y, int z) {
+        if (x < 0 || x >= size_x || y < 0 || y >= size_y || z < 0 || z >= size_z) {
+            return -1;
+        }
+
+        if (!this->hashed) {
+            return z * size_y * size_x + y * size_x + x;
+        }
+
+        uint64_t key = this->cellKey(x, y, z);
+        int mask = (int)((~0ull) >> this->hashShift);
+        int slot = this->hashSlot(key);
+
+        while (this->hashKeys[slot] != EMPTY_KEY) {
+            if (this->hashKeys[slot] == key) {
+                return this->hashValues[slot];
+            }
+            slot = (slot + 1) & mask;
+        }
+
+        return -1;
+    }
+
+    /// Appends the indices of all particles in the cell of the given particle
+    /// and the adjacent cells to the given list. This includes the particle
+    /// itself.
+    ///
+    /// @param idx int The index of the particle
+    /// @param list std::vector<int>& The list to append the candidates to
     void getNeighbors(int idx, std::vector<int>& list);
+
+    /// Calls f(i, j) exactly once for every pair of different particles i
+    /// and j in the same or adjacent cells. Each cell is paired with itself
+    /// and the 13 adjacent cells that follow it, which covers all 26
+    /// adjacent cells exactly once. The cells are processed in blocks of
+    /// 2x2x1 cells in eight colours, one after the other. Blocks of the same
+    /// colour never touch the same particles, so the calls of different
+    /// threads never share a particle and f may write to both particles.
+    ///
+    /// This must be called by all threads of a parallel region, as it
+    /// synchronizes the threads between the colours.
+    ///
+    /// @param threadNum int The thread number of the calling thread
+    /// @param nrOfThreads int The number of threads in the parallel region
+    /// @param f PairFunction& The function to call for each pair
+    template <typename PairFunction>
+    void forEachPair(int threadNum, int nrOfThreads, PairFunction& f);
+
+    /// @var EMPTY_KEY uint64_t The key of empty slots in the hash table
+    static const uint64_t EMPTY_KEY = ~0ull;
+
+    /// @var HASHED_OFFSET int The offset added to the cell coordinates in the
+    ///     hashed grid, so cells below the origin have positive coordinates
+    static const int HASHED_OFFSET = 1 << 19;
+
+private:
+    /// Calls f(i, j) for all pairs within the given cell and all pairs
+    /// between the cell and the 13 adjacent cells that follow it.
+    ///
+    /// @param cell int The index of the cell
+    /// @param x int The x coordinate of the cell
+    /// @param y int The y coordinate of the cell
+    /// @param z int The z coordinate of the cell
+    /// @param f PairFunction& The function to call for each pair
+    template <typename PairFunction>
+    void forEachPairOfCell(int cell, int x, int y, int z, PairFunction& f);
 };
+
+template <typename PairFunction>
+void Neighbors::forEachPair(int threadNum, int nrOfThreads, PairFunction& f) {
+    if (this->hashed) {
+        for (int colour = 0; colour < 8; colour++) {
+            int first = this->colourStart[colour];
+            ParallelBounds bBounds = ParallelBounds(nrOfThreads, this->colourStart[colour + 1] - first);
+
+            for (int b = first + bBounds.lower(threadNum); b < first + bBounds.upper(threadNum); b++) {
+                for (int cell = this->blockStart[b]; cell < this->blockStart[b + 1]; cell++) {
+                    this->forEachPairOfCell(
+                        cell,
+                        this->cellCoords[cell * 3],
+                        this->cellCoords[cell * 3 + 1],
+                        this->cellCoords[cell * 3 + 2],
+                        f
+                    );
+                }
+            }
+
+            #pragma omp barrier
+        }
+
+        return;
+    }
+
+    // number of blocks in each dimension
+    int nbx = (size_x + 1) / 2;
+    int nby = (size_y + 1) / 2;
+    int nbz = size_z;
+
+    for (int colour = 0; colour < 8; colour++) {
+        int cx = colour & 1;
+        int cy = (colour >> 1) & 1;
+        int cz = (colour >> 2) & 1;
+
+        // number of blocks of this colour in each dimension
+        int nx = (nbx - cx + 1) / 2;
+        int ny = (nby - cy + 1) / 2;
+        int nz = (nbz - cz + 1) / 2;
+
+        ParallelBounds bBounds = ParallelBounds(nrOfThreads, nx * ny * nz);
+
+        for (int b = bBounds.lower(threadNum); b < bBounds.upper(threadNum); b++) {
+            int bx = cx + 2 * (b % nx);
+            int by = cy + 2 * ((b / nx) % ny);
+            int z = cz + 2 * (b / (nx * ny));
+
+            for (int y = 2 * by; y < std::min(2 * by + 2, size_y); y++) {
+                for (int x = 2 * bx; x < std::min(2 * bx + 2, size_x); x++) {
+                    this->forEachPairOfCell(z * size_y * size_x + y * size_x + x, x, y, z, f);
+                }
+            }
+        }
+
+        #pragma omp barrier
+    }
+}
+
+template <typename PairFunction>
+void Neighbors::forEachPairOfCell(int cell, int x, int y, int z, PairFunction& f) {
+    // the adjacent cells following a cell, which are all cells in the next
+    // z layer, the next row of the same layer and the next cell of the row
+    static const int forward[13][3] = {
+        {1, 0, 0},
+        {-1, 1, 0}, {0, 1, 0}, {1, 1, 0},
+        {-1, -1, 1}, {0, -1, 1}, {1, -1, 1},
+        {-1, 0, 1}, {0, 0, 1}, {1, 0, 1},
+        {-1, 1, 1}, {0, 1, 1}, {1, 1, 1}
+    };
+
+    int start = this->cellStart[cell];
+    int end = this->cellEnd[cell];
+
+    if (start == end) {
+        return;
+    }
+
+    for (int a = start; a < end; a++) {
+        for (int b = a + 1; b < end; b++) {
+            f(this->sortedIndices[a], this->sortedIndices[b]);
+        }
+    }
+
+    for (int n = 0; n < 13; n++) {
+        int other = this->findCell(x + forward[n][0], y + forward[n][1], z + forward[n][2]);
+
+        if (other < 0) {
+            continue;
+        }
+
+        for (int a = start; a < end; a++) {
+            int i = this->sortedIndices[a];
+            for (int b = this->cellStart[other]; b < this->cellEnd[other]; b++) {
+                f(i, this->sortedIndices[b]);
+            }
+        }
+    }
+}
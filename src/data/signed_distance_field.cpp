@@ -0,0 +1,225 @@
+#include "data/signed_distance_field.h"
+#include "util/checkpoint.h"
+#include "util/hash.h"
+#include <algorithm>
+#include <cmath>
+
+/// The number of cells the grid reaches beyond the bounding box of the mesh
+/// on each side, so the distance at the bounds of the grid is positive.
+static const int MARGIN = 2;
+
+SignedDistanceField::SignedDistanceField(Mesh* mesh, int resolution)
+{
+    this->mesh = mesh;
+    this->resolution = std::max(1, resolution);
+    this->nrOfPoints = new int[3];
+    this->origin = new float[3];
+
+    float* box = this->mesh->getBoundingBox();
+    float longest = std::max(box[3] - box[0], std::max(box[4] - box[1], box[5] - box[2]));
+    this->cellSize = longest > 0.f ? longest / this->resolution : 1.f;
+
+    for (int k = 0; k < 3; k++) {
+        this->nrOfPoints[k] = (int)std::ceil((box[k + 3] - box[k]) / this->cellSize) + 1 + 2 * MARGIN;
+        this->origin[k] = box[k] - MARGIN * this->cellSize;
+    }
+}
+
+SignedDistanceField::~SignedDistanceField()
+{
+    delete[] this->nrOfPoints;
+    delete[] this->origin;
+}
+
+void SignedDistanceField::build(int nrOfThreads)
+{
+    int nx = this->nrOfPoints[0];
+    int ny = this->nrOfPoints[1];
+    int nz = this->nrOfPoints[2];
+    this->distances.resize((size_t)nx * ny * nz);
+
+    // the mesh is queried by all threads at once
+    this->mesh->prepare();
+
+    // the layers through the mesh take longer than those around it, so they
+    // are handed out one by one
+    #pragma omp parallel for num_threads(std::max(1, nrOfThreads)) schedule(dynamic)
+    for (int z = 0; z < nz; z++) {
+        for (int y = 0; y < ny; y++) {
+            for (int x = 0; x < nx; x++) {
+                Vector3D<float> point = Vector3D<float>(
+                    this->origin[0] + x * this->cellSize,
+                    this->origin[1] + y * this->cellSize,
+                    this->origin[2] + z * this->cellSize
+                );
+
+                float d = this->mesh->distanceToMesh(point);
+                if (this->mesh->pointIsInsideMesh(point)) {
+                    d = -d;
+                }
+
+                this->distances[((size_t)z * ny + y) * nx + x] = d;
+            }
+        }
+    }
+
+    this->findExactCells();
+}
+
+void SignedDistanceField::findExactCells()
+{
+    int nx = this->nrOfPoints[0];
+    int ny = this->nrOfPoints[1];
+    int nz = this->nrOfPoints[2];
+    this->exactCells.resize((size_t)(nx - 1) * (ny - 1) * (nz - 1));
+
+    // if the surface passes through a cell, all its corners are at most the
+    // diagonal away from it. a little more is taken, so rounding can not
+    // leave out such a cell
+    float band = 1.01f * std::sqrt(3.f) * this->cellSize;
+
+    for (int z = 0; z < nz - 1; z++) {
+        for (int y = 0; y < ny - 1; y++) {
+            for (int x = 0; x < nx - 1; x++) {
+                bool nearSurface = false;
+                int nrInside = 0;
+
+                for (int c = 0; c < 8; c++) {
+                    float d = this->getValue(x + (c & 1), y + ((c >> 1) & 1), z + ((c >> 2) & 1));
+                    nearSurface = nearSurface || std::fabs(d) <= band;
+                    nrInside += d < 0.f ? 1 : 0;
+                }
+
+                this->exactCells[((size_t)z * (ny - 1) + y) * (nx - 1) + x] =
+                    nearSurface || (nrInside != 0 && nrInside != 8);
+            }
+        }
+    }
+}
+
+uint64_t SignedDistanceField::getKey()
+{
+    std::vector<Vector3D<float>>& vertices = this->mesh->getVertices();
+    std::vector<int>& faces = this->mesh->getFaces();
+
+    uint64_t hash = fnv1a(&this->resolution, sizeof(int));
+
+    for (size_t i = 0; i < vertices.size(); i++) {
+        float coords[3] = {vertices[i].getX(), vertices[i].getY(), vertices[i].getZ()};
+        hash = fnv1a(coords, sizeof(coords), hash);
+    }
+
+    return fnv1a(faces.data(), faces.size() * sizeof(int), hash);
+}
+
+bool SignedDistanceField::load(std::string filename)
+{
+    CheckpointReader reader;
+    if (!reader.open(filename) || reader.getParamHash() != this->getKey()) {
+        return false;
+    }
+
+    int points[3];
+    if (!reader.read("points", points, sizeof(points))
+            || points[0] != this->nrOfPoints[0]
+            || points[1] != this->nrOfPoints[1]
+            || points[2] != this->nrOfPoints[2]) {
+        return false;
+    }
+
+    this->distances.resize((size_t)points[0] * points[1] * points[2]);
+    if (!reader.read("distances", this->distances.data(), this->distances.size() * sizeof(float))) {
+        this->distances.clear();
+        return false;
+    }
+
+    this->findExactCells();
+    return true;
+}
+
+bool SignedDistanceField::save(std::string filename)
+{
+    CheckpointWriter writer = CheckpointWriter(this->getKey());
+    writer.add("points", this->nrOfPoints, 3 * sizeof(int));
+    writer.add("origin", this->origin, 3 * sizeof(float));
+    writer.addValue("cell_size", this->cellSize);
+    writer.add("distances", this->distances.data(), this->distances.size() * sizeof(float));
+    return writer.write(filename);
+}
+
+float SignedDistanceField::distance(float* position)
+{
+    int cell[3];
+    float t[3];
+    float outside = 0.f;
+
+    for (int k = 0; k < 3; k++) {
+        float c = (position[k] - this->origin[k]) / this->cellSize;
+        float clamped = std::min(std::max(c, 0.f), float(this->nrOfPoints[k] - 1));
+
+        float beyond = (c - clamped) * this->cellSize;
+        outside += beyond * beyond;
+
+        cell[k] = std::min(int(clamped), this->nrOfPoints[k] - 2);
+        t[k] = clamped - cell[k];
+    }
+
+    float value = 0.f;
+    for (int c = 0; c < 8; c++) {
+        int dx = c & 1;
+        int dy = (c >> 1) & 1;
+        int dz = (c >> 2) & 1;
+        float weight = (dx ? t[0] : 1.f - t[0]) * (dy ? t[1] : 1.f - t[1]) * (dz ? t[2] : 1.f - t[2]);
+        value += weight * this->getValue(cell[0] + dx, cell[1] + dy, cell[2] + dz);
+    }
+
+    return value + std::sqrt(outside);
+}
+
+void SignedDistanceField::normal(float* position, float* ret)
+{
+    float step = 0.5f * this->cellSize;
+    float shifted[3];
+    float length = 0.f;
+
+    for (int k = 0; k < 3; k++) {
+        shifted[0] = position[0];
+        shifted[1] = position[1];
+        shifted[2] = position[2];
+
+        shifted[k] = position[k] + step;
+        ret[k] = this->distance(shifted);
+        shifted[k] = position[k] - step;
+        ret[k] -= this->distance(shifted);
+
+        length += ret[k] * ret[k];
+    }
+
+    if (length > 0.f) {
+        length = std::sqrt(length);
+        for (int k = 0; k < 3; k++) {
+            ret[k] /= length;
+        }
+    }
+}
+
+bool SignedDistanceField::pointIsInside(float* position)
+{
+    int cell[3];
+    bool inGrid = true;
+
+    for (int k = 0; k < 3; k++) {
+        float c = (position[k] - this->origin[k]) / this->cellSize;
+        inGrid = inGrid && c >= 0.f && c < float(this->nrOfPoints[k] - 1);
+        cell[k] = int(c);
+    }
+
+    if (inGrid && !this->exactCells[
+        ((size_t)cell[2] * (this->nrOfPoints[1] - 1) + cell[1]) * (this->nrOfPoints[0] - 1) + cell[0]
+    ]) {
+        return this->getValue(cell[0], cell[1], cell[2]) < 0.f;
+    }
+
+    Vector3D<float> point = Vector3D<float>(position[0], position[1], position[2]);
+    return this->mesh->pointIsInsideMesh(point);
+}
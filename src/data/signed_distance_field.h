@@ -0,0 +1,135 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "data/mesh.h"
+
+/// The signed distance to the surface of a mesh, sampled on a regular grid
+/// around it and interpolated trilinearly in between. The distance is
+/// negative inside the mesh and positive outside. The samples are exact
+/// distances, and as the distance changes by at most the distance moved,
+/// the interpolation is off by at most the diagonal of a cell. Inside a
+/// cell the surface does not pass through, the sign is the same as at its
+/// corners, so points are classified by the cell they are in. Only the
+/// cells close to the surface are tested against the mesh.
+class SignedDistanceField {
+private:
+    /// @var mesh Mesh* The mesh the distance is sampled from
+    Mesh* mesh;
+
+    /// @var resolution int The number of cells along the longest side of
+    ///     the bounding box of the mesh
+    int resolution;
+
+    /// @var nrOfPoints int* The number of grid points in x, y and z
+    ///     direction
+    int* nrOfPoints;
+
+    /// @var origin float* The position of the first grid point
+    float* origin;
+
+    /// @var cellSize float The distance between neighboring grid points
+    float cellSize;
+
+    /// @var distances std::vector<float> The signed distance at each grid
+    ///     point, with x changing fastest
+    std::vector<float> distances;
+
+    /// @var exactCells std::vector<char> If the points in each cell have to
+    ///     be tested against the mesh, with x changing fastest. These are
+    ///     the cells with a corner closer to the surface than the diagonal
+    ///     of a cell, or with corners of both signs, which a mesh that is
+    ///     not closed can have away from its surface
+    std::vector<char> exactCells;
+
+    /// Finds the cells that have to be tested against the mesh from the
+    /// sampled distances.
+    void findExactCells();
+
+    /// Returns the sampled distance at the given grid point.
+    ///
+    /// @param x int The index of the point in x direction
+    /// @param y int The index of the point in y direction
+    /// @param z int The index of the point in z direction
+    /// @return float The signed distance
+    float getValue(int x, int y, int z) {
+        return this->distances[((size_t)z * this->nrOfPoints[1] + y) * this->nrOfPoints[0] + x];
+    }
+
+public:
+    /// Constructor. Places the grid around the bounding box of the mesh with
+    /// a margin of two cells, but does not sample the distance yet.
+    ///
+    /// @param mesh Mesh* The mesh, which must not change while the field
+    ///     is used
+    /// @param resolution int The number of cells along the longest side of
+    ///     the bounding box of the mesh
+    SignedDistanceField(Mesh* mesh, int resolution);
+
+    ~SignedDistanceField();
+
+    /// The grid belongs to one field only
+    SignedDistanceField(const SignedDistanceField&) = delete;
+    SignedDistanceField& operator=(const SignedDistanceField&) = delete;
+
+    /// Samples the distance at all grid points. The layers of the grid are
+    /// distributed over the threads.
+    ///
+    /// @param nrOfThreads int The number of threads sampling the distance
+    void build(int nrOfThreads);
+
+    /// Returns a hash of the vertices and faces of the mesh and the
+    /// resolution, which identifies the field in the cache.
+    ///
+    /// @return uint64_t The hash
+    uint64_t getKey();
+
+    /// Reads the sampled distances from the given file, if it was written
+    /// for the same mesh and resolution.
+    ///
+    /// @param filename std::string The name of the file
+    /// @return bool If the distances were read
+    bool load(std::string filename);
+
+    /// Writes the sampled distances to the given file.
+    ///
+    /// @param filename std::string The name of the file
+    /// @return bool If the file was written
+    bool save(std::string filename);
+
+    /// Returns the interpolated signed distance at the given position. Outside
+    /// of the grid the distance to the grid is added to the distance at the
+    /// closest point of the grid.
+    ///
+    /// @param position float* The position (3 dimensional)
+    /// @return float The signed distance, negative inside the mesh
+    float distance(float* position);
+
+    /// Calculates the direction in which the distance increases the most at
+    /// the given position, which near the surface is its outward normal.
+    ///
+    /// @param position float* The position (3 dimensional)
+    /// @param ret float* Output vector (3 dimensional), which is normalized
+    ///     unless the distance is the same all around
+    void normal(float* position, float* ret);
+
+    /// Returns if the given position is inside the mesh. This is the sign at
+    /// the corners of the cell the position is in, unless the cell is too
+    /// close to the surface or the position is outside of the grid, in
+    /// which case the mesh is tested.
+    ///
+    /// @param position float* The position (3 dimensional)
+    /// @return bool If the position is inside
+    bool pointIsInside(float* position);
+
+    int* getNrOfPoints() {return this->nrOfPoints;}
+
+    float getCellSize() {return this->cellSize;}
+
+    /// Returns the memory taken by the sampled distances and the cells.
+    ///
+    /// @return size_t The number of bytes
+    size_t getMemory() {return this->distances.size() * sizeof(float) + this->exactCells.size();}
+};
@@ -0,0 +1,157 @@
+#include "data/verlet_list.h"
+#include <omp.h>
+#include <cmath>
+#include <algorithm>
+
+VerletList::VerletList(float h, float skin, int N) {
+    this->N = N;
+    this->skin = skin;
+    this->cutoff = h + skin;
+    this->offsets = new int[N + 1];
+    this->referencePositions = new float[3 * N];
+    this->neighbors = std::vector<int>();
+    this->threadLists = std::vector<std::vector<int>>();
+    this->threadMaxima = std::vector<float>();
+    this->nrOfBuilds = 0;
+    this->nrOfChecks = 0;
+    this->maxDisplacement = 0.f;
+}
+
+VerletList::~VerletList() {
+    delete[] this->offsets;
+    delete[] this->referencePositions;
+}
+
+bool VerletList::needsRebuild(float* positions, ParallelBounds& pBounds) {
+    bool rebuild = false;
+
+    #pragma omp parallel
+    {
+        bool threadRebuild = this->needsRebuildInRegion(positions, pBounds, omp_get_thread_num());
+
+        #pragma omp master
+        rebuild = threadRebuild;
+    }
+
+    return rebuild;
+}
+
+bool VerletList::needsRebuildInRegion(float* positions, ParallelBounds& pBounds, int threadNum) {
+    #pragma omp single
+    {
+        this->nrOfChecks++;
+        this->threadMaxima.assign(pBounds.getNrOfThreads(), 0.f);
+    }
+
+    if (this->nrOfBuilds == 0) {
+        return true;
+    }
+
+    float maximum = 0.f;
+
+    for (int i = pBounds.lower(threadNum); i < pBounds.upper(threadNum); i++) {
+        float dx = positions[i * 3] - this->referencePositions[i * 3];
+        float dy = positions[i * 3 + 1] - this->referencePositions[i * 3 + 1];
+        float dz = positions[i * 3 + 2] - this->referencePositions[i * 3 + 2];
+        maximum = std::max(maximum, dx * dx + dy * dy + dz * dz);
+    }
+
+    this->threadMaxima[threadNum] = maximum;
+
+    #pragma omp barrier
+
+    // every thread finds the same maximum, so all of them return the same
+    maximum = *std::max_element(this->threadMaxima.begin(), this->threadMaxima.end());
+    float displacement = std::sqrt(maximum);
+
+    #pragma omp master
+    this->maxDisplacement = displacement;
+
+    return displacement > 0.5f * this->skin;
+}
+
+void VerletList::build(float* positions, Neighbors& grid, ParallelBounds& pBounds) {
+    #pragma omp parallel
+    this->buildInRegion(positions, grid, pBounds, omp_get_thread_num());
+}
+
+void VerletList::buildInRegion(float* positions, Neighbors& grid, ParallelBounds& pBounds, int threadNum) {
+    int T = pBounds.getNrOfThreads();
+    float cutoff2 = this->cutoff * this->cutoff;
+
+    #pragma omp single
+    if ((int)this->threadLists.size() != T) {
+        this->threadLists = std::vector<std::vector<int>>(T);
+    }
+
+    // each thread builds the lists of its particles into its own buffer and
+    // counts the list lengths. the buffers keep their capacity between builds
+    std::vector<int>& list = this->threadLists[threadNum];
+    std::vector<int> candidates = std::vector<int>();
+    list.clear();
+
+    for (int i = pBounds.lower(threadNum); i < pBounds.upper(threadNum); i++) {
+        candidates.clear();
+        grid.getNeighbors(i, candidates);
+
+        int count = 0;
+        for (unsigned int k = 0; k < candidates.size(); k++) {
+            int j = candidates[k];
+            float dx = positions[i * 3] - positions[j * 3];
+            float dy = positions[i * 3 + 1] - positions[j * 3 + 1];
+            float dz = positions[i * 3 + 2] - positions[j * 3 + 2];
+
+            if (dx * dx + dy * dy + dz * dz <= cutoff2) {
+                list.push_back(j);
+                count++;
+            }
+        }
+
+        this->offsets[i + 1] = count;
+        this->referencePositions[i * 3] = positions[i * 3];
+        this->referencePositions[i * 3 + 1] = positions[i * 3 + 1];
+        this->referencePositions[i * 3 + 2] = positions[i * 3 + 2];
+    }
+
+    #pragma omp barrier
+
+    // prefix sum over the list lengths, which is cheap compared to building
+    // the lists, so it is done by one thread
+    #pragma omp single
+    {
+        this->offsets[0] = 0;
+        for (int i = 0; i < this->N; i++) {
+            this->offsets[i + 1] += this->offsets[i];
+        }
+
+        this->neighbors.resize(this->offsets[this->N]);
+        this->nrOfBuilds++;
+    }
+
+    std::copy(list.begin(), list.end(), this->neighbors.begin() + this->offsets[pBounds.lower(threadNum)]);
+
+    #pragma omp barrier
+}
+
+void VerletList::saveTo(CheckpointWriter& writer) {
+    writer.add("verlet_offsets", this->offsets, (this->N + 1) * sizeof(int));
+    writer.add("verlet_neighbors", this->neighbors.data(), this->neighbors.size() * sizeof(int));
+    writer.add("verlet_reference", this->referencePositions, 3 * this->N * sizeof(float));
+    writer.addValue("verlet_builds", this->nrOfBuilds);
+    writer.addValue("verlet_checks", this->nrOfChecks);
+}
+
+bool VerletList::loadFrom(CheckpointReader& reader) {
+    size_t bytes = 0;
+    if (!reader.read("verlet_offsets", this->offsets, (this->N + 1) * sizeof(int))
+            || reader.find("verlet_neighbors", bytes) == NULL) {
+        return false;
+    }
+
+    this->neighbors.resize(bytes / sizeof(int));
+
+    return reader.read("verlet_neighbors", this->neighbors.data(), bytes)
+        && reader.read("verlet_reference", this->referencePositions, 3 * this->N * sizeof(float))
+        && reader.readValue("verlet_builds", this->nrOfBuilds)
+        && reader.readValue("verlet_checks", this->nrOfChecks);
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <vector>
+#include "data/neighbors.h"
+#include "util/parallel_bounds.h"
+#include "util/checkpoint.h"
+
+class VerletList {
+private:
+    /// @var N int The number of particles
+    int N;
+
+    /// @var cutoff float The radius within which particles are listed as
+    ///     neighbors, which is the smoothing length plus the skin
+    float cutoff;
+
+    /// @var skin float The additional radius beyond the smoothing length
+    float skin;
+
+    /// @var offsets int* The start of the list of each particle within
+    ///     neighbors, with N+1 entries so the list of particle i ends at
+    ///     offsets[i + 1]
+    int* offsets;
+
+    /// @var neighbors std::vector<int> The concatenated neighbor lists
+    std::vector<int> neighbors;
+
+    /// @var threadLists std::vector<std::vector<int>> The lists of the
+    ///     particles of each thread, which are built independently and then
+    ///     copied into neighbors
+    std::vector<std::vector<int>> threadLists;
+
+    /// @var threadMaxima std::vector<float> The maximum squared displacement
+    ///     found by each thread
+    std::vector<float> threadMaxima;
+
+    /// @var referencePositions float* The particle positions at the time the
+    ///     lists were built
+    float* referencePositions;
+
+    /// @var nrOfBuilds int The number of times the lists were built
+    int nrOfBuilds;
+
+    /// @var nrOfChecks int The number of times the lists were checked for
+    ///     the need to rebuild them
+    int nrOfChecks;
+
+    /// @var maxDisplacement float The maximum displacement found during the
+    ///     last check
+    float maxDisplacement;
+
+public:
+    /// Constructor.
+    ///
+    /// @param h float The smoothing length
+    /// @param skin float The additional radius beyond the smoothing length
+    ///     within which particles are listed as neighbors
+    /// @param N int The number of particles
+    VerletList(float h, float skin, int N);
+
+    ~VerletList();
+
+    /// Checks if any particle has moved more than half the skin since the
+    /// lists were last built, in which case a particle outside the lists
+    /// might have come within the smoothing length and the lists have to be
+    /// built again. Always true before the first build.
+    ///
+    /// @param positions float* The particle positions
+    /// @param pBounds ParallelBounds& The iteration bounds of the particles
+    /// @return bool If the lists need to be built again
+    bool needsRebuild(float* positions, ParallelBounds& pBounds);
+
+    /// Same as needsRebuild, but must be called by all threads of an
+    /// enclosing parallel region instead of starting its own. Returns the
+    /// same for all threads.
+    ///
+    /// @param positions float* The particle positions
+    /// @param pBounds ParallelBounds& The iteration bounds of the particles
+    /// @param threadNum int The thread number of the calling thread
+    /// @return bool If the lists need to be built again
+    bool needsRebuildInRegion(float* positions, ParallelBounds& pBounds, int threadNum);
+
+    /// Builds the neighbor lists of all particles from the given grid, which
+    /// must have been sorted with the given positions and use cells of at
+    /// least the size of the cutoff radius.
+    ///
+    /// @param positions float* The particle positions
+    /// @param grid Neighbors& The neighbor grid
+    /// @param pBounds ParallelBounds& The iteration bounds of the particles
+    void build(float* positions, Neighbors& grid, ParallelBounds& pBounds);
+
+    /// Same as build, but must be called by all threads of an enclosing
+    /// parallel region instead of starting its own. The lists are complete
+    /// for all threads once this returns.
+    ///
+    /// @param positions float* The particle positions
+    /// @param grid Neighbors& The neighbor grid
+    /// @param pBounds ParallelBounds& The iteration bounds of the particles
+    /// @param threadNum int The thread number of the calling thread
+    void buildInRegion(float* positions, Neighbors& grid, ParallelBounds& pBounds, int threadNum);
+
+    /// Returns the neighbor list of the given particle. The list includes the
+    /// particle itself.
+    ///
+    /// @param idx int The index of the particle
+    /// @return int* The first neighbor of the particle
+    int* getNeighbors(int idx) {return this->neighbors.data() + this->offsets[idx];}
+
+    /// Returns the length of the neighbor list of the given particle.
+    ///
+    /// @param idx int The index of the particle
+    /// @return int The number of neighbors of the particle
+    int getNrOfNeighbors(int idx) {return this->offsets[idx + 1] - this->offsets[idx];}
+
+    /// Adds the lists and the reference positions to the given checkpoint,
+    /// so they can be restored instead of being built again, which might
+    /// change the order of the neighbors.
+    ///
+    /// @param writer CheckpointWriter& The checkpoint
+    void saveTo(CheckpointWriter& writer);
+
+    /// Restores the lists and the reference positions from the given
+    /// checkpoint.
+    ///
+    /// @param reader CheckpointReader& The checkpoint
+    /// @return bool If the checkpoint contained lists for as many particles
+    bool loadFrom(CheckpointReader& reader);
+
+    int getNrOfBuilds() {return this->nrOfBuilds;}
+    int getNrOfChecks() {return this->nrOfChecks;}
+    float getMaxDisplacement() {return this->maxDisplacement;}
+};
@@ -9,6 +9,7 @@ Domain::Domain(DomainType type, YAML::Node& params) {
 	this->size = new float[3];
 	this->offset = new float[3];
 	this->boundingBox = new float[6];
+	this->distanceField = NULL;
 
 	float tmp[3] = {
 		params["offset_x"].as<float>(),
@@ -83,6 +84,10 @@ DomainType Domain::getType() {
 
 void Domain::setMesh(Mesh* mesh) {
 	this->mesh = mesh;
+
+	// the points may be tested by several threads at once
+	this->mesh->prepare();
+
 	float* box = this->mesh->getBoundingBox();
 	this->boundingBox[0] = box[0];
 	this->boundingBox[1] = box[1];
@@ -96,6 +101,14 @@ Mesh* Domain::getMesh() {
 	return this->mesh;
 }
 
+void Domain::setDistanceField(SignedDistanceField* field) {
+	this->distanceField = field;
+}
+
+SignedDistanceField* Domain::getDistanceField() {
+	return this->distanceField;
+}
+
 float Domain::getVolume() {
 	if (this->dtype == DomainType::Cube) {
 		return this->size[0] * this->size[1] * this->size[2];
@@ -134,6 +147,12 @@ bool Domain::pointIsInDomain(float* position) {
 		return sum <= 1.0;
 
 	} else if (this->dtype == DomainType::Mesh) {
+		// the distance field only tests the points close to the surface
+		// against the mesh
+		if (this->distanceField != NULL) {
+			return this->distanceField->pointIsInside(position);
+		}
+
 		Vector3D<float> pos = Vector3D<float>(position[0], position[1], position[2]);
 		return this->mesh->pointIsInsideMesh(pos);
 
@@ -2,6 +2,7 @@
 
 #include "distribution/distributionEnums.h"
 #include "data/mesh.h"
+#include "data/signed_distance_field.h"
 #include <yaml-cpp/yaml.h>
 
 class Domain {
@@ -11,6 +12,7 @@ private:
 	float* offset;
 	float* boundingBox;
 	Mesh* mesh;
+	SignedDistanceField* distanceField;
 
 	void setBoundingBox();
 
@@ -25,6 +27,8 @@ public:
 	DomainType getType();
 	void setMesh(Mesh* mesh);
 	Mesh* getMesh();
+	void setDistanceField(SignedDistanceField* field);
+	SignedDistanceField* getDistanceField();
 
 	float getVolume();
 
@@ -1,4 +1,8 @@
 #include "kernel/kernel.h"
+#include "kernel/cubic_spline.h"
+#include "kernel/poly_6.h"
+#include "kernel/spiky.h"
+#include "kernel/wendland.h"
 #include <cmath>
 
 Kernel::Kernel(float h, int N, float mass) {
@@ -28,4 +32,23 @@ float Kernel::InterpolateDensity(float rx, float ry, float rz, float* density, f
 void Kernel::SetH(float h) {
     _h = h;
     _fac1 = 1.0 / (h * h * h);
+    this->Precalculate();
+}
+
+void Kernel::SetN(int N) {
+    _N = N;
+}
+
+Kernel* Kernel::Create(std::string name, float h, int N, float mass) {
+    if (name == "poly6") {
+        return new Poly6(h, N, mass);
+    } else if (name == "spiky") {
+        return new Spiky(h, N, mass);
+    } else if (name == "wendland") {
+        return new Wendland(h, N, mass);
+    } else if (name == "cubic_spline") {
+        return new CubicSpline(h, N, mass);
+    }
+
+    return NULL;
 }
\ No newline at end of file
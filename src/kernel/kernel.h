@@ -1,5 +1,11 @@
 #pragma once
 
+#include <string>
+
+/// Base class of the SPH kernels. The kernels themselves are final and
+/// define the kernel functions in their headers, so code that knows the
+/// type of the kernel calls them without virtual dispatch and can inline
+/// them, see Compute.
 class Kernel {
 public:
     /// Constructor.
@@ -44,7 +50,39 @@ public:
     /// @param h float The new smoothing length.
     void SetH(float h);
 
+    /// Returns the smoothing length used by the kernel, beyond which it is
+    /// zero.
+    ///
+    /// @return float The smoothing length
+    float GetH() {return _h;}
+
+    /// Returns the mass of a particle.
+    ///
+    /// @return float The mass of a particle
+    float GetMass() {return _mass;}
+
+    /// Sets the number of particles to the given value.
+    ///
+    /// @param N int The new number of particles
+    void SetN(int N);
+
+    /// Creates the kernel with the given name, which is one of "poly6",
+    /// "spiky", "wendland" or "cubic_spline".
+    ///
+    /// @param name std::string The name of the kernel
+    /// @param h float The range factor for the kernel
+    /// @param N int The number of particles
+    /// @param mass float The mass of a particle
+    /// @return Kernel* The new kernel, or NULL if the name is unknown
+    static Kernel* Create(std::string name, float h, int N, float mass);
+
+    virtual ~Kernel() {}
+
 protected:
+    /// Calculates the factors of the kernel, which depend on the smoothing
+    /// length. Called by the constructors of the kernels and by SetH.
+    virtual void Precalculate() = 0;
+
     /// @var _h float The range factor used by the kernel
     float _h;
 
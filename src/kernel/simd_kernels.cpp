@@ -0,0 +1,391 @@
+#include "kernel/simd_kernels.h"
+#include <cmath>
+#include <cstdio>
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SPH_SIMD_X86
+#include <immintrin.h>
+#endif
+
+#ifdef SPH_SIMD_X86
+
+// The intrinsics start some vectors as undefined on purpose, which GCC
+// reports as uninitialized once they are inlined
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+// The vectorized functions are compiled for their instruction set only, so
+// the rest of the program does not require it and they are only called
+// after checking that the CPU supports it.
+
+__attribute__((target("avx2,fma")))
+static inline float horizontalSum(__m256 v) {
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    return _mm_cvtss_f32(sum);
+}
+
+/// Loads the next up to 8 candidates and sets the mask of the lanes in use.
+__attribute__((target("avx2,fma")))
+static inline __m256i loadCandidates(const int* list, int remaining, __m256& mask) {
+    if (remaining >= 8) {
+        mask = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        return _mm256_loadu_si256((const __m256i*)list);
+    }
+
+    __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i laneMask = _mm256_cmpgt_epi32(_mm256_set1_epi32(remaining), lanes);
+    mask = _mm256_castsi256_ps(laneMask);
+    return _mm256_maskload_epi32(list, laneMask);
+}
+
+__attribute__((target("avx2,fma")))
+static float densitySumAVX2(const SimdKernels::Constants& c, float* position,
+        int i, const int* list, int n) {
+    __m256 xi = _mm256_set1_ps(position[i * 3]);
+    __m256 yi = _mm256_set1_ps(position[i * 3 + 1]);
+    __m256 zi = _mm256_set1_ps(position[i * 3 + 2]);
+    __m256 h2 = _mm256_set1_ps(c.h2);
+    __m256 zero = _mm256_setzero_ps();
+    __m256 sum = zero;
+
+    for (int k = 0; k < n; k += 8) {
+        __m256 mask;
+        __m256i idx = loadCandidates(list + k, n - k, mask);
+        __m256i idx3 = _mm256_add_epi32(_mm256_add_epi32(idx, idx), idx);
+
+        __m256 dx = _mm256_sub_ps(xi, _mm256_mask_i32gather_ps(zero, position, idx3, mask, 4));
+        __m256 dy = _mm256_sub_ps(yi, _mm256_mask_i32gather_ps(zero, position + 1, idx3, mask, 4));
+        __m256 dz = _mm256_sub_ps(zi, _mm256_mask_i32gather_ps(zero, position + 2, idx3, mask, 4));
+        __m256 r2 = _mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dz, dz)));
+
+        // Poly6 only depends on the squared distance
+        __m256 inside = _mm256_and_ps(mask, _mm256_cmp_ps(r2, h2, _CMP_LE_OQ));
+        __m256 w = _mm256_sub_ps(h2, r2);
+        w = _mm256_mul_ps(w, _mm256_mul_ps(w, w));
+        sum = _mm256_add_ps(sum, _mm256_and_ps(inside, w));
+    }
+
+    return c.densityFactor * horizontalSum(sum);
+}
+
+__attribute__((target("avx2,fma")))
+static void addForcesAVX2(const SimdKernels::Constants& c, float* position, float* velocity,
+        float* density, float* pressure, int i, const int* list, int n, float* force) {
+    __m256 xi = _mm256_set1_ps(position[i * 3]);
+    __m256 yi = _mm256_set1_ps(position[i * 3 + 1]);
+    __m256 zi = _mm256_set1_ps(position[i * 3 + 2]);
+    __m256 vxi = _mm256_set1_ps(velocity[i * 3]);
+    __m256 vyi = _mm256_set1_ps(velocity[i * 3 + 1]);
+    __m256 vzi = _mm256_set1_ps(velocity[i * 3 + 2]);
+    __m256 pi = _mm256_set1_ps(pressure[i] / (density[i] * density[i]));
+    __m256i ii = _mm256_set1_epi32(i);
+
+    __m256 h = _mm256_set1_ps(c.h);
+    __m256 h2 = _mm256_set1_ps(c.h2);
+    __m256 invH = _mm256_set1_ps(c.invH);
+    __m256 minR = _mm256_set1_ps(c.minDistance);
+    __m256 eps = _mm256_set1_ps(c.viscosityEpsilon);
+    __m256 pFactor = _mm256_set1_ps(c.pressureFactor);
+    __m256 vFactor = _mm256_set1_ps(c.viscosityFactor);
+    __m256 one = _mm256_set1_ps(1.f);
+    __m256 half = _mm256_set1_ps(0.5f);
+    __m256 threeHalfs = _mm256_set1_ps(1.5f);
+    __m256 zero = _mm256_setzero_ps();
+    __m256 fx = zero, fy = zero, fz = zero;
+
+    for (int k = 0; k < n; k += 8) {
+        __m256 mask;
+        __m256i idx = loadCandidates(list + k, n - k, mask);
+        __m256i idx3 = _mm256_add_epi32(_mm256_add_epi32(idx, idx), idx);
+
+        __m256 dx = _mm256_sub_ps(xi, _mm256_mask_i32gather_ps(zero, position, idx3, mask, 4));
+        __m256 dy = _mm256_sub_ps(yi, _mm256_mask_i32gather_ps(zero, position + 1, idx3, mask, 4));
+        __m256 dz = _mm256_sub_ps(zi, _mm256_mask_i32gather_ps(zero, position + 2, idx3, mask, 4));
+        __m256 r2 = _mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dz, dz)));
+
+        // the particle itself has a distance of zero and is skipped as well
+        __m256 inside = _mm256_and_ps(mask, _mm256_and_ps(
+            _mm256_cmp_ps(r2, h2, _CMP_LT_OQ),
+            _mm256_cmp_ps(r2, zero, _CMP_GT_OQ)
+        ));
+
+        if (_mm256_movemask_ps(inside) == 0) {
+            continue;
+        }
+
+        // reciprocal square root with one Newton-Raphson step
+        __m256 invR = _mm256_rsqrt_ps(r2);
+        invR = _mm256_mul_ps(invR, _mm256_fnmadd_ps(
+            _mm256_mul_ps(half, r2), _mm256_mul_ps(invR, invR), threeHalfs));
+        __m256 r = _mm256_mul_ps(r2, invR);
+
+        __m256 rhoj = _mm256_mask_i32gather_ps(one, density, idx, inside, 4);
+        __m256 pj = _mm256_mask_i32gather_ps(zero, pressure, idx, inside, 4);
+
+        // Pressure force with the Spiky gradient
+        __m256 hr = _mm256_sub_ps(h, r);
+        __m256 pTerm = _mm256_add_ps(pi, _mm256_div_ps(pj, _mm256_mul_ps(rhoj, rhoj)));
+        __m256 pCoef = _mm256_mul_ps(pFactor, _mm256_mul_ps(pTerm, _mm256_mul_ps(_mm256_mul_ps(hr, hr), invR)));
+        pCoef = _mm256_and_ps(inside, pCoef);
+
+        // Viscosity force with the Wendland gradient. The pair force uses
+        // the density of the particle with the higher index, as
+        // Compute::AddPairForces does
+        __m256i idxMax = _mm256_max_epi32(idx, ii);
+        __m256 rhoMax = _mm256_mask_i32gather_ps(one, density, idxMax, inside, 4);
+        __m256 t = _mm256_fnmadd_ps(r, invH, one);
+        __m256 vCoef = _mm256_div_ps(
+            _mm256_mul_ps(vFactor, _mm256_mul_ps(t, _mm256_mul_ps(t, t))),
+            _mm256_mul_ps(rhoMax, _mm256_add_ps(r2, eps))
+        );
+        vCoef = _mm256_and_ps(_mm256_and_ps(inside, _mm256_cmp_ps(r, minR, _CMP_GE_OQ)), vCoef);
+
+        __m256 dvx = _mm256_sub_ps(vxi, _mm256_mask_i32gather_ps(zero, velocity, idx3, inside, 4));
+        __m256 dvy = _mm256_sub_ps(vyi, _mm256_mask_i32gather_ps(zero, velocity + 1, idx3, inside, 4));
+        __m256 dvz = _mm256_sub_ps(vzi, _mm256_mask_i32gather_ps(zero, velocity + 2, idx3, inside, 4));
+
+        fx = _mm256_fmadd_ps(dx, _mm256_fmadd_ps(_mm256_mul_ps(vCoef, dvx), dx, pCoef), fx);
+        fy = _mm256_fmadd_ps(dy, _mm256_fmadd_ps(_mm256_mul_ps(vCoef, dvy), dy, pCoef), fy);
+        fz = _mm256_fmadd_ps(dz, _mm256_fmadd_ps(_mm256_mul_ps(vCoef, dvz), dz, pCoef), fz);
+    }
+
+    force[0] += horizontalSum(fx);
+    force[1] += horizontalSum(fy);
+    force[2] += horizontalSum(fz);
+}
+
+/// Loads the next up to 16 candidates and returns the mask of the lanes in
+/// use.
+__attribute__((target("avx512f")))
+static inline __m512i loadCandidates16(const int* list, int remaining, __mmask16& mask) {
+    mask = remaining >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << remaining) - 1);
+    return _mm512_maskz_loadu_epi32(mask, list);
+}
+
+__attribute__((target("avx512f")))
+static float densitySumAVX512(const SimdKernels::Constants& c, float* position,
+        int i, const int* list, int n) {
+    __m512 xi = _mm512_set1_ps(position[i * 3]);
+    __m512 yi = _mm512_set1_ps(position[i * 3 + 1]);
+    __m512 zi = _mm512_set1_ps(position[i * 3 + 2]);
+    __m512 h2 = _mm512_set1_ps(c.h2);
+    __m512 zero = _mm512_setzero_ps();
+    __m512 sum = zero;
+
+    for (int k = 0; k < n; k += 16) {
+        __mmask16 mask;
+        __m512i idx = loadCandidates16(list + k, n - k, mask);
+        __m512i idx3 = _mm512_add_epi32(_mm512_add_epi32(idx, idx), idx);
+
+        __m512 dx = _mm512_sub_ps(xi, _mm512_mask_i32gather_ps(zero, mask, idx3, position, 4));
+        __m512 dy = _mm512_sub_ps(yi, _mm512_mask_i32gather_ps(zero, mask, idx3, position + 1, 4));
+        __m512 dz = _mm512_sub_ps(zi, _mm512_mask_i32gather_ps(zero, mask, idx3, position + 2, 4));
+        __m512 r2 = _mm512_fmadd_ps(dx, dx, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dz, dz)));
+
+        // Poly6 only depends on the squared distance
+        __mmask16 inside = _mm512_mask_cmp_ps_mask(mask, r2, h2, _CMP_LE_OQ);
+        __m512 w = _mm512_sub_ps(h2, r2);
+        w = _mm512_mul_ps(w, _mm512_mul_ps(w, w));
+        sum = _mm512_mask_add_ps(sum, inside, sum, w);
+    }
+
+    return c.densityFactor * _mm512_reduce_add_ps(sum);
+}
+
+__attribute__((target("avx512f")))
+static void addForcesAVX512(const SimdKernels::Constants& c, float* position, float* velocity,
+        float* density, float* pressure, int i, const int* list, int n, float* force) {
+    __m512 xi = _mm512_set1_ps(position[i * 3]);
+    __m512 yi = _mm512_set1_ps(position[i * 3 + 1]);
+    __m512 zi = _mm512_set1_ps(position[i * 3 + 2]);
+    __m512 vxi = _mm512_set1_ps(velocity[i * 3]);
+    __m512 vyi = _mm512_set1_ps(velocity[i * 3 + 1]);
+    __m512 vzi = _mm512_set1_ps(velocity[i * 3 + 2]);
+    __m512 pi = _mm512_set1_ps(pressure[i] / (density[i] * density[i]));
+    __m512i ii = _mm512_set1_epi32(i);
+
+    __m512 h = _mm512_set1_ps(c.h);
+    __m512 h2 = _mm512_set1_ps(c.h2);
+    __m512 invH = _mm512_set1_ps(c.invH);
+    __m512 minR = _mm512_set1_ps(c.minDistance);
+    __m512 eps = _mm512_set1_ps(c.viscosityEpsilon);
+    __m512 pFactor = _mm512_set1_ps(c.pressureFactor);
+    __m512 vFactor = _mm512_set1_ps(c.viscosityFactor);
+    __m512 one = _mm512_set1_ps(1.f);
+    __m512 half = _mm512_set1_ps(0.5f);
+    __m512 threeHalfs = _mm512_set1_ps(1.5f);
+    __m512 zero = _mm512_setzero_ps();
+    __m512 fx = zero, fy = zero, fz = zero;
+
+    for (int k = 0; k < n; k += 16) {
+        __mmask16 mask;
+        __m512i idx = loadCandidates16(list + k, n - k, mask);
+        __m512i idx3 = _mm512_add_epi32(_mm512_add_epi32(idx, idx), idx);
+
+        __m512 dx = _mm512_sub_ps(xi, _mm512_mask_i32gather_ps(zero, mask, idx3, position, 4));
+        __m512 dy = _mm512_sub_ps(yi, _mm512_mask_i32gather_ps(zero, mask, idx3, position + 1, 4));
+        __m512 dz = _mm512_sub_ps(zi, _mm512_mask_i32gather_ps(zero, mask, idx3, position + 2, 4));
+        __m512 r2 = _mm512_fmadd_ps(dx, dx, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dz, dz)));
+
+        // the particle itself has a distance of zero and is skipped as well
+        __mmask16 inside = _mm512_mask_cmp_ps_mask(
+            _mm512_mask_cmp_ps_mask(mask, r2, h2, _CMP_LT_OQ), r2, zero, _CMP_GT_OQ);
+
+        if (inside == 0) {
+            continue;
+        }
+
+        // reciprocal square root with one Newton-Raphson step
+        __m512 invR = _mm512_maskz_rsqrt14_ps(inside, r2);
+        invR = _mm512_mul_ps(invR, _mm512_fnmadd_ps(
+            _mm512_mul_ps(half, r2), _mm512_mul_ps(invR, invR), threeHalfs));
+        __m512 r = _mm512_mul_ps(r2, invR);
+
+        __m512 rhoj = _mm512_mask_i32gather_ps(one, inside, idx, density, 4);
+        __m512 pj = _mm512_mask_i32gather_ps(zero, inside, idx, pressure, 4);
+
+        // Pressure force with the Spiky gradient
+        __m512 hr = _mm512_sub_ps(h, r);
+        __m512 pTerm = _mm512_add_ps(pi, _mm512_div_ps(pj, _mm512_mul_ps(rhoj, rhoj)));
+        __m512 pCoef = _mm512_maskz_mul_ps(inside, pFactor,
+            _mm512_mul_ps(pTerm, _mm512_mul_ps(_mm512_mul_ps(hr, hr), invR)));
+
+        // Viscosity force with the Wendland gradient. The pair force uses
+        // the density of the particle with the higher index, as
+        // Compute::AddPairForces does
+        __m512i idxMax = _mm512_max_epi32(idx, ii);
+        __m512 rhoMax = _mm512_mask_i32gather_ps(one, inside, idxMax, density, 4);
+        __m512 t = _mm512_fnmadd_ps(r, invH, one);
+        __mmask16 viscous = _mm512_mask_cmp_ps_mask(inside, r, minR, _CMP_GE_OQ);
+        __m512 vCoef = _mm512_maskz_div_ps(viscous,
+            _mm512_mul_ps(vFactor, _mm512_mul_ps(t, _mm512_mul_ps(t, t))),
+            _mm512_mul_ps(rhoMax, _mm512_add_ps(r2, eps))
+        );
+
+        __m512 dvx = _mm512_sub_ps(vxi, _mm512_mask_i32gather_ps(zero, inside, idx3, velocity, 4));
+        __m512 dvy = _mm512_sub_ps(vyi, _mm512_mask_i32gather_ps(zero, inside, idx3, velocity + 1, 4));
+        __m512 dvz = _mm512_sub_ps(vzi, _mm512_mask_i32gather_ps(zero, inside, idx3, velocity + 2, 4));
+
+        fx = _mm512_fmadd_ps(dx, _mm512_fmadd_ps(_mm512_mul_ps(vCoef, dvx), dx, pCoef), fx);
+        fy = _mm512_fmadd_ps(dy, _mm512_fmadd_ps(_mm512_mul_ps(vCoef, dvy), dy, pCoef), fy);
+        fz = _mm512_fmadd_ps(dz, _mm512_fmadd_ps(_mm512_mul_ps(vCoef, dvz), dz, pCoef), fz);
+    }
+
+    force[0] += _mm512_reduce_add_ps(fx);
+    force[1] += _mm512_reduce_add_ps(fy);
+    force[2] += _mm512_reduce_add_ps(fz);
+}
+
+#pragma GCC diagnostic pop
+
+#endif
+
+SimdKernels::SimdKernels(std::string mode, float h, float mass, float mu, float epsilon) {
+    _constants.h = h;
+    _constants.h2 = h * h;
+    _constants.invH = 1.f / h;
+    _constants.densityFactor = mass * 315.f / (64.f * M_PI * std::pow(h, 9));
+    _constants.pressureFactor = mass * mass * 45.f / (M_PI * std::pow(h, 6));
+    _constants.viscosityFactor = 2.f * mass * mass * mu * -210.f / (M_PI * std::pow(h, 5));
+    _constants.viscosityEpsilon = epsilon * h * h;
+    _constants.minDistance = 0.00005f * h;
+
+    _level = SIMD_NONE;
+
+#ifdef SPH_SIMD_X86
+    __builtin_cpu_init();
+    bool hasAVX2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    bool hasAVX512 = __builtin_cpu_supports("avx512f");
+
+    if ((mode == "auto" || mode == "avx512") && hasAVX512) {
+        _level = SIMD_AVX512;
+    } else if ((mode == "auto" || mode == "avx512" || mode == "avx2") && hasAVX2) {
+        _level = SIMD_AVX2;
+    }
+#endif
+
+    if (mode != "auto" && mode != "off" && _level == SIMD_NONE) {
+        printf("Vectorized kernels with %s are not supported on this CPU\n", mode.c_str());
+    }
+}
+
+const char* SimdKernels::GetLevelName() {
+    switch (_level) {
+        case SIMD_AVX512: return "avx512";
+        case SIMD_AVX2: return "avx2";
+        default: return "off";
+    }
+}
+
+float SimdKernels::DensitySum(float* position, int i, const int* list, int n) {
+#ifdef SPH_SIMD_X86
+    if (_level == SIMD_AVX512) {
+        return densitySumAVX512(_constants, position, i, list, n);
+    } else if (_level == SIMD_AVX2) {
+        return densitySumAVX2(_constants, position, i, list, n);
+    }
+#endif
+
+    // scalar fallback with the same kernel polynomials
+    float sum = 0.f;
+    for (int k = 0; k < n; k++) {
+        int j = list[k];
+        float dx = position[i * 3] - position[j * 3];
+        float dy = position[i * 3 + 1] - position[j * 3 + 1];
+        float dz = position[i * 3 + 2] - position[j * 3 + 2];
+        float w = _constants.h2 - (dx * dx + dy * dy + dz * dz);
+
+        if (w >= 0.f) {
+            sum += w * w * w;
+        }
+    }
+
+    return _constants.densityFactor * sum;
+}
+
+void SimdKernels::AddForces(float* position, float* velocity, float* density, float* pressure,
+        int i, const int* list, int n, float* force) {
+#ifdef SPH_SIMD_X86
+    if (_level == SIMD_AVX512) {
+        addForcesAVX512(_constants, position, velocity, density, pressure, i, list, n, force);
+        return;
+    } else if (_level == SIMD_AVX2) {
+        addForcesAVX2(_constants, position, velocity, density, pressure, i, list, n, force);
+        return;
+    }
+#endif
+
+    // scalar fallback with the same kernel polynomials
+    const Constants& c = _constants;
+    float pi = pressure[i] / (density[i] * density[i]);
+
+    for (int k = 0; k < n; k++) {
+        int j = list[k];
+        float dx = position[i * 3] - position[j * 3];
+        float dy = position[i * 3 + 1] - position[j * 3 + 1];
+        float dz = position[i * 3 + 2] - position[j * 3 + 2];
+        float r2 = dx * dx + dy * dy + dz * dz;
+
+        if (r2 >= c.h2 || r2 <= 0.f) {
+            continue;
+        }
+
+        float r = std::sqrt(r2);
+        float hr = c.h - r;
+        float pCoef = c.pressureFactor * (pi + pressure[j] / (density[j] * density[j])) * hr * hr / r;
+
+        float vCoef = 0.f;
+        if (r >= c.minDistance) {
+            float t = 1.f - r * c.invH;
+            vCoef = c.viscosityFactor * t * t * t / (density[std::max(i, j)] * (r2 + c.viscosityEpsilon));
+        }
+
+        force[0] += dx * (pCoef + vCoef * (velocity[i * 3] - velocity[j * 3]) * dx);
+        force[1] += dy * (pCoef + vCoef * (velocity[i * 3 + 1] - velocity[j * 3 + 1]) * dy);
+        force[2] += dz * (pCoef + vCoef * (velocity[i * 3 + 2] - velocity[j * 3 + 2]) * dz);
+    }
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <string>
+
+/// The instruction sets for which vectorized kernels exist
+enum SimdLevel {
+    SIMD_NONE,
+    SIMD_AVX2,
+    SIMD_AVX512
+};
+
+/// Vectorized density and force calculation for the kernel combination of
+/// Poly6 for density, Spiky for pressure and Wendland for viscosity. The
+/// kernel functions are built in as polynomials of the squared distance, so
+/// there are no virtual calls and the neighbor candidates are processed 8
+/// (AVX2) or 16 (AVX-512) at a time. Candidates beyond the smoothing length
+/// are masked out before any square root is taken. The instruction set is
+/// chosen at runtime by what the CPU supports, with a scalar fallback.
+class SimdKernels {
+public:
+    /// @var Constants The precalculated factors of the kernels
+    struct Constants {
+        float h;
+        float h2;
+        float invH;
+
+        /// @var densityFactor float Mass times the Poly6 normalization
+        float densityFactor;
+
+        /// @var pressureFactor float Squared mass times the negated Spiky
+        ///     gradient normalization
+        float pressureFactor;
+
+        /// @var viscosityFactor float Twice the squared mass times the
+        ///     viscosity times the Wendland gradient normalization
+        float viscosityFactor;
+
+        /// @var viscosityEpsilon float The term added to the squared
+        ///     distance in the viscosity force
+        float viscosityEpsilon;
+
+        /// @var minDistance float The distance below which the Wendland
+        ///     gradient is zero
+        float minDistance;
+    };
+
+    /// Constructor.
+    ///
+    /// @param mode std::string The requested instruction set, one of "auto",
+    ///     "avx512", "avx2" or "off". If the CPU does not support it, the
+    ///     next lower supported one is used
+    /// @param h float The smoothing length
+    /// @param mass float The mass of a particle
+    /// @param mu float The viscosity
+    /// @param epsilon float The viscosity regularization factor
+    SimdKernels(std::string mode, float h, float mass, float mu, float epsilon);
+
+    /// Returns if a vectorized instruction set is used. Otherwise only the
+    /// scalar fallback is available.
+    ///
+    /// @return bool If the vectorized kernels are available
+    bool IsEnabled() {return _level != SIMD_NONE;}
+
+    /// Returns the name of the instruction set in use.
+    ///
+    /// @return const char* The name of the instruction set
+    const char* GetLevelName();
+
+    /// Returns the density of particle i as the sum over the given
+    /// candidates, which include the particle itself.
+    ///
+    /// @param position float* The particle positions
+    /// @param i int The index of the particle
+    /// @param list const int* The neighbor candidates
+    /// @param n int The number of candidates
+    /// @return float The density of the particle
+    float DensitySum(float* position, int i, const int* list, int n);
+
+    /// Adds the pressure and viscosity forces of all given candidates on
+    /// particle i to the given force. Unlike Compute::AddPairForces only
+    /// particle i is written, so each pair is calculated twice, once for
+    /// each particle, but threads never write to the same particle.
+    ///
+    /// @param position float* The particle positions
+    /// @param velocity float* The particle velocities
+    /// @param density float* The particle densities
+    /// @param pressure float* The particle pressures
+    /// @param i int The index of the particle
+    /// @param list const int* The neighbor candidates
+    /// @param n int The number of candidates
+    /// @param force float* The force of the particle (3 dimensional)
+    void AddForces(float* position, float* velocity, float* density, float* pressure,
+        int i, const int* list, int n, float* force);
+
+private:
+    /// @var _level SimdLevel The instruction set in use
+    SimdLevel _level;
+
+    /// @var _constants Constants The precalculated factors of the kernels
+    Constants _constants;
+};
@@ -2,16 +2,45 @@
 
 #include "kernel/kernel.h"
 
-class Spiky: public Kernel {
+class Spiky final: public Kernel {
 private:
     float _fac2;
+
+    /// @var _valueFactor float The normalization of the kernel
+    float _valueFactor;
+
+    /// @var _gradientFactor float The normalization of the gradient
+    float _gradientFactor;
+
+protected:
+    /// @see Kernel::Precalculate
+    void Precalculate();
+
 public:
     /// @see Kernel::Kernel
     Spiky(float h, int N, float mass);
 
     /// @see Kernel::ValueOf
-    float ValueOf(float r);
+    float ValueOf(float r) {
+        if (r > _h) return 0.f;
+
+        float d = _h - r;
+        return _valueFactor * d * d * d;
+    }
 
     /// @see Kernel::FOD
-    void FOD(float rx, float ry, float rz, float r, float* ret);
+    void FOD(float rx, float ry, float rz, float r, float* ret) {
+        if (r >= _h) {
+            ret[0] = 0.f;
+            ret[1] = 0.f;
+            ret[2] = 0.f;
+            return;
+        }
+
+        float d = _h - r;
+        float magn = _gradientFactor * d * d / r;
+        ret[0] = magn * rx;
+        ret[1] = magn * ry;
+        ret[2] = magn * rz;
+    }
 };
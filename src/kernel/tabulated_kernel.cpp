@@ -0,0 +1,89 @@
+#include "kernel/kernel.h"
+#include "kernel/tabulated_kernel.h"
+#include <cmath>
+#include <cstdio>
+#include <algorithm>
+
+TabulatedKernel::TabulatedKernel(Kernel* source, float h, int N, float mass, int resolution, bool cubic)
+        : Kernel(h, N, mass) {
+    _source = source;
+    _resolution = std::max(resolution, 2);
+    _cubic = cubic;
+    this->Precalculate();
+}
+
+TabulatedKernel::~TabulatedKernel() {
+    delete _source;
+}
+
+void TabulatedKernel::Precalculate() {
+    _source->SetH(_h);
+
+    float spacing = _h * _h / _resolution;
+    _invSpacing = 1.f / spacing;
+
+    // one sample before the first and two after the last are needed for the
+    // cubic interpolation. beyond h the kernels are zero
+    _values = std::vector<float>(_resolution + 4);
+    _gradients = std::vector<float>(_resolution + 4);
+
+    float ret[3];
+    for (int k = 0; k <= _resolution + 2; k++) {
+        float r = std::sqrt(k * spacing);
+        _values[k + 1] = _source->ValueOf(r);
+
+        if (k > 0) {
+            _source->FOD(r, 0.f, 0.f, r, ret);
+            _gradients[k + 1] = ret[0] / r;
+        }
+    }
+
+    // the gradient divided by the distance is not defined at zero distance,
+    // so we continue it from the next samples
+    _gradients[1] = 2.f * _gradients[2] - _gradients[3];
+
+    _values[0] = 2.f * _values[1] - _values[2];
+    _gradients[0] = 2.f * _gradients[1] - _gradients[2];
+}
+
+void TabulatedKernel::PrintAccuracy(const char* name) {
+    int n = 10 * _resolution;
+    float maxValue = 0.f, maxGradient = 0.f;
+    float ret[3], tab[3];
+
+    // kernels with a kink or pole at zero distance can not be represented
+    // well by a function of the squared distance within the first interval,
+    // so the errors there are reported separately
+    float valueError[2] = {0.f, 0.f};
+    float gradientError[2] = {0.f, 0.f};
+
+    for (int k = 1; k < n; k++) {
+        float r = _h * k / n;
+        int range = r * r * _invSpacing < 1.f ? 1 : 0;
+
+        float value = _source->ValueOf(r);
+        maxValue = std::max(maxValue, std::fabs(value));
+        valueError[range] = std::max(valueError[range], std::fabs(value - this->ValueOf(r)));
+
+        _source->FOD(r, 0.f, 0.f, r, ret);
+        this->FOD(r, 0.f, 0.f, r, tab);
+        maxGradient = std::max(maxGradient, std::fabs(ret[0]));
+        gradientError[range] = std::max(gradientError[range], std::fabs(ret[0] - tab[0]));
+    }
+
+    for (int range = 0; range < 2; range++) {
+        valueError[range] = maxValue > 0.f ? valueError[range] / maxValue : 0.f;
+        gradientError[range] = maxGradient > 0.f ? gradientError[range] / maxGradient : 0.f;
+    }
+
+    printf("Tabulated %s kernel with %d %s intervals: max. relative error %e of value, "
+        "%e of gradient (%e and %e within the first interval)\n",
+        name,
+        _resolution,
+        _cubic ? "cubic" : "linear",
+        valueError[0],
+        gradientError[0],
+        valueError[1],
+        gradientError[1]
+    );
+}
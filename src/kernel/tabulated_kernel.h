@@ -0,0 +1,118 @@
+#pragma once
+
+#include "kernel/kernel.h"
+#include <vector>
+
+/// A kernel that looks up the values and gradients of another kernel in
+/// tables instead of evaluating it. The tables are indexed by the squared
+/// distance, so no square root is needed, and are interpolated linearly or
+/// with cubic (Catmull-Rom) interpolation.
+class TabulatedKernel final: public Kernel {
+private:
+    /// @var _source Kernel* The kernel that is tabulated. Owned by this
+    ///     kernel.
+    Kernel* _source;
+
+    /// @var _resolution int The number of intervals the squared distances
+    ///     from 0 to h*h are divided into
+    int _resolution;
+
+    /// @var _cubic bool Flag if the tables are interpolated cubically
+    ///     instead of linearly
+    bool _cubic;
+
+    /// @var _invSpacing float The inverse of the squared distance between
+    ///     two samples
+    float _invSpacing;
+
+    /// @var _values std::vector<float> The kernel values. Entry k + 1 is
+    ///     the value at the squared distance k / _invSpacing. The first and
+    ///     the last two entries are padding for the cubic interpolation.
+    std::vector<float> _values;
+
+    /// @var _gradients std::vector<float> The gradient magnitudes divided by
+    ///     the distance, so the gradient is the entry times the distance
+    ///     vector. Laid out like _values.
+    std::vector<float> _gradients;
+
+    /// Interpolates the given table at the given squared distance.
+    ///
+    /// @param table const std::vector<float>& The table
+    /// @param r2 float The squared distance, which must be less than h*h
+    /// @return float The interpolated value
+    float Interpolate(const std::vector<float>& table, float r2) {
+        float x = r2 * _invSpacing;
+        int k = (int)x;
+        float t = x - k;
+        const float* p = table.data() + k + 1;
+
+        if (!_cubic) {
+            return p[0] + t * (p[1] - p[0]);
+        }
+
+        return p[0] + 0.5f * t * (p[1] - p[-1]
+            + t * (2.f * p[-1] - 5.f * p[0] + 4.f * p[1] - p[2]
+            + t * (3.f * (p[0] - p[1]) + p[2] - p[-1])));
+    }
+
+protected:
+    /// @see Kernel::Precalculate
+    void Precalculate();
+
+public:
+    /// Constructor.
+    ///
+    /// @param source Kernel* The kernel to tabulate, which is deleted with
+    ///     this kernel
+    /// @param h float The range factor for the kernel
+    /// @param N int The number of particles
+    /// @param mass float The mass of a particle
+    /// @param resolution int The number of intervals of the tables
+    /// @param cubic bool Flag if the tables are interpolated cubically
+    ///     instead of linearly
+    TabulatedKernel(Kernel* source, float h, int N, float mass, int resolution, bool cubic);
+
+    ~TabulatedKernel();
+
+    /// Returns the value of the kernel at the given squared distance.
+    ///
+    /// @param r2 float The squared distance
+    /// @return float The value of the kernel function
+    float ValueOfSquared(float r2) {
+        if (r2 >= _h * _h) return 0.f;
+
+        return this->Interpolate(_values, r2);
+    }
+
+    /// @see Kernel::ValueOf
+    float ValueOf(float r) {
+        return this->ValueOfSquared(r * r);
+    }
+
+    /// @see Kernel::FOD
+    /// The distance r is not used, the squared distance is calculated from
+    /// the components instead.
+    void FOD(float rx, float ry, float rz, float r, float* ret) {
+        (void)r;
+        float r2 = rx * rx + ry * ry + rz * rz;
+
+        if (r2 >= _h * _h) {
+            ret[0] = 0.f;
+            ret[1] = 0.f;
+            ret[2] = 0.f;
+            return;
+        }
+
+        float magn = this->Interpolate(_gradients, r2);
+        ret[0] = magn * rx;
+        ret[1] = magn * ry;
+        ret[2] = magn * rz;
+    }
+
+    /// Compares the tables against the tabulated kernel at distances between
+    /// the samples and prints the largest errors of the values and of the
+    /// gradient magnitudes, relative to their largest magnitude.
+    ///
+    /// @param name const char* The name printed with the errors
+    void PrintAccuracy(const char* name);
+};
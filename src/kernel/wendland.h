@@ -2,16 +2,50 @@
 
 #include "kernel/kernel.h"
 
-class Wendland: public Kernel {
+class Wendland final: public Kernel {
 private:
     float _fac2;
+
+    /// @var _fac3 float The normalization of the kernel
+    float _fac3;
+
+protected:
+    /// @see Kernel::Precalculate
+    void Precalculate();
+
 public:
     /// @see Kernel::Kernel
     Wendland(float h, int N, float mass);
 
     /// @see Kernel::ValueOf
-    float ValueOf(float r);
+    float ValueOf(float r) {
+        const float q = r / (0.5f * _h);
+
+        if (q >= 2.f) return 0.f;
+
+        const float tmp = 1.f - 0.5 * q;
+
+        return _fac3 * tmp * tmp * tmp * tmp * (2.f * q + 1.f);
+    }
 
     /// @see Kernel::FOD
-    void FOD(float rx, float ry, float rz, float r, float* ret);
+    void FOD(float rx, float ry, float rz, float r, float* ret) {
+        const float q = r / (0.5f * _h);
+
+        if (q >= 2.f || q < 0.0001f) {
+            ret[0] = 0.f;
+            ret[1] = 0.f;
+            ret[2] = 0.f;
+            return;
+        }
+
+        float magn = 1.f - 0.5f * q;
+        const float h1 = 2.f / _h;
+        const float val = -5.f * q * magn * magn * magn * h1 / r;
+        magn = val * _fac3;
+
+        ret[0] = magn * rx;
+        ret[1] = magn * ry;
+        ret[2] = magn * rz;
+    }
 };
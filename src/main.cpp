@@ -1,13 +1,16 @@
 #include "output/debug_renderer.h"
-#include "kernel/cubic_spline.h"
-#include "kernel/poly_6.h"
-#include "kernel/spiky.h"
-#include "kernel/wendland.h"
+#include "kernel/kernel.h"
+#include "kernel/tabulated_kernel.h"
 #include "output/vtk.h"
+#include "output/vtk_particles.h"
+#include "output/trajectory.h"
+#include "output/surface_output.h"
 #include "output/ascii_output.h"
+#include "output/async_output.h"
 #include "simulation/compute.h"
 #include <yaml-cpp/yaml.h>
 #include <omp.h>
+#include <cstdlib>
 
 /// Checks if there has been a SDL_QUIT event since the last time SDL events
 /// were checked.
@@ -23,6 +26,42 @@ bool checkQuitSDLEvent(SDL_Event* event) {
     return false;
 }
 
+/// Creates the kernel named by the given parameter, which is tabulated if
+/// set by the parameters. Exits if the name is unknown.
+///
+/// @param param YAML::Node& The parameter object
+/// @param name std::string The name of the parameter
+/// @return Kernel* The kernel
+Kernel* createKernel(YAML::Node& param, std::string name) {
+    Kernel* kernel = Kernel::Create(
+        param[name].as<std::string>(),
+        param["h"].as<float>(),
+        param["N"].as<int>(),
+        param["mass"].as<float>()
+    );
+
+    if (kernel == NULL) {
+        printf("Unknown kernel %s for %s\n", param[name].as<std::string>().c_str(), name.c_str());
+        exit(1);
+    }
+
+    std::string table = param["kernel_table"].as<std::string>();
+    if (table == "linear" || table == "cubic") {
+        TabulatedKernel* tabulated = new TabulatedKernel(
+            kernel,
+            param["h"].as<float>(),
+            param["N"].as<int>(),
+            param["mass"].as<float>(),
+            param["kernel_table_resolution"].as<int>(),
+            table == "cubic"
+        );
+        tabulated->PrintAccuracy(param[name].as<std::string>().c_str());
+        kernel = tabulated;
+    }
+
+    return kernel;
+}
+
 void checkWriteBMPOutput(DebugRenderer& renderer, int timestep) {
     char filename[255];
     sprintf(filename, "output/bmp/%d.bmp", timestep);
@@ -100,18 +139,141 @@ int main() {
     printf("Calculated cubic volume is %f\n", 8.f * psize * psize * psize);
     printf("Calculated spheric volume is %f\n", 4.f / 3.f * M_PI * psize * psize * psize);
 
-    Poly6 kernel_d = Poly6(param["h"].as<float>(), param["N"].as<int>(), param["mass"].as<float>());
-    Spiky kernel_p = Spiky(param["h"].as<float>(), param["N"].as<int>(), param["mass"].as<float>());
-    Wendland kernel_v = Wendland(param["h"].as<float>(), param["N"].as<int>(), param["mass"].as<float>());
-    Compute compute = Compute(param, &kernel_d, &kernel_p, &kernel_v);
+    Kernel* kernel_d = createKernel(param, "kernel_density");
+    Kernel* kernel_p = createKernel(param, "kernel_pressure");
+    Kernel* kernel_v = createKernel(param, "kernel_viscosity");
+    Compute compute = Compute(param, kernel_d, kernel_p, kernel_v);
+
+    int vtkCells[3] = {
+        param["vtk_cells_x"].as<int>(),
+        param["vtk_cells_y"].as<int>(),
+        param["vtk_cells_z"].as<int>()
+    };
+    float vtkOffset[3] = {
+        param["vtk_offset_x"].as<float>(),
+        param["vtk_offset_y"].as<float>(),
+        param["vtk_offset_z"].as<float>()
+    };
+    float vtkSize[3] = {
+        param["vtk_size_x"].as<float>(),
+        param["vtk_size_y"].as<float>(),
+        param["vtk_size_z"].as<float>()
+    };
+    // The writers run in background threads next to the simulation, so they
+    // get threads of their own instead of those of the simulation. Without
+    // buffers the simulation waits for them and they can use its threads
+    int outputThreads = param["output_buffers"].as<int>() > 0
+        ? param["output_threads"].as<int>()
+        : nrOfThreads;
+
+    VTK vtk = VTK("output/vtk/", kernel_d, vtkCells, vtkOffset, vtkSize, outputThreads);
+    ASCIIOutput ascii = ASCIIOutput("output/ascii/", outputThreads);
+    VTKParticles vtp = VTKParticles(
+        "output/vtk/",
+        param["vtp_pieces"].as<int>() > 0 ? param["vtp_pieces"].as<int>() : outputThreads,
+        param["vtp_compress"].as<bool>()
+    );
+    TrajectoryWriter trajectory(
+        param["trajectory_file"].as<std::string>(),
+        param["trajectory_keyframe_interval"].as<int>(),
+        param["trajectory_position_precision"].as<float>(),
+        param["trajectory_density_precision"].as<float>(),
+        param["trajectory_pressure_precision"].as<float>(),
+        outputThreads
+    );
+
+    // a restarted run continues the trajectory of the run it restarts from
+    if (param["restart"].as<bool>() && param["write_trajectory"].as<bool>()) {
+        trajectory.Resume(compute.GetTime());
+    }
+
+    int surfaceCells[3] = {
+        param["surface_cells_x"].as<int>(),
+        param["surface_cells_y"].as<int>(),
+        param["surface_cells_z"].as<int>()
+    };
+    float surfaceOffset[3] = {
+        param["surface_offset_x"].as<float>(),
+        param["surface_offset_y"].as<float>(),
+        param["surface_offset_z"].as<float>()
+    };
+    float surfaceSize[3] = {
+        param["surface_size_x"].as<float>(),
+        param["surface_size_y"].as<float>(),
+        param["surface_size_z"].as<float>()
+    };
+    SurfaceOutput surface(
+        "output/surface/",
+        kernel_d,
+        surfaceCells,
+        surfaceOffset,
+        surfaceSize,
+        param["surface_iso_level"].as<float>(),
+        outputThreads
+    );
 
-    VTK vtk = VTK("output/vtk/", &kernel_d, 20);
-    ASCIIOutput ascii = ASCIIOutput("output/ascii/");
+    // The output of each step goes into files numbered by the step, so a
+    // restarted run continues the numbering instead of overwriting the files
+    // of the run it restarts from
+    int firstStep = compute.GetStepCount() + 1;
+    vtk.SetCount(firstStep);
+    vtp.SetCount(firstStep);
+    surface.SetCount(firstStep);
+    ascii.SetCount(firstStep);
+
+    // The output is written by background threads from snapshots of the
+    // particle data, so the simulation goes on meanwhile
+    AsyncOutput output(param["output_buffers"].as<int>());
+    if (param["write_vtk"].as<bool>()) {
+        output.AddWriter("VTK", [&vtk](OutputSnapshot& snapshot) {
+            return vtk.WriteDensity(snapshot.density.data(), snapshot.position.data(), snapshot.N);
+        });
+    }
+    if (param["write_vtp"].as<bool>()) {
+        output.AddWriter("VTP", [&vtp](OutputSnapshot& snapshot) {
+            return vtp.WriteParticles(
+                snapshot.position.data(),
+                snapshot.velocity.data(),
+                snapshot.density.data(),
+                snapshot.pressure.data(),
+                snapshot.ids.data(),
+                snapshot.N
+            );
+        });
+    }
+    if (param["write_trajectory"].as<bool>()) {
+        output.AddWriter("Trajectory", [&trajectory](OutputSnapshot& snapshot) {
+            return trajectory.WriteFrame(
+                snapshot.position.data(),
+                snapshot.density.data(),
+                snapshot.pressure.data(),
+                snapshot.ids.data(),
+                snapshot.N,
+                snapshot.time
+            );
+        });
+    }
+    if (param["write_surface"].as<bool>()) {
+        output.AddWriter("Surface", [&surface](OutputSnapshot& snapshot) {
+            return surface.WriteSurface(snapshot.density.data(), snapshot.position.data(), snapshot.N);
+        });
+    }
+    if (param["write_ascii"].as<bool>()) {
+        output.AddWriter("ASCII", [&ascii](OutputSnapshot& snapshot) {
+            return ascii.WriteParticleStatus(
+                snapshot.density.data(),
+                snapshot.position.data(),
+                snapshot.pressure.data(),
+                snapshot.ids.data(),
+                snapshot.N
+            );
+        });
+    }
 
     bool running = true;
     SDL_Event event;
-    float t = 0.0;
-    int step = 1;
+    float t = compute.GetTime();
+    int step = firstStep;
 
     drawDebugView(*renderer, compute, param);
 
@@ -119,18 +281,18 @@ int main() {
         printf("Current timestep %f; ", t);
         compute.Timestep();
 
-        if (param["write_vtk"].as<bool>()) {
-            printf("Write VTK output; ");
-            vtk.WriteDensity(compute.GetDensity(), compute.GetPosition());
-        }
-
-        if (param["write_ascii"].as<bool>()) {
-            printf("Write ASCII output; ");
-            ascii.WriteParticleStatus(
-                compute.GetDensity(),
+        if (param["write_vtk"].as<bool>() || param["write_vtp"].as<bool>()
+                || param["write_trajectory"].as<bool>() || param["write_surface"].as<bool>()
+                || param["write_ascii"].as<bool>()) {
+            printf("Write output; ");
+            output.Write(
                 compute.GetPosition(),
+                compute.GetVelocity(),
+                compute.GetDensity(),
                 compute.GetPressure(),
-                param
+                compute.GetParticleIds(),
+                param["N"].as<int>(),
+                compute.GetTime()
             );
         }
 
@@ -139,7 +301,8 @@ int main() {
             checkWriteBMPOutput(*renderer, step);
         }
 
-        t += param["dt"].as<float>();
+        t += compute.GetDt();
+        printf("dt: %f; ", compute.GetDt());
         step++;
 
         printf("\n");
@@ -147,7 +310,9 @@ int main() {
         running = !checkQuitSDLEvent(&event);
     }
 
+    output.Finish();
     printf("End of simulation\n");
+    output.PrintStatistics();
 
     while (running) {
         SDL_Delay(30);
@@ -155,6 +320,9 @@ int main() {
     }
 
     delete renderer;
+    delete kernel_d;
+    delete kernel_p;
+    delete kernel_v;
 
     return 0;
 }
\ No newline at end of file
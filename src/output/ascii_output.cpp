@@ -1,33 +1,151 @@
 #include "output/ascii_output.h"
+#include "util/parallel_bounds.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <string>
 
 using namespace std;
 
-ASCIIOutput::ASCIIOutput(string path) {
+/// The most characters a line of the particle status can take, which is
+/// five values of up to 48 characters plus the separators.
+static const int MAX_LINE_LENGTH = 256;
+
+/// Writes the given value as printf does with "%f", that is rounded to six
+/// decimals. A float has at most 24 significant bits, so the decimals of
+/// the exact value can be calculated with 64 bit integers and rounded
+/// exactly like printf, which rounds ties to even. Values of 2^63 or more,
+/// infinity and NaN are left to snprintf.
+///
+/// @param value float The value
+/// @param out char* Where to write the characters, at least 48
+/// @return int The number of characters written
+static int formatFixed(float value, char* out) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(float));
+
+    int exponent = (bits >> 23) & 0xff;
+    uint64_t mantissa = bits & 0x7fffff;
+
+    // the value is mantissa * 2^shift
+    int shift;
+    if (exponent == 0) {
+        shift = -149;
+    } else {
+        mantissa |= 0x800000;
+        shift = exponent - 150;
+    }
+
+    if (exponent == 0xff || shift > 39) {
+        return snprintf(out, 48, "%f", value);
+    }
+
+    uint64_t integer = 0;
+    uint64_t decimals = 0;
+
+    if (shift >= 0) {
+        integer = mantissa << shift;
+    } else if (shift > -64) {
+        int k = -shift;
+        uint64_t fraction = mantissa & ((uint64_t(1) << k) - 1);
+        integer = mantissa >> k;
+
+        // the fraction is less than 2^24, so its millionfold fits
+        uint64_t scaled = fraction * 1000000;
+        decimals = scaled >> k;
+        uint64_t remainder = scaled & ((uint64_t(1) << k) - 1);
+        uint64_t half = uint64_t(1) << (k - 1);
+
+        if (remainder > half || (remainder == half && (decimals & 1))) {
+            decimals++;
+            if (decimals == 1000000) {
+                decimals = 0;
+                integer++;
+            }
+        }
+    }
+
+    char* p = out;
+    if (bits >> 31) {
+        *p++ = '-';
+    }
+
+    char digits[20];
+    int nrOfDigits = 0;
+    do {
+        digits[nrOfDigits++] = '0' + integer % 10;
+        integer /= 10;
+    } while (integer > 0);
+
+    while (nrOfDigits > 0) {
+        *p++ = digits[--nrOfDigits];
+    }
+
+    *p++ = '.';
+    for (int k = 5; k >= 0; k--) {
+        p[k] = '0' + decimals % 10;
+        decimals /= 10;
+    }
+    p += 6;
+
+    return p - out;
+}
+
+ASCIIOutput::ASCIIOutput(string path, int nrOfThreads) {
     _path = path;
     _count = 1;
+    _nrOfThreads = std::max(1, nrOfThreads);
+    _buffers = std::vector<std::vector<char>>(_nrOfThreads);
 }
 
-void ASCIIOutput::WriteParticleStatus(float* density, float* position, float* pressure, YAML::Node& param) {
+long ASCIIOutput::WriteParticleStatus(float* density, float* position, float* pressure, int* ids, int N) {
+    // the position of each particle ID in the particle data
+    _order.resize(N);
+    for (int i = 0; i < N; i++) {
+        _order[ids[i]] = i;
+    }
+
+    // each thread formats the lines of a range of IDs into its own buffer
+    ParallelBounds pBounds = ParallelBounds(_nrOfThreads, N);
+
+    #pragma omp parallel for num_threads(_nrOfThreads)
+    for (int t = 0; t < _nrOfThreads; t++) {
+        std::vector<char>& buffer = _buffers[t];
+        buffer.resize((size_t)(pBounds.upper(t) - pBounds.lower(t)) * MAX_LINE_LENGTH);
+        char* p = buffer.data();
+
+        for (int k = pBounds.lower(t); k < pBounds.upper(t); k++) {
+            int i = _order[k];
+            p += formatFixed(position[i * 3], p);
+            *p++ = '\t';
+            p += formatFixed(position[i * 3 + 1], p);
+            *p++ = '\t';
+            p += formatFixed(position[i * 3 + 2], p);
+            *p++ = '\t';
+            p += formatFixed(density[i], p);
+            *p++ = '\t';
+            p += formatFixed(pressure[i], p);
+            *p++ = '\n';
+        }
+
+        buffer.resize(p - buffer.data());
+    }
+
     char* filename = new char[255];
     sprintf(filename, "%sfield_%i.dat", _path.c_str(), _count);
     FILE* handle = fopen(filename, "w");
-    delete filename;
+    delete[] filename;
 
     fprintf(handle, "x\ty\tz\tdensity\tpressure\n");
 
-    for (int i = 0; i < param["N"].as<int>(); i++) {
-        fprintf(
-            handle,
-            "%f\t%f\t%f\t%f\t%f\n",
-            position[i * 3],
-            position[i * 3 + 1],
-            position[i * 3 + 2],
-            density[i],
-            pressure[i]
-        );
+    for (int t = 0; t < _nrOfThreads; t++) {
+        fwrite(_buffers[t].data(), 1, _buffers[t].size(), handle);
     }
+
+    long bytes = ftell(handle);
     fclose(handle);
 
     _count++;
-}
\ No newline at end of file
+    return bytes;
+}
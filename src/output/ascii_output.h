@@ -1,7 +1,7 @@
 #pragma once
 
 #include <string>
-#include <yaml-cpp/yaml.h>
+#include <vector>
 
 using namespace std;
 
@@ -11,18 +11,30 @@ public:
     /// Constructor. Creates a new instance working in the given path.
     ///
     /// @param path string The path where the output files will be stored.
-    ASCIIOutput(string path);
+    /// @param nrOfThreads int The number of threads formatting the lines
+    ASCIIOutput(string path, int nrOfThreads);
 
     /// Writes the given particle status out to a CSV file, that is ASCII
     /// encoded. Each call since instantiation will increment the file
     /// names by one, so the files will be called field_1.dat, field_2.dat etc.
+    /// The particles are written in the order of their IDs, so each line
+    /// always belongs to the same particle regardless of how the particle
+    /// data is currently ordered. The values are written as with "%f" of
+    /// printf, but the lines are formatted in parallel into a buffer of each
+    /// thread, which are then written at once.
     ///
     /// @param density float* The particle densities
     /// @param position float* The particle positions
     /// @param pressure float* The particle pressures
-    /// @param param YAML::Node& The parameter object holding the simulation
-    ///   parameters.
-    void WriteParticleStatus(float* density, float* position, float* pressure, YAML::Node& param);
+    /// @param ids int* The particle IDs
+    /// @param N int The number of particles
+    /// @return long The number of bytes written
+    long WriteParticleStatus(float* density, float* position, float* pressure, int* ids, int N);
+
+    /// Sets the number of the next file, field_<count>.dat.
+    ///
+    /// @param count int The number of the next file
+    void SetCount(int count) {_count = count;}
 
 private:
     /// @var _path string The path where the data files will be stored.
@@ -30,4 +42,15 @@ private:
 
     /// @var _count int A counter for the number of files since instantiation.
     int _count;
+
+    /// @var _nrOfThreads int The number of threads formatting the lines
+    int _nrOfThreads;
+
+    /// @var _order std::vector<int> The position of each particle ID in the
+    ///   particle data
+    std::vector<int> _order;
+
+    /// @var _buffers std::vector<std::vector<char>> The formatted lines of
+    ///   each thread, which keep their memory between calls
+    std::vector<std::vector<char>> _buffers;
 };
@@ -0,0 +1,179 @@
+#include "output/async_output.h"
+#include <chrono>
+#include <cstdio>
+#include <algorithm>
+
+/// Returns the seconds since some fixed point in time.
+///
+/// @return double The current time in seconds
+static double now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+AsyncOutput::AsyncOutput(int nrOfBuffers) {
+    // without own threads a single buffer is enough
+    _asynchronous = nrOfBuffers > 0;
+    _buffers = std::vector<OutputSnapshot*>();
+    for (int k = 0; k < std::max(nrOfBuffers, 1); k++) {
+        _buffers.push_back(new OutputSnapshot());
+    }
+    _free = _buffers;
+
+    _writers = std::vector<Writer*>();
+    _stopping = false;
+    _nrOfSnapshots = 0;
+    _nrOfStalls = 0;
+    _stallTime = 0.0;
+}
+
+AsyncOutput::~AsyncOutput() {
+    this->Finish();
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _changed.notify_all();
+
+    for (size_t w = 0; w < _writers.size(); w++) {
+        if (_writers[w]->thread.joinable()) {
+            _writers[w]->thread.join();
+        }
+        delete _writers[w];
+    }
+
+    for (size_t k = 0; k < _buffers.size(); k++) {
+        delete _buffers[k];
+    }
+}
+
+void AsyncOutput::AddWriter(std::string name, OutputWriteFunction write) {
+    Writer* writer = new Writer();
+    writer->name = name;
+    writer->write = write;
+    writer->nrOfSnapshots = 0;
+    writer->bytes = 0;
+    writer->busyTime = 0.0;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _writers.push_back(writer);
+    }
+
+    if (_asynchronous) {
+        writer->thread = std::thread(&AsyncOutput::RunWriter, this, writer);
+    }
+}
+
+void AsyncOutput::Write(float* position, float* velocity, float* density, float* pressure, int* ids, int N, double time) {
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    // back-pressure: if the writers fall behind, the simulation waits until
+    // they finished one of the buffers
+    if (_free.empty()) {
+        double start = now();
+        _changed.wait(lock, [this] {return !_free.empty();});
+        _stallTime += now() - start;
+        _nrOfStalls++;
+    }
+
+    OutputSnapshot* snapshot = _free.back();
+    _free.pop_back();
+    _nrOfSnapshots++;
+    lock.unlock();
+
+    // no writer uses the buffer now, so it is filled without the lock. the
+    // vectors keep their memory, so after the first snapshots this is only
+    // copying
+    snapshot->N = N;
+    snapshot->time = time;
+    snapshot->position.assign(position, position + 3 * N);
+    snapshot->velocity.assign(velocity, velocity + 3 * N);
+    snapshot->density.assign(density, density + N);
+    snapshot->pressure.assign(pressure, pressure + N);
+    snapshot->ids.assign(ids, ids + N);
+
+    if (!_asynchronous) {
+        this->WriteNow(snapshot);
+        return;
+    }
+
+    lock.lock();
+    snapshot->pending = _writers.size();
+    if (_writers.empty()) {
+        _free.push_back(snapshot);
+    }
+    for (size_t w = 0; w < _writers.size(); w++) {
+        _writers[w]->queue.push_back(snapshot);
+    }
+    lock.unlock();
+    _changed.notify_all();
+}
+
+void AsyncOutput::WriteNow(OutputSnapshot* snapshot) {
+    for (size_t w = 0; w < _writers.size(); w++) {
+        double start = now();
+        long bytes = _writers[w]->write(*snapshot);
+        _writers[w]->busyTime += now() - start;
+        _writers[w]->bytes += bytes;
+        _writers[w]->nrOfSnapshots++;
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _free.push_back(snapshot);
+}
+
+void AsyncOutput::RunWriter(Writer* writer) {
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    while (true) {
+        _changed.wait(lock, [this, writer] {return _stopping || !writer->queue.empty();});
+        if (writer->queue.empty()) {
+            return;
+        }
+
+        OutputSnapshot* snapshot = writer->queue.front();
+        writer->queue.pop_front();
+        lock.unlock();
+
+        double start = now();
+        long bytes = writer->write(*snapshot);
+        double elapsed = now() - start;
+
+        lock.lock();
+        writer->busyTime += elapsed;
+        writer->bytes += bytes;
+        writer->nrOfSnapshots++;
+
+        // the last writer of a snapshot gives the buffer back
+        snapshot->pending--;
+        if (snapshot->pending == 0) {
+            _free.push_back(snapshot);
+        }
+        _changed.notify_all();
+    }
+}
+
+void AsyncOutput::Finish() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _changed.wait(lock, [this] {return _free.size() == _buffers.size();});
+}
+
+void AsyncOutput::PrintStatistics() {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    for (size_t w = 0; w < _writers.size(); w++) {
+        Writer* writer = _writers[w];
+        printf("Output %s: %d snapshots, %.1f MB in %.3f s (%.1f ms per snapshot, %.1f MB/s)\n",
+            writer->name.c_str(),
+            writer->nrOfSnapshots,
+            writer->bytes / 1e6,
+            writer->busyTime,
+            writer->nrOfSnapshots > 0 ? writer->busyTime * 1000.0 / writer->nrOfSnapshots : 0.0,
+            writer->busyTime > 0.0 ? writer->bytes / 1e6 / writer->busyTime : 0.0
+        );
+    }
+
+    printf("Output waited for free buffers for %d of %d snapshots, %.3f s in total\n",
+        _nrOfStalls, _nrOfSnapshots, _stallTime);
+}
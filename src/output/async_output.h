@@ -0,0 +1,148 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// A copy of the particle data to be written out, so the simulation can go
+/// on while the copy is written.
+struct OutputSnapshot {
+    /// @var N int The number of particles
+    int N;
+
+    /// @var time double The simulated time of the snapshot
+    double time;
+
+    /// @var position std::vector<float> The particle positions
+    std::vector<float> position;
+
+    /// @var velocity std::vector<float> The particle velocities
+    std::vector<float> velocity;
+
+    /// @var density std::vector<float> The particle densities
+    std::vector<float> density;
+
+    /// @var pressure std::vector<float> The particle pressures
+    std::vector<float> pressure;
+
+    /// @var ids std::vector<int> The particle IDs
+    std::vector<int> ids;
+
+    /// @var pending int The number of writers that did not write the
+    ///     snapshot yet
+    int pending;
+};
+
+/// A function writing a snapshot, which returns the number of bytes written.
+typedef std::function<long(OutputSnapshot&)> OutputWriteFunction;
+
+class AsyncOutput {
+public:
+    /// Constructor. Creates an output stage with the given number of
+    /// snapshot buffers. Each writer runs in its own thread and writes the
+    /// snapshots in the order they were taken. If all buffers are in use,
+    /// taking the next snapshot waits until one is written by all writers.
+    ///
+    /// @param nrOfBuffers int The number of snapshot buffers. With 0 the
+    ///     snapshots are written right away by the calling thread
+    AsyncOutput(int nrOfBuffers);
+
+    /// Destructor. Waits until all snapshots are written.
+    ~AsyncOutput();
+
+    AsyncOutput(const AsyncOutput&) = delete;
+    AsyncOutput& operator=(const AsyncOutput&) = delete;
+
+    /// Adds a writer, which is called for each following snapshot.
+    ///
+    /// @param name std::string The name of the writer for the statistics
+    /// @param write OutputWriteFunction The function writing a snapshot.
+    ///     Is called from the thread of the writer, so it must not use data
+    ///     that the simulation changes
+    void AddWriter(std::string name, OutputWriteFunction write);
+
+    /// Takes a snapshot of the given particle data and passes it to all
+    /// writers.
+    ///
+    /// @param position float* The particle positions
+    /// @param velocity float* The particle velocities
+    /// @param density float* The particle densities
+    /// @param pressure float* The particle pressures
+    /// @param ids int* The particle IDs
+    /// @param N int The number of particles
+    /// @param time double The simulated time
+    void Write(float* position, float* velocity, float* density, float* pressure, int* ids, int N, double time);
+
+    /// Waits until all snapshots taken so far are written.
+    void Finish();
+
+    /// Prints the number of snapshots, the bytes written and the throughput
+    /// of each writer and how long taking the snapshots had to wait.
+    void PrintStatistics();
+
+private:
+    struct Writer {
+        std::string name;
+        OutputWriteFunction write;
+        std::thread thread;
+
+        /// @var queue std::deque<OutputSnapshot*> The snapshots this writer
+        ///     has yet to write
+        std::deque<OutputSnapshot*> queue;
+
+        int nrOfSnapshots;
+        long bytes;
+        double busyTime;
+    };
+
+    /// Writes the snapshots queued for the given writer until the output
+    /// is stopped. Runs in the thread of the writer.
+    ///
+    /// @param writer Writer* The writer
+    void RunWriter(Writer* writer);
+
+    /// Writes the given snapshot with all writers in the calling thread.
+    ///
+    /// @param snapshot OutputSnapshot* The snapshot
+    void WriteNow(OutputSnapshot* snapshot);
+
+    /// @var _buffers std::vector<OutputSnapshot*> All snapshot buffers
+    std::vector<OutputSnapshot*> _buffers;
+
+    /// @var _free std::vector<OutputSnapshot*> The buffers that are not in
+    ///     use by any writer
+    std::vector<OutputSnapshot*> _free;
+
+    /// @var _asynchronous bool If the writers run in their own threads
+    bool _asynchronous;
+
+    /// @var _writers std::vector<Writer*> The writers
+    std::vector<Writer*> _writers;
+
+    /// @var _mutex std::mutex Guards the queues, the free buffers and the
+    ///     statistics
+    std::mutex _mutex;
+
+    /// @var _changed std::condition_variable Signals changes of the queues
+    ///     and free buffers
+    std::condition_variable _changed;
+
+    /// @var _stopping bool Flag that the writer threads should end once
+    ///     their queues are empty
+    bool _stopping;
+
+    /// @var _nrOfSnapshots int The number of snapshots taken
+    int _nrOfSnapshots;
+
+    /// @var _nrOfStalls int The number of snapshots that had to wait for a
+    ///     free buffer
+    int _nrOfStalls;
+
+    /// @var _stallTime double The time spent waiting for free buffers in
+    ///     seconds
+    double _stallTime;
+};
@@ -0,0 +1,133 @@
+#include "output/density_field.h"
+#include "util/parallel_bounds.h"
+#include <algorithm>
+#include <cmath>
+#include <omp.h>
+
+DensityField::DensityField(Kernel* kernel, int* cells, float* offset, float* size, int nrOfThreads) {
+    _kernel = kernel;
+    _nrOfThreads = std::max(1, nrOfThreads);
+
+    for (int k = 0; k < 3; k++) {
+        _cells[k] = std::max(1, cells[k]);
+        _offset[k] = offset[k];
+        _spacing[k] = size[k] / _cells[k];
+
+        // the bins are at least as large as the smoothing length, so only
+        // the neighboring bins have to be searched
+        _bins[k] = std::max(1, (int)(size[k] / _kernel->GetH()));
+        while (_bins[k] > 1 && size[k] / _bins[k] < _kernel->GetH()) {
+            _bins[k]--;
+        }
+        _binSize[k] = size[k] / _bins[k];
+    }
+
+    _binStart.resize(_bins[0] * _bins[1] * _bins[2] + 1);
+    _values.resize((_cells[0] + 1) * (_cells[1] + 1) * (_cells[2] + 1));
+}
+
+void DensityField::SortParticlesIntoBins(float* position, int N) {
+    float h = _kernel->GetH();
+    _particleBins.resize(N);
+    _sortedIndices.resize(N);
+    std::fill(_binStart.begin(), _binStart.end(), 0);
+
+    for (int i = 0; i < N; i++) {
+        int idx[3];
+        bool outside = false;
+
+        for (int k = 0; k < 3; k++) {
+            float r = position[i * 3 + k] - _offset[k];
+
+            // particles further than h from the grid contribute nothing,
+            // the others are put into the nearest bin
+            if (r < -h || r > _binSize[k] * _bins[k] + h) {
+                outside = true;
+            }
+            idx[k] = std::min(_bins[k] - 1, std::max(0, (int)std::floor(r / _binSize[k])));
+        }
+
+        _particleBins[i] = outside ? -1 : (idx[2] * _bins[1] + idx[1]) * _bins[0] + idx[0];
+        if (!outside) {
+            _binStart[_particleBins[i] + 1]++;
+        }
+    }
+
+    int nrOfBins = _bins[0] * _bins[1] * _bins[2];
+    for (int b = 0; b < nrOfBins; b++) {
+        _binStart[b + 1] += _binStart[b];
+    }
+
+    // scatter the particles in the order of their indices, advancing the
+    // start of each bin to its end, so the starts are shifted back after
+    for (int i = 0; i < N; i++) {
+        if (_particleBins[i] >= 0) {
+            _sortedIndices[_binStart[_particleBins[i]]++] = i;
+        }
+    }
+
+    for (int b = nrOfBins; b > 0; b--) {
+        _binStart[b] = _binStart[b - 1];
+    }
+    _binStart[0] = 0;
+}
+
+void DensityField::InterpolateValues(float* density, float* position) {
+    int nx = _cells[0] + 1;
+    int ny = _cells[1] + 1;
+    int nz = _cells[2] + 1;
+    float h = _kernel->GetH();
+    float mass = _kernel->GetMass();
+
+    ParallelBounds zBounds = ParallelBounds(_nrOfThreads, nz);
+
+    #pragma omp parallel num_threads(zBounds.getNrOfThreads())
+    {
+        int threadNum = omp_get_thread_num();
+
+        for (int z = zBounds.lower(threadNum); z < zBounds.upper(threadNum); z++) {
+            for (int y = 0; y < ny; y++) {
+                for (int x = 0; x < nx; x++) {
+                    float rx = _offset[0] + x * _spacing[0];
+                    float ry = _offset[1] + y * _spacing[1];
+                    float rz = _offset[2] + z * _spacing[2];
+
+                    int bx = std::min(_bins[0] - 1, (int)(x * _spacing[0] / _binSize[0]));
+                    int by = std::min(_bins[1] - 1, (int)(y * _spacing[1] / _binSize[1]));
+                    int bz = std::min(_bins[2] - 1, (int)(z * _spacing[2] / _binSize[2]));
+
+                    float sum = 0.f;
+
+                    for (int cz = std::max(0, bz - 1); cz <= std::min(_bins[2] - 1, bz + 1); cz++) {
+                    for (int cy = std::max(0, by - 1); cy <= std::min(_bins[1] - 1, by + 1); cy++) {
+                    for (int cx = std::max(0, bx - 1); cx <= std::min(_bins[0] - 1, bx + 1); cx++) {
+                        int bin = (cz * _bins[1] + cy) * _bins[0] + cx;
+
+                        for (int s = _binStart[bin]; s < _binStart[bin + 1]; s++) {
+                            int j = _sortedIndices[s];
+                            float dx = position[j * 3] - rx;
+                            float dy = position[j * 3 + 1] - ry;
+                            float dz = position[j * 3 + 2] - rz;
+                            float r2 = dx * dx + dy * dy + dz * dz;
+
+                            if (r2 > h * h) {
+                                continue;
+                            }
+
+                            sum += mass * density[j] * _kernel->ValueOf(std::sqrt(r2));
+                        }
+                    }
+                    }
+                    }
+
+                    _values[(z * ny + y) * nx + x] = sum;
+                }
+            }
+        }
+    }
+}
+
+void DensityField::Interpolate(float* density, float* position, int N) {
+    this->SortParticlesIntoBins(position, N);
+    this->InterpolateValues(density, position);
+}
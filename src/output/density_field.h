@@ -0,0 +1,121 @@
+#pragma once
+
+#include "kernel/kernel.h"
+#include <vector>
+
+/// The density of the particles interpolated on the points of a regular
+/// grid. The particles are sorted into bins first, so each grid point only
+/// visits the particles near it.
+class DensityField {
+public:
+    /// Constructor. Creates a grid spanning the given box with the given
+    /// number of cells in each direction.
+    ///
+    /// @param kernel Kernel* The kernel to be used to interpolate the
+    ///   density between particles
+    /// @param cells int* The number of cells of the grid in x, y and z
+    ///   direction. The grid has one more point than cells in each direction.
+    /// @param offset float* The lower corner of the grid
+    /// @param size float* The size of the grid in x, y and z direction
+    /// @param nrOfThreads int The number of threads interpolating the density
+    DensityField(Kernel* kernel, int* cells, float* offset, float* size, int nrOfThreads);
+
+    /// Interpolates the density of the given particles on all points of the
+    /// grid.
+    ///
+    /// @param density float* The density values of the particles
+    /// @param position float* The position values of the particles
+    /// @param N int The number of particles
+    void Interpolate(float* density, float* position, int N);
+
+    /// Returns the interpolated density of each grid point, in the order
+    /// x, y, z from fastest to slowest.
+    ///
+    /// @return float* The values of the grid points
+    float* GetValues() {return _values.data();}
+
+    /// Returns the value of the given grid point.
+    ///
+    /// @param x int The x index of the point
+    /// @param y int The y index of the point
+    /// @param z int The z index of the point
+    /// @return float The value of the point
+    float GetValue(int x, int y, int z) {
+        return _values[(z * (_cells[1] + 1) + y) * (_cells[0] + 1) + x];
+    }
+
+    /// Returns the number of cells in the given direction.
+    ///
+    /// @param k int The direction, 0 to 2 for x to z
+    /// @return int The number of cells
+    int GetNrOfCells(int k) {return _cells[k];}
+
+    /// Returns the position of the given grid point.
+    ///
+    /// @param x int The x index of the point
+    /// @param y int The y index of the point
+    /// @param z int The z index of the point
+    /// @param ret float* Output vector (3 dimensional)
+    void GetPoint(int x, int y, int z, float* ret) {
+        ret[0] = _offset[0] + x * _spacing[0];
+        ret[1] = _offset[1] + y * _spacing[1];
+        ret[2] = _offset[2] + z * _spacing[2];
+    }
+
+private:
+    /// Sorts the particles that are within the smoothing length of the grid
+    /// into bins of at least the size of the smoothing length, so the
+    /// particles near a grid point are found in the surrounding 27 bins.
+    ///
+    /// @param position float* The position values of the particles
+    /// @param N int The number of particles
+    void SortParticlesIntoBins(float* position, int N);
+
+    /// Interpolates the density on all points of the grid into _values,
+    /// only visiting the particles in the bins around each point. The grid
+    /// is split into layers of constant z, which are interpolated in
+    /// parallel.
+    ///
+    /// @param density float* The density values of the particles
+    /// @param position float* The position values of the particles
+    void InterpolateValues(float* density, float* position);
+
+    /// @var _cells int[3] The number of cells of the grid in each direction
+    int _cells[3];
+
+    /// @var _offset float[3] The lower corner of the grid
+    float _offset[3];
+
+    /// @var _spacing float[3] The distance between the grid points in each
+    ///   direction
+    float _spacing[3];
+
+    /// @var _bins int[3] The number of bins of particles in each direction
+    int _bins[3];
+
+    /// @var _binSize float[3] The size of the bins in each direction
+    float _binSize[3];
+
+    /// @var _binStart std::vector<int> The first position in
+    ///   _sortedIndices for each bin, with one more entry for the end of the
+    ///   last bin
+    std::vector<int> _binStart;
+
+    /// @var _sortedIndices std::vector<int> The indices of the particles
+    ///   sorted by bin, in the order of the indices within each bin
+    std::vector<int> _sortedIndices;
+
+    /// @var _particleBins std::vector<int> The bin of each particle or -1 if
+    ///   it is too far from the grid to contribute
+    std::vector<int> _particleBins;
+
+    /// @var _values std::vector<float> The interpolated density of each grid
+    ///   point, in the order x, y, z from fastest to slowest
+    std::vector<float> _values;
+
+    /// @var _kernel Kernel The kernel used for interpolation.
+    Kernel* _kernel;
+
+    /// @var _nrOfThreads int The number of threads interpolating the density
+    int _nrOfThreads;
+};
@@ -0,0 +1,262 @@
+#include "output/surface_output.h"
+#include "util/parallel_bounds.h"
+#include <algorithm>
+#include <cstdio>
+#include <omp.h>
+
+using namespace std;
+
+/// The corners of the six tetrahedra each cell is split into. A corner is
+/// given by its offsets in x, y and z as the bits 0 to 2. Each tetrahedron
+/// goes from corner 0 to corner 7 along the edges of the cell in another
+/// order, so the corners of a tetrahedron only ever increase and every
+/// edge between two of them is one of seven directions from the lower one.
+/// As all cells are split the same way, the faces of neighboring cells are
+/// split the same way as well.
+static const int TETRAHEDRA[6][4] = {
+    {0, 1, 3, 7},
+    {0, 1, 5, 7},
+    {0, 2, 3, 7},
+    {0, 2, 6, 7},
+    {0, 4, 5, 7},
+    {0, 4, 6, 7}
+};
+
+/// The orientation of each of the tetrahedra, which is the parity of the
+/// order in which it goes along the x, y and z edges.
+static const int TETRAHEDRON_SIGNS[6] = {1, -1, -1, 1, 1, -1};
+
+/// Returns the parity of the given order of the corners of a tetrahedron.
+///
+/// @param order int* The four corners 0 to 3 in some order
+/// @return int 1 for an even and -1 for an odd permutation
+static int permutationSign(const int* order) {
+    int sign = 1;
+    for (int a = 0; a < 4; a++) {
+        for (int b = a + 1; b < 4; b++) {
+            if (order[a] > order[b]) {
+                sign = -sign;
+            }
+        }
+    }
+    return sign;
+}
+
+SurfaceOutput::SurfaceOutput(string path, Kernel* kernel, int* cells, float* offset, float* size,
+        float isoLevel, int nrOfThreads)
+    : _field(kernel, cells, offset, size, nrOfThreads) {
+    _path = path;
+    _count = 1;
+    _isoLevel = isoLevel;
+    _nrOfThreads = std::max(1, nrOfThreads);
+    _threadTriangles = std::vector<std::vector<int64_t>>(_nrOfThreads);
+    _threadEdges = std::vector<std::vector<int64_t>>(_nrOfThreads);
+}
+
+void SurfaceOutput::EdgeVertex(int64_t edge, float* ret) {
+    int nx = _field.GetNrOfCells(0) + 1;
+    int ny = _field.GetNrOfCells(1) + 1;
+
+    int direction = edge % 7 + 1;
+    int64_t point = edge / 7;
+    int x = point % nx;
+    int y = (point / nx) % ny;
+    int z = point / ((int64_t)nx * ny);
+
+    int dx = direction & 1;
+    int dy = (direction >> 1) & 1;
+    int dz = (direction >> 2) & 1;
+
+    float a[3];
+    float b[3];
+    _field.GetPoint(x, y, z, a);
+    _field.GetPoint(x + dx, y + dy, z + dz, b);
+    float va = _field.GetValue(x, y, z);
+    float vb = _field.GetValue(x + dx, y + dy, z + dz);
+
+    // exactly one end is above the iso level, so the values differ
+    float t = (_isoLevel - va) / (vb - va);
+
+    for (int k = 0; k < 3; k++) {
+        ret[k] = a[k] + t * (b[k] - a[k]);
+    }
+}
+
+void SurfaceOutput::ExtractLayers(int lower, int upper, std::vector<int64_t>& triangles) {
+    int nx = _field.GetNrOfCells(0) + 1;
+    int ny = _field.GetNrOfCells(1) + 1;
+
+    for (int z = lower; z < upper; z++) {
+        for (int y = 0; y < ny - 1; y++) {
+            for (int x = 0; x < nx - 1; x++) {
+                int64_t points[8];
+                float values[8];
+                bool inside[8];
+                int nrInside = 0;
+
+                for (int c = 0; c < 8; c++) {
+                    int cx = x + (c & 1);
+                    int cy = y + ((c >> 1) & 1);
+                    int cz = z + ((c >> 2) & 1);
+                    points[c] = ((int64_t)cz * ny + cy) * nx + cx;
+                    values[c] = _field.GetValue(cx, cy, cz);
+                    inside[c] = values[c] > _isoLevel;
+                    nrInside += inside[c] ? 1 : 0;
+                }
+
+                // most cells are entirely inside or outside
+                if (nrInside == 0 || nrInside == 8) {
+                    continue;
+                }
+
+                for (int t = 0; t < 6; t++) {
+                    const int* corners = TETRAHEDRA[t];
+
+                    // the corners of the tetrahedron inside and outside
+                    int in[4];
+                    int out[4];
+                    int nrIn = 0;
+                    int nrOut = 0;
+                    for (int k = 0; k < 4; k++) {
+                        if (inside[corners[k]]) {
+                            in[nrIn++] = k;
+                        } else {
+                            out[nrOut++] = k;
+                        }
+                    }
+
+                    if (nrIn == 0 || nrOut == 0) {
+                        continue;
+                    }
+
+                    // the edge between two corners of the tetrahedron, given
+                    // by the lower corner and the direction to the other
+                    auto edge = [&](int k, int l) -> int64_t {
+                        int lo = corners[std::min(k, l)];
+                        int hi = corners[std::max(k, l)];
+                        return points[lo] * 7 + (hi ^ lo) - 1;
+                    };
+
+                    // the triangles are built for corners in ascending
+                    // order, for which they face from the first corners to
+                    // the others in a positively oriented tetrahedron. For
+                    // other orders and orientations they are flipped
+                    int64_t found[4];
+                    int nrOfVertices;
+                    int order[4];
+                    bool flip;
+
+                    if (nrIn == 1 || nrOut == 1) {
+                        // a single corner is cut off by one triangle
+                        int lone = nrIn == 1 ? in[0] : out[0];
+                        int* others = nrIn == 1 ? out : in;
+                        found[0] = edge(lone, others[0]);
+                        found[1] = edge(lone, others[1]);
+                        found[2] = edge(lone, others[2]);
+                        nrOfVertices = 3;
+
+                        order[0] = lone;
+                        order[1] = others[0];
+                        order[2] = others[1];
+                        order[3] = others[2];
+                        flip = nrIn != 1;
+                    } else {
+                        // two corners are cut off from the other two by a
+                        // quad, going around it in order
+                        found[0] = edge(in[0], out[0]);
+                        found[1] = edge(in[0], out[1]);
+                        found[2] = edge(in[1], out[1]);
+                        found[3] = edge(in[1], out[0]);
+                        nrOfVertices = 4;
+
+                        order[0] = in[0];
+                        order[1] = in[1];
+                        order[2] = out[0];
+                        order[3] = out[1];
+                        flip = false;
+                    }
+
+                    if (TETRAHEDRON_SIGNS[t] * permutationSign(order) < 0) {
+                        flip = !flip;
+                    }
+
+                    for (int first = 1; first + 1 < nrOfVertices; first++) {
+                        int64_t tri[3] = {found[0], found[first], found[first + 1]};
+                        if (flip) {
+                            std::swap(tri[1], tri[2]);
+                        }
+
+                        triangles.push_back(tri[0]);
+                        triangles.push_back(tri[1]);
+                        triangles.push_back(tri[2]);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void SurfaceOutput::ExtractSurface(float* density, float* position, int N, Mesh& mesh) {
+    _field.Interpolate(density, position, N);
+
+    ParallelBounds zBounds = ParallelBounds(_nrOfThreads, _field.GetNrOfCells(2));
+
+    #pragma omp parallel for num_threads(_nrOfThreads)
+    for (int t = 0; t < _nrOfThreads; t++) {
+        _threadTriangles[t].clear();
+        this->ExtractLayers(zBounds.lower(t), zBounds.upper(t), _threadTriangles[t]);
+
+        std::vector<int64_t>& edges = _threadEdges[t];
+        edges.assign(_threadTriangles[t].begin(), _threadTriangles[t].end());
+        std::sort(edges.begin(), edges.end());
+        edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+    }
+
+    // the vertices are welded by giving each edge with a vertex one index,
+    // in the order of the edges so the mesh does not depend on the threads.
+    // the sorted edges of the threads are merged, and only the edges on the
+    // layers between two threads appear twice
+    _edges.clear();
+    for (int t = 0; t < _nrOfThreads; t++) {
+        size_t middle = _edges.size();
+        _edges.insert(_edges.end(), _threadEdges[t].begin(), _threadEdges[t].end());
+        std::inplace_merge(_edges.begin(), _edges.begin() + middle, _edges.end());
+    }
+    _edges.erase(std::unique(_edges.begin(), _edges.end()), _edges.end());
+
+    int nrOfVertices = _edges.size();
+    _vertices.resize(nrOfVertices);
+
+    #pragma omp parallel for num_threads(_nrOfThreads)
+    for (int v = 0; v < nrOfVertices; v++) {
+        float p[3];
+        this->EdgeVertex(_edges[v], p);
+        _vertices[v] = Vector3D<float>(p);
+    }
+
+    _faces.clear();
+    for (int t = 0; t < _nrOfThreads; t++) {
+        std::vector<int64_t>& triangles = _threadTriangles[t];
+        size_t start = _faces.size();
+        _faces.resize(start + triangles.size());
+
+        #pragma omp parallel for num_threads(_nrOfThreads)
+        for (int k = 0; k < (int)triangles.size(); k++) {
+            _faces[start + k] = std::lower_bound(_edges.begin(), _edges.end(), triangles[k]) - _edges.begin();
+        }
+    }
+
+    mesh.swapVerticesAndFaces(_vertices, _faces);
+}
+
+long SurfaceOutput::WriteSurface(float* density, float* position, int N) {
+    this->ExtractSurface(density, position, N, _mesh);
+
+    char* filename = new char[255];
+    sprintf(filename, "%ssurface_%i.obj", _path.c_str(), _count);
+    long bytes = _mesh.writeMeshToOBJFile(filename);
+    delete[] filename;
+
+    _count++;
+    return bytes;
+}
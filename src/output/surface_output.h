@@ -0,0 +1,123 @@
+#pragma once
+
+#include "kernel/kernel.h"
+#include "output/density_field.h"
+#include "data/mesh.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/// Extracts the surface of the fluid as a triangle mesh and writes it to an
+/// OBJ file for each call. The density is interpolated on a regular grid
+/// and the surface is where it crosses the iso level. Each cell of the grid
+/// is split into six tetrahedra along its diagonal, in which the surface is
+/// one or two triangles (marching tetrahedra). The layers of cells are
+/// processed in parallel. The vertices lie on the edges of the tetrahedra,
+/// so triangles sharing an edge share the vertex and the mesh is closed
+/// except where the fluid touches the bounds of the grid.
+class SurfaceOutput {
+public:
+    /// Constructor. Creates a new instance saving the output in the given
+    /// path.
+    ///
+    /// @param path string Where the OBJ files will be saved. The path should
+    ///   end with a slash if a directory is targeted, as no directory detection
+    ///   takes place.
+    /// @param kernel Kernel* The kernel to be used to interpolate the
+    ///   density between particles
+    /// @param cells int* The number of cells of the grid in x, y and z
+    ///   direction
+    /// @param offset float* The lower corner of the grid
+    /// @param size float* The size of the grid in x, y and z direction
+    /// @param isoLevel float The interpolated density at the surface
+    /// @param nrOfThreads int The number of threads extracting the surface
+    SurfaceOutput(string path, Kernel* kernel, int* cells, float* offset, float* size,
+        float isoLevel, int nrOfThreads);
+
+    /// The mesh can not be copied
+    SurfaceOutput(const SurfaceOutput&) = delete;
+    SurfaceOutput& operator=(const SurfaceOutput&) = delete;
+
+    /// Extracts the surface of the given particles into the given mesh,
+    /// replacing its vertices and faces.
+    ///
+    /// @param density float* The density values of the particles
+    /// @param position float* The position values of the particles
+    /// @param N int The number of particles
+    /// @param mesh Mesh& The mesh to store the surface in
+    void ExtractSurface(float* density, float* position, int N, Mesh& mesh);
+
+    /// Extracts the surface of the given particles and writes it to a file
+    /// surface_<count>.obj.
+    ///
+    /// @param density float* The density values of the particles
+    /// @param position float* The position values of the particles
+    /// @param N int The number of particles
+    /// @return long The number of bytes written
+    long WriteSurface(float* density, float* position, int N);
+
+    /// Sets the number of the next file, surface_<count>.obj.
+    ///
+    /// @param count int The number of the next file
+    void SetCount(int count) {_count = count;}
+
+private:
+    /// Finds the triangles in the cells of the given layers and appends
+    /// the edges their vertices lie on to the given list, three per
+    /// triangle.
+    ///
+    /// @param lower int The first layer of cells
+    /// @param upper int The layer after the last one
+    /// @param triangles std::vector<int64_t>& The edges of the triangles
+    void ExtractLayers(int lower, int upper, std::vector<int64_t>& triangles);
+
+    /// Calculates the position of the vertex on the given edge, which is
+    /// where the linear interpolation between the values of its ends
+    /// crosses the iso level.
+    ///
+    /// @param edge int64_t The edge, which is the grid point at its lower
+    ///   end times seven plus the direction
+    /// @param ret float* Output vector (3 dimensional)
+    void EdgeVertex(int64_t edge, float* ret);
+
+    /// @var _path string The path where the files are saved
+    string _path;
+
+    /// @var _count int Counts up since construction and increments on each
+    ///   call of WriteSurface, so the surface of each call is saved in files
+    ///   of incrementing names.
+    int _count;
+
+    /// @var _field DensityField The grid the density is interpolated on
+    DensityField _field;
+
+    /// @var _isoLevel float The interpolated density at the surface
+    float _isoLevel;
+
+    /// @var _nrOfThreads int The number of threads extracting the surface
+    int _nrOfThreads;
+
+    /// @var _threadTriangles std::vector<std::vector<int64_t>> The edges of
+    ///   the triangles found by each thread
+    std::vector<std::vector<int64_t>> _threadTriangles;
+
+    /// @var _threadEdges std::vector<std::vector<int64_t>> The sorted edges
+    ///   with a vertex found by each thread
+    std::vector<std::vector<int64_t>> _threadEdges;
+
+    /// @var _edges std::vector<int64_t> The sorted edges with a vertex, so
+    ///   the index of an edge is the index of its vertex
+    std::vector<int64_t> _edges;
+
+    /// @var _vertices std::vector<Vector3D<float>> The vertices to be
+    ///   swapped into the mesh
+    std::vector<Vector3D<float>> _vertices;
+
+    /// @var _faces std::vector<int> The faces to be swapped into the mesh
+    std::vector<int> _faces;
+
+    /// @var _mesh Mesh The surface written by WriteSurface
+    Mesh _mesh;
+};
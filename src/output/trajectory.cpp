@@ -0,0 +1,430 @@
+#include "output/trajectory.h"
+#include "util/parallel_bounds.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+/// The first bytes of each trajectory file and of its footer.
+const char MAGIC[8] = {'S', 'P', 'H', 'T', 'R', 'A', 'J', '\0'};
+
+/// The number of quantized values per particle, which are the x, y and z
+/// position, the density and the pressure.
+const int NR_OF_VALUES = 5;
+
+struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t N;
+    int32_t keyframeInterval;
+    uint32_t reserved;
+    double precision[NR_OF_VALUES];
+};
+
+/// Precedes each frame, followed by the size of each block and the blocks.
+struct FrameHeader {
+    uint64_t bytes;
+    double time;
+    uint32_t nrOfBlocks;
+    uint32_t keyframe;
+};
+
+struct IndexEntry {
+    uint64_t offset;
+    double time;
+};
+
+/// Ends the file after the index of the frames.
+struct Footer {
+    uint64_t indexOffset;
+    uint64_t nrOfFrames;
+    char magic[8];
+};
+
+/// Appends the given signed value as a variable-length integer of 7 bits per
+/// byte. The sign is moved to the lowest bit, so small negative values are
+/// short as well.
+///
+/// @param value int64_t The value
+/// @param buffer std::vector<unsigned char>& The buffer to append to
+inline void putVarint(int64_t value, std::vector<unsigned char>& buffer) {
+    uint64_t u = ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+    while (u >= 0x80) {
+        buffer.push_back((unsigned char)(u | 0x80));
+        u >>= 7;
+    }
+    buffer.push_back((unsigned char)u);
+}
+
+/// Reads a variable-length integer written by putVarint.
+///
+/// @param data const unsigned char*& The position to read from, which is
+///     advanced past the integer
+/// @param end const unsigned char* The end of the data
+/// @return int64_t The value
+inline int64_t getVarint(const unsigned char*& data, const unsigned char* end) {
+    uint64_t u = 0;
+    int shift = 0;
+    while (data < end && shift < 64) {
+        unsigned char byte = *data++;
+        u |= (uint64_t)(byte & 0x7f) << shift;
+        if (byte < 0x80) {
+            break;
+        }
+        shift += 7;
+    }
+    return (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+}
+
+/// Returns the given value as a multiple of the given precision. Values
+/// that are not finite become zero.
+///
+/// @param value float The value
+/// @param precision double The quantization step
+/// @return int64_t The quantized value
+inline int64_t quantize(float value, double precision) {
+    if (!std::isfinite(value)) {
+        return 0;
+    }
+    return (int64_t)std::llround(value / precision);
+}
+
+}
+
+TrajectoryWriter::TrajectoryWriter(string filename, int keyframeInterval, float positionPrecision,
+        float densityPrecision, float pressurePrecision, int nrOfBlocks) {
+    _filename = filename;
+    _file = NULL;
+    _keyframeInterval = std::max(1, keyframeInterval);
+    _precision[0] = positionPrecision;
+    _precision[1] = positionPrecision;
+    _precision[2] = positionPrecision;
+    _precision[3] = densityPrecision;
+    _precision[4] = pressurePrecision;
+    _N = 0;
+    _resumed = false;
+    _blocks = std::vector<std::vector<unsigned char>>(std::max(1, nrOfBlocks));
+    _position = 0;
+}
+
+TrajectoryWriter::~TrajectoryWriter() {
+    this->Close();
+}
+
+void TrajectoryWriter::EncodeBlock(int lower, int upper, bool keyframe, std::vector<unsigned char>& buffer) {
+    buffer.clear();
+
+    for (int id = lower; id < upper; id++) {
+        int i = _order[id];
+        float values[NR_OF_VALUES] = {
+            _values[0][i * 3],
+            _values[0][i * 3 + 1],
+            _values[0][i * 3 + 2],
+            _values[1][i],
+            _values[2][i]
+        };
+
+        for (int k = 0; k < NR_OF_VALUES; k++) {
+            int64_t q = quantize(values[k], _precision[k]);
+            int64_t& previous = _previous[id * NR_OF_VALUES + k];
+            putVarint(keyframe ? q : q - previous, buffer);
+            previous = q;
+        }
+    }
+}
+
+void TrajectoryWriter::Resume(double time) {
+    // without a file there is nothing to continue
+    FILE* existing = fopen(_filename.c_str(), "rb");
+    if (existing == NULL) {
+        return;
+    }
+    fclose(existing);
+
+    TrajectoryReader reader;
+    bool matches = reader.Open(_filename) && reader.GetN() > 0
+        && reader.GetKeyframeInterval() == _keyframeInterval;
+    for (int k = 0; k < NR_OF_VALUES && matches; k++) {
+        matches = reader.GetPrecision(k) == _precision[k];
+    }
+
+    if (!matches) {
+        printf("Trajectory file %s can not be continued and is left as it is\n", _filename.c_str());
+        _N = -1;
+        return;
+    }
+
+    int nrOfFrames = 0;
+    while (nrOfFrames < reader.GetNrOfFrames() && reader.GetTime(nrOfFrames) <= time) {
+        _offsets.push_back(reader.GetOffset(nrOfFrames));
+        _times.push_back(reader.GetTime(nrOfFrames));
+        nrOfFrames++;
+    }
+    uint64_t end = reader.GetOffset(nrOfFrames);
+
+    _file = fopen(_filename.c_str(), "r+b");
+    if (_file == NULL || ftruncate(fileno(_file), end) != 0 || fseek(_file, end, SEEK_SET) != 0) {
+        printf("Could not continue the trajectory file %s\n", _filename.c_str());
+        if (_file != NULL) {
+            fclose(_file);
+            _file = NULL;
+        }
+        _N = -1;
+        return;
+    }
+
+    _N = reader.GetN();
+    _order.resize(_N);
+    _previous.resize((size_t)_N * NR_OF_VALUES);
+    _position = end;
+    _resumed = true;
+}
+
+long TrajectoryWriter::WriteFrame(float* position, float* density, float* pressure, int* ids, int N, double time) {
+    if (_file == NULL && _N == 0) {
+        _file = fopen(_filename.c_str(), "wb");
+        if (_file == NULL) {
+            printf("Could not create the trajectory file %s\n", _filename.c_str());
+            _N = -1;
+            return 0;
+        }
+
+        FileHeader header;
+        memset(&header, 0, sizeof(FileHeader));
+        memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.version = TRAJECTORY_VERSION;
+        header.N = N;
+        header.keyframeInterval = _keyframeInterval;
+        memcpy(header.precision, _precision, sizeof(_precision));
+        fwrite(&header, sizeof(FileHeader), 1, _file);
+
+        _N = N;
+        _order.resize(N);
+        _previous.resize((size_t)N * NR_OF_VALUES);
+        _position = sizeof(FileHeader);
+    }
+
+    if (_file == NULL || N != _N) {
+        return 0;
+    }
+
+    for (int i = 0; i < N; i++) {
+        _order[ids[i]] = i;
+    }
+    _values[0] = position;
+    _values[1] = density;
+    _values[2] = pressure;
+
+    bool keyframe = _resumed || _offsets.size() % _keyframeInterval == 0;
+    _resumed = false;
+    int nrOfBlocks = _blocks.size();
+    ParallelBounds bBounds = ParallelBounds(nrOfBlocks, N);
+
+    #pragma omp parallel for num_threads(nrOfBlocks)
+    for (int b = 0; b < nrOfBlocks; b++) {
+        this->EncodeBlock(bBounds.lower(b), bBounds.upper(b), keyframe, _blocks[b]);
+    }
+
+    std::vector<uint64_t> blockBytes(nrOfBlocks);
+    FrameHeader header;
+    header.bytes = sizeof(FrameHeader) + nrOfBlocks * sizeof(uint64_t);
+    header.time = time;
+    header.nrOfBlocks = nrOfBlocks;
+    header.keyframe = keyframe ? 1 : 0;
+
+    for (int b = 0; b < nrOfBlocks; b++) {
+        blockBytes[b] = _blocks[b].size();
+        header.bytes += blockBytes[b];
+    }
+
+    fwrite(&header, sizeof(FrameHeader), 1, _file);
+    fwrite(blockBytes.data(), sizeof(uint64_t), nrOfBlocks, _file);
+    for (int b = 0; b < nrOfBlocks; b++) {
+        fwrite(_blocks[b].data(), 1, _blocks[b].size(), _file);
+    }
+
+    _offsets.push_back(_position);
+    _times.push_back(time);
+    _position += header.bytes;
+
+    return header.bytes;
+}
+
+void TrajectoryWriter::Close() {
+    if (_file == NULL) {
+        return;
+    }
+
+    std::vector<IndexEntry> index(_offsets.size());
+    for (size_t k = 0; k < _offsets.size(); k++) {
+        index[k].offset = _offsets[k];
+        index[k].time = _times[k];
+    }
+
+    Footer footer;
+    footer.indexOffset = _position;
+    footer.nrOfFrames = _offsets.size();
+    memcpy(footer.magic, MAGIC, sizeof(MAGIC));
+
+    fwrite(index.data(), sizeof(IndexEntry), index.size(), _file);
+    fwrite(&footer, sizeof(Footer), 1, _file);
+    fclose(_file);
+    _file = NULL;
+}
+
+TrajectoryReader::TrajectoryReader() {
+    _file = NULL;
+    _N = 0;
+    _keyframeInterval = 1;
+    _end = 0;
+    _decodedFrame = -1;
+}
+
+TrajectoryReader::~TrajectoryReader() {
+    if (_file != NULL) {
+        fclose(_file);
+    }
+}
+
+bool TrajectoryReader::Open(string filename) {
+    _file = fopen(filename.c_str(), "rb");
+    if (_file == NULL) {
+        return false;
+    }
+
+    FileHeader header;
+    if (fread(&header, sizeof(FileHeader), 1, _file) != 1
+            || memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0
+            || header.version != TRAJECTORY_VERSION
+            || header.N < 0 || header.keyframeInterval < 1) {
+        return false;
+    }
+
+    _N = header.N;
+    _keyframeInterval = header.keyframeInterval;
+    memcpy(_precision, header.precision, sizeof(_precision));
+    _values.resize((size_t)_N * NR_OF_VALUES);
+    _decodedFrame = -1;
+
+    fseek(_file, 0, SEEK_END);
+    uint64_t size = ftell(_file);
+
+    Footer footer;
+    bool indexed = size >= sizeof(FileHeader) + sizeof(Footer)
+        && fseek(_file, size - sizeof(Footer), SEEK_SET) == 0
+        && fread(&footer, sizeof(Footer), 1, _file) == 1
+        && memcmp(footer.magic, MAGIC, sizeof(MAGIC)) == 0
+        && footer.indexOffset + footer.nrOfFrames * sizeof(IndexEntry) + sizeof(Footer) == size;
+
+    if (indexed) {
+        std::vector<IndexEntry> index(footer.nrOfFrames);
+        fseek(_file, footer.indexOffset, SEEK_SET);
+        if (fread(index.data(), sizeof(IndexEntry), index.size(), _file) != index.size()) {
+            return false;
+        }
+
+        for (size_t k = 0; k < index.size(); k++) {
+            _offsets.push_back(index[k].offset);
+            _times.push_back(index[k].time);
+        }
+        _end = footer.indexOffset;
+        return true;
+    }
+
+    // without an index, the frames are found by their sizes, up to the
+    // last complete frame
+    uint64_t offset = sizeof(FileHeader);
+    FrameHeader frame;
+    while (fseek(_file, offset, SEEK_SET) == 0
+            && fread(&frame, sizeof(FrameHeader), 1, _file) == 1
+            && frame.bytes >= sizeof(FrameHeader)
+            && offset + frame.bytes <= size) {
+        _offsets.push_back(offset);
+        _times.push_back(frame.time);
+        offset += frame.bytes;
+    }
+    _end = offset;
+
+    return true;
+}
+
+bool TrajectoryReader::DecodeFrame(int frame) {
+    FrameHeader header;
+    if (fseek(_file, _offsets[frame], SEEK_SET) != 0
+            || fread(&header, sizeof(FrameHeader), 1, _file) != 1) {
+        return false;
+    }
+
+    int nrOfBlocks = header.nrOfBlocks;
+    if (nrOfBlocks < 1 || header.bytes < sizeof(FrameHeader) + nrOfBlocks * sizeof(uint64_t)) {
+        return false;
+    }
+
+    std::vector<uint64_t> blockBytes(nrOfBlocks);
+    std::vector<unsigned char> data(header.bytes - sizeof(FrameHeader) - nrOfBlocks * sizeof(uint64_t));
+    if (fread(blockBytes.data(), sizeof(uint64_t), nrOfBlocks, _file) != (size_t)nrOfBlocks
+            || fread(data.data(), 1, data.size(), _file) != data.size()) {
+        return false;
+    }
+
+    std::vector<uint64_t> blockStart(nrOfBlocks + 1, 0);
+    for (int b = 0; b < nrOfBlocks; b++) {
+        blockStart[b + 1] = blockStart[b] + blockBytes[b];
+    }
+    if (blockStart[nrOfBlocks] != data.size()) {
+        return false;
+    }
+
+    // the blocks cover the IDs as split by the writer
+    ParallelBounds bBounds = ParallelBounds(nrOfBlocks, _N);
+    bool keyframe = header.keyframe != 0;
+
+    #pragma omp parallel for
+    for (int b = 0; b < nrOfBlocks; b++) {
+        const unsigned char* p = data.data() + blockStart[b];
+        const unsigned char* end = data.data() + blockStart[b + 1];
+
+        for (int id = bBounds.lower(b); id < bBounds.upper(b); id++) {
+            for (int k = 0; k < NR_OF_VALUES; k++) {
+                int64_t value = getVarint(p, end);
+                _values[id * NR_OF_VALUES + k] = keyframe ? value : _values[id * NR_OF_VALUES + k] + value;
+            }
+        }
+    }
+
+    _decodedFrame = frame;
+    return true;
+}
+
+bool TrajectoryReader::ReadFrame(int frame, float* position, float* density, float* pressure) {
+    if (_file == NULL || frame < 0 || frame >= (int)_offsets.size()) {
+        return false;
+    }
+
+    // continue from the last decoded frame if it is on the way, else start
+    // at the keyframe
+    int keyframe = frame - frame % _keyframeInterval;
+    int start = _decodedFrame >= keyframe && _decodedFrame <= frame ? _decodedFrame + 1 : keyframe;
+
+    for (int f = start; f <= frame; f++) {
+        if (!this->DecodeFrame(f)) {
+            _decodedFrame = -1;
+            return false;
+        }
+    }
+
+    for (int id = 0; id < _N; id++) {
+        const int64_t* values = &_values[id * NR_OF_VALUES];
+        position[id * 3] = (float)(values[0] * _precision[0]);
+        position[id * 3 + 1] = (float)(values[1] * _precision[1]);
+        position[id * 3 + 2] = (float)(values[2] * _precision[2]);
+        density[id] = (float)(values[3] * _precision[3]);
+        pressure[id] = (float)(values[4] * _precision[4]);
+    }
+
+    return true;
+}
@@ -0,0 +1,234 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/// The version of the trajectory file format. Files of other versions are
+/// not read.
+const uint32_t TRAJECTORY_VERSION = 1;
+
+/// Writes the particles of each step into one compact trajectory file. The
+/// positions, densities and pressures are quantized to fixed-point integers
+/// with a given precision, so the error of each value is at most half the
+/// precision. Every keyframe interval a frame stores the quantized values,
+/// the frames in between only store the differences to the previous frame,
+/// which are small and encoded as variable-length integers. The particles
+/// are written in the order of their IDs and encoded in parallel blocks.
+/// An index of the frames at the end of the file lets a reader find any
+/// frame by decoding at most one keyframe interval.
+class TrajectoryWriter {
+public:
+    /// Constructor. The file is created with the first frame, overwriting
+    /// an existing one unless the writer resumes it.
+    ///
+    /// @param filename string The name of the file
+    /// @param keyframeInterval int The number of frames from one keyframe
+    ///   to the next
+    /// @param positionPrecision float The quantization step of the positions
+    /// @param densityPrecision float The quantization step of the densities
+    /// @param pressurePrecision float The quantization step of the pressures
+    /// @param nrOfBlocks int The number of blocks and threads encoding them
+    TrajectoryWriter(string filename, int keyframeInterval, float positionPrecision,
+        float densityPrecision, float pressurePrecision, int nrOfBlocks);
+
+    /// Destructor. Closes the file.
+    ~TrajectoryWriter();
+
+    /// The file belongs to one writer only
+    TrajectoryWriter(const TrajectoryWriter&) = delete;
+    TrajectoryWriter& operator=(const TrajectoryWriter&) = delete;
+
+    /// Continues the existing file for a restarted run instead of
+    /// overwriting it. The frames up to the given time are kept, while
+    /// the index and the frames after it, which the restarted run writes
+    /// again, are removed. The next frame is a keyframe, so the frames
+    /// before do not have to be decoded. A file that was written with
+    /// other settings or can not be read is left as it is, and no frames
+    /// are written. Must be called before the first frame.
+    ///
+    /// @param time double The simulated time the run restarts from
+    void Resume(double time);
+
+    /// Appends a frame with the given particle data. The number of
+    /// particles must be the same in all frames.
+    ///
+    /// @param position float* The particle positions
+    /// @param density float* The particle densities
+    /// @param pressure float* The particle pressures
+    /// @param ids int* The particle IDs
+    /// @param N int The number of particles
+    /// @param time double The simulated time of the frame
+    /// @return long The number of bytes written
+    long WriteFrame(float* position, float* density, float* pressure, int* ids, int N, double time);
+
+    /// Writes the index of the frames and closes the file. Is called by the
+    /// destructor, if not before.
+    void Close();
+
+private:
+    /// Quantizes the values of the particles with the given IDs and encodes
+    /// them into the given buffer, as differences to the previous frame
+    /// unless it is a keyframe.
+    ///
+    /// @param lower int The first ID of the block
+    /// @param upper int The ID after the last one of the block
+    /// @param keyframe bool If the frame is a keyframe
+    /// @param buffer std::vector<unsigned char>& The encoded block
+    void EncodeBlock(int lower, int upper, bool keyframe, std::vector<unsigned char>& buffer);
+
+    /// @var _filename string The name of the file, which is created with
+    ///   the first frame
+    string _filename;
+
+    /// @var _file FILE* The file, or NULL if it is not open
+    FILE* _file;
+
+    /// @var _keyframeInterval int The number of frames from one keyframe to
+    ///   the next
+    int _keyframeInterval;
+
+    /// @var _precision double[5] The quantization step of the x, y and z
+    ///   position, the density and the pressure
+    double _precision[5];
+
+    /// @var _N int The number of particles, or 0 before the first frame
+    int _N;
+
+    /// @var _resumed bool If the file was resumed and no frame has been
+    ///   written since, so the next one has to be a keyframe
+    bool _resumed;
+
+    /// @var _order std::vector<int> The position of each particle ID in the
+    ///   particle data of the current frame
+    std::vector<int> _order;
+
+    /// @var _values float*[3] The positions, densities and pressures of the
+    ///   current frame, which the blocks read from
+    float* _values[3];
+
+    /// @var _previous std::vector<int64_t> The quantized values of the
+    ///   previous frame, five per particle in the order of the IDs
+    std::vector<int64_t> _previous;
+
+    /// @var _blocks std::vector<std::vector<unsigned char>> The encoded
+    ///   blocks of the current frame
+    std::vector<std::vector<unsigned char>> _blocks;
+
+    /// @var _offsets std::vector<uint64_t> The offset of each frame in the
+    ///   file
+    std::vector<uint64_t> _offsets;
+
+    /// @var _times std::vector<double> The simulated time of each frame
+    std::vector<double> _times;
+
+    /// @var _position uint64_t The current size of the file
+    uint64_t _position;
+};
+
+/// Reads frames of a trajectory file written by TrajectoryWriter. Reading
+/// the frames in order decodes each only once, otherwise a frame is decoded
+/// starting at the keyframe before it.
+class TrajectoryReader {
+public:
+    TrajectoryReader();
+
+    ~TrajectoryReader();
+
+    /// The file belongs to one reader only
+    TrajectoryReader(const TrajectoryReader&) = delete;
+    TrajectoryReader& operator=(const TrajectoryReader&) = delete;
+
+    /// Opens the given file and reads its index. If the file has no index,
+    /// because the writer did not finish, the frames are found by skipping
+    /// through the file instead.
+    ///
+    /// @param filename string The name of the file
+    /// @return bool If the file is a valid trajectory of the current version
+    bool Open(string filename);
+
+    /// Decodes the given frame. The values are in the order of the particle
+    /// IDs.
+    ///
+    /// @param frame int The number of the frame, starting at 0
+    /// @param position float* The particle positions, 3*N floats
+    /// @param density float* The particle densities, N floats
+    /// @param pressure float* The particle pressures, N floats
+    /// @return bool If the frame exists and could be read
+    bool ReadFrame(int frame, float* position, float* density, float* pressure);
+
+    /// Returns the number of particles in each frame.
+    ///
+    /// @return int The number of particles
+    int GetN() {return _N;}
+
+    /// Returns the number of frames in the file.
+    ///
+    /// @return int The number of frames
+    int GetNrOfFrames() {return _offsets.size();}
+
+    /// Returns the simulated time of the given frame.
+    ///
+    /// @param frame int The number of the frame
+    /// @return double The simulated time of the frame
+    double GetTime(int frame) {return _times[frame];}
+
+    /// Returns the offset of the given frame in the file. For the number of
+    /// frames, this is where the last frame ends.
+    ///
+    /// @param frame int The number of the frame
+    /// @return uint64_t The offset in bytes
+    uint64_t GetOffset(int frame) {return frame < (int)_offsets.size() ? _offsets[frame] : _end;}
+
+    /// Returns the number of frames from one keyframe to the next.
+    ///
+    /// @return int The keyframe interval
+    int GetKeyframeInterval() {return _keyframeInterval;}
+
+    /// Returns the quantization step of the given value.
+    ///
+    /// @param k int The value, 0 to 2 for the position, 3 for the density
+    ///   and 4 for the pressure
+    /// @return double The quantization step
+    double GetPrecision(int k) {return _precision[k];}
+
+private:
+    /// Decodes the given frame into _values, as differences to the values
+    /// already there unless it is a keyframe.
+    ///
+    /// @param frame int The number of the frame
+    /// @return bool If the frame could be read
+    bool DecodeFrame(int frame);
+
+    /// @var _file FILE* The file, or NULL if not open
+    FILE* _file;
+
+    /// @var _N int The number of particles
+    int _N;
+
+    /// @var _keyframeInterval int The number of frames from one keyframe to
+    ///   the next
+    int _keyframeInterval;
+
+    /// @var _precision double[5] The quantization steps of the values
+    double _precision[5];
+
+    /// @var _offsets std::vector<uint64_t> The offset of each frame
+    std::vector<uint64_t> _offsets;
+
+    /// @var _times std::vector<double> The simulated time of each frame
+    std::vector<double> _times;
+
+    /// @var _end uint64_t The offset after the last complete frame
+    uint64_t _end;
+
+    /// @var _values std::vector<int64_t> The quantized values of the last
+    ///   decoded frame, five per particle in the order of the IDs
+    std::vector<int64_t> _values;
+
+    /// @var _decodedFrame int The frame in _values, or -1 if none
+    int _decodedFrame;
+};
@@ -1,40 +1,38 @@
 #include "output/vtk.h"
 #include <iostream>
-#include <cmath>
 
 using namespace std;
 
-VTK::VTK(string path, Kernel* kernel, int size) {
+VTK::VTK(string path, Kernel* kernel, int* cells, float* offset, float* size, int nrOfThreads)
+    : _field(kernel, cells, offset, size, nrOfThreads) {
     _path = path;
-    _kernel = kernel;
-    _size = size;
     _count = 1;
 }
 
-void VTK::WriteDensity(float* density, float* position) {
+long VTK::WriteDensity(float* density, float* position, int N) {
     char* filename = new char[255];
     sprintf(filename, "%sfield_%i.vts", _path.c_str(), _count);
 
     FILE* handle = fopen(filename, "w");
     delete filename;
 
-    float ds = 1.0 / _size;
+    _field.Interpolate(density, position, N);
+
+    int cells[3] = {_field.GetNrOfCells(0), _field.GetNrOfCells(1), _field.GetNrOfCells(2)};
 
     fprintf(handle, "<?xml version=\"1.0\"?>\n");
     fprintf(handle, "<VTKFile type=\"StructuredGrid\">\n");
-    fprintf(handle, "<StructuredGrid WholeExtent=\"0 %i 0 %i 0 %i \">\n", _size, _size, _size);
-    fprintf(handle, "<Piece Extent=\"0 %i 0 %i 0 %i \">\n", _size, _size, _size);
+    fprintf(handle, "<StructuredGrid WholeExtent=\"0 %i 0 %i 0 %i \">\n", cells[0], cells[1], cells[2]);
+    fprintf(handle, "<Piece Extent=\"0 %i 0 %i 0 %i \">\n", cells[0], cells[1], cells[2]);
     fprintf(handle, "<Points>\n");
     fprintf(handle, "<DataArray type=\"Float64\" format=\"ascii\" NumberOfComponents=\"3\">\n");
 
-    for (int z = 0; z <= _size; ++z) {
-        for (int y = 0; y <= _size; ++y) {
-            for (int x = 0; x <= _size; ++x) {
-                fprintf(handle, "%le %le %le\n",
-                    (float)x * ds,
-                    (float)y * ds,
-                    (float)z * ds
-                );
+    for (int z = 0; z <= cells[2]; ++z) {
+        for (int y = 0; y <= cells[1]; ++y) {
+            for (int x = 0; x <= cells[0]; ++x) {
+                float point[3];
+                _field.GetPoint(x, y, z, point);
+                fprintf(handle, "%le %le %le\n", point[0], point[1], point[2]);
             }
         }
     }
@@ -46,11 +44,11 @@ void VTK::WriteDensity(float* density, float* position) {
     fprintf(handle,
     "<DataArray Name=\"%s\" type=\"Float64\" format=\"ascii\">\n", "density");
 
-    for (int z = 0; z <= _size; ++z) {
-        for (int y = 0; y <= _size; ++y) {
-            for (int x = 0; x <= _size; ++x) {
-                float d = _kernel->InterpolateDensity(x*ds, y*ds, z*ds, density, position);
-                fprintf(handle, "%le ", (d > 0.5 ? 1.0 : 0.0));
+    float* d = _field.GetValues();
+    for (int z = 0; z <= cells[2]; ++z) {
+        for (int y = 0; y <= cells[1]; ++y) {
+            for (int x = 0; x <= cells[0]; ++x, ++d) {
+                fprintf(handle, "%le ", (*d > 0.5 ? 1.0 : 0.0));
             }
             fprintf(handle, "\n");
         }
@@ -63,7 +61,9 @@ void VTK::WriteDensity(float* density, float* position) {
     fprintf(handle, "</StructuredGrid>\n");
     fprintf(handle, "</VTKFile>\n");
 
+    long bytes = ftell(handle);
     fclose(handle);
 
     _count++;
+    return bytes;
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "kernel/kernel.h"
+#include "output/density_field.h"
 #include <string>
 
 using namespace std;
@@ -15,16 +16,28 @@ public:
     ///   takes place.
     /// @param kernel Kernel* The kernel to be used to interpolate the
     ///   density between particles
-    /// @param size int The size of the regular grid, onto which the density
-    ///   values are interpolated
-    VTK(string path, Kernel* kernel, int size);
+    /// @param cells int* The number of cells of the grid in x, y and z
+    ///   direction. The grid has one more point than cells in each direction.
+    /// @param offset float* The lower corner of the grid
+    /// @param size float* The size of the grid in x, y and z direction, on
+    ///   which the density values are interpolated
+    /// @param nrOfThreads int The number of threads interpolating the density
+    VTK(string path, Kernel* kernel, int* cells, float* offset, float* size, int nrOfThreads);
 
     /// Writes the density out as a VTK file, interpolating the values on a
     /// regular grid.
     ///
     /// @param density float* The density values of the particles
     /// @param position float* The position values of the particles
-    void WriteDensity(float* density, float* position);
+    /// @param N int The number of particles
+    /// @return long The number of bytes written
+    long WriteDensity(float* density, float* position, int N);
+
+    /// Sets the number in the name of the next file, which a restarted run
+    /// continues from the step it restarts at.
+    ///
+    /// @param count int The number of the next file
+    void SetCount(int count) {_count = count;}
 
 private:
     /// @var _path string The path where the files are saved
@@ -35,13 +48,6 @@ private:
     ///   of incrementing names.
     int _count;
 
-    /// @var _size int The size of the regular grid, onto which the density
-    ///   values are interpolated.
-    int _size;
-
-    /// @var _mass float The particle mass.
-    float _mass;
-
-    /// @var _kernel Kernel The kernel used for interpolation.
-    Kernel* _kernel;
+    /// @var _field DensityField The grid the density is interpolated on
+    DensityField _field;
 };
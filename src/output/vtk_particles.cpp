@@ -0,0 +1,207 @@
+#include "output/vtk_particles.h"
+#include "util/parallel_bounds.h"
+#include <algorithm>
+#include <omp.h>
+
+#ifdef SPH_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+using namespace std;
+
+/// @var COMPRESSION_BLOCK_SIZE uint64_t The number of bytes compressed as
+///     one block, which is the block size VTK itself uses
+static const uint64_t COMPRESSION_BLOCK_SIZE = 32768;
+
+VTKParticles::VTKParticles(string path, int nrOfPieces, bool compress) {
+    _path = path;
+    _count = 1;
+    _nrOfPieces = std::max(1, nrOfPieces);
+    _compress = compress;
+
+#ifndef SPH_HAVE_ZLIB
+    if (_compress) {
+        printf("Built without zlib, the VTK particle output is not compressed\n");
+        _compress = false;
+    }
+#endif
+}
+
+VTKParticles::AppendedArray VTKParticles::Encode(const char* name, const char* type, int components, const void* data, uint64_t bytes) {
+    AppendedArray array;
+    array.name = name;
+    array.type = type;
+    array.components = components;
+    array.bytes = bytes;
+    array.data = (const char*)data;
+
+    if (!_compress) {
+        array.header.push_back(bytes);
+        return array;
+    }
+
+#ifdef SPH_HAVE_ZLIB
+    // the header holds the number of blocks, the size of the blocks, the
+    // size of the last block if it is not full or else zero and the
+    // compressed size of each block
+    uint64_t nrOfBlocks = (bytes + COMPRESSION_BLOCK_SIZE - 1) / COMPRESSION_BLOCK_SIZE;
+    array.header.push_back(nrOfBlocks);
+    array.header.push_back(COMPRESSION_BLOCK_SIZE);
+    array.header.push_back(bytes % COMPRESSION_BLOCK_SIZE);
+
+    array.compressed.resize(nrOfBlocks * compressBound(COMPRESSION_BLOCK_SIZE));
+    uint64_t used = 0;
+
+    for (uint64_t b = 0; b < nrOfBlocks; b++) {
+        uint64_t blockBytes = std::min(COMPRESSION_BLOCK_SIZE, bytes - b * COMPRESSION_BLOCK_SIZE);
+        uLongf compressedBytes = array.compressed.size() - used;
+
+        compress2(
+            array.compressed.data() + used,
+            &compressedBytes,
+            (const Bytef*)array.data + b * COMPRESSION_BLOCK_SIZE,
+            blockBytes,
+            Z_BEST_SPEED
+        );
+
+        array.header.push_back(compressedBytes);
+        used += compressedBytes;
+    }
+
+    array.compressed.resize(used);
+    array.data = NULL;
+#endif
+
+    return array;
+}
+
+void VTKParticles::WriteFileAttributes(FILE* handle, const char* type) {
+    unsigned int one = 1;
+    bool littleEndian = *(unsigned char*)&one == 1;
+
+    fprintf(handle, "<?xml version=\"1.0\"?>\n");
+    fprintf(handle, "<VTKFile type=\"%s\" version=\"1.0\" byte_order=\"%s\" header_type=\"UInt64\"",
+        type, littleEndian ? "LittleEndian" : "BigEndian");
+    if (_compress) {
+        fprintf(handle, " compressor=\"vtkZLibDataCompressor\"");
+    }
+    fprintf(handle, ">\n");
+}
+
+long VTKParticles::WritePiece(int piece, int lower, int upper, float* position, float* velocity,
+        float* density, float* pressure, int* ids) {
+    int n = upper - lower;
+
+    // each particle is a vertex, so ParaView shows them without further
+    // filters
+    std::vector<int> connectivity(n);
+    std::vector<int> offsets(n);
+    for (int i = 0; i < n; i++) {
+        connectivity[i] = i;
+        offsets[i] = i + 1;
+    }
+
+    std::vector<AppendedArray> arrays;
+    arrays.push_back(this->Encode(NULL, "Float32", 3, position + 3 * lower, 3 * n * sizeof(float)));
+    arrays.push_back(this->Encode("connectivity", "Int32", 1, connectivity.data(), n * sizeof(int)));
+    arrays.push_back(this->Encode("offsets", "Int32", 1, offsets.data(), n * sizeof(int)));
+    arrays.push_back(this->Encode("velocity", "Float32", 3, velocity + 3 * lower, 3 * n * sizeof(float)));
+    arrays.push_back(this->Encode("density", "Float32", 1, density + lower, n * sizeof(float)));
+    arrays.push_back(this->Encode("pressure", "Float32", 1, pressure + lower, n * sizeof(float)));
+    arrays.push_back(this->Encode("id", "Int32", 1, ids + lower, n * sizeof(int)));
+
+    std::vector<uint64_t> offset(arrays.size() + 1, 0);
+    for (size_t a = 0; a < arrays.size(); a++) {
+        offset[a + 1] = offset[a] + arrays[a].size();
+    }
+
+    char* filename = new char[255];
+    sprintf(filename, "%sparticles_%i_%i.vtp", _path.c_str(), _count, piece);
+    FILE* handle = fopen(filename, "wb");
+    delete[] filename;
+
+    this->WriteFileAttributes(handle, "PolyData");
+    fprintf(handle, "<PolyData>\n");
+    fprintf(handle, "<Piece NumberOfPoints=\"%i\" NumberOfVerts=\"%i\">\n", n, n);
+
+    fprintf(handle, "<Points>\n");
+    fprintf(handle, "<DataArray type=\"%s\" NumberOfComponents=\"3\" format=\"appended\" offset=\"%lu\"/>\n",
+        arrays[0].type, (unsigned long)offset[0]);
+    fprintf(handle, "</Points>\n");
+
+    fprintf(handle, "<Verts>\n");
+    for (size_t a = 1; a < 3; a++) {
+        fprintf(handle, "<DataArray type=\"%s\" Name=\"%s\" format=\"appended\" offset=\"%lu\"/>\n",
+            arrays[a].type, arrays[a].name, (unsigned long)offset[a]);
+    }
+    fprintf(handle, "</Verts>\n");
+
+    fprintf(handle, "<PointData Scalars=\"density\" Vectors=\"velocity\">\n");
+    for (size_t a = 3; a < arrays.size(); a++) {
+        fprintf(handle, "<DataArray type=\"%s\" Name=\"%s\" NumberOfComponents=\"%i\" format=\"appended\" offset=\"%lu\"/>\n",
+            arrays[a].type, arrays[a].name, arrays[a].components, (unsigned long)offset[a]);
+    }
+    fprintf(handle, "</PointData>\n");
+
+    fprintf(handle, "</Piece>\n");
+    fprintf(handle, "</PolyData>\n");
+
+    // the offsets of the arrays count from after the underscore
+    fprintf(handle, "<AppendedData encoding=\"raw\">\n_");
+    for (size_t a = 0; a < arrays.size(); a++) {
+        fwrite(arrays[a].header.data(), sizeof(uint64_t), arrays[a].header.size(), handle);
+        if (arrays[a].data != NULL) {
+            fwrite(arrays[a].data, 1, arrays[a].bytes, handle);
+        } else {
+            fwrite(arrays[a].compressed.data(), 1, arrays[a].compressed.size(), handle);
+        }
+    }
+    fprintf(handle, "\n</AppendedData>\n");
+    fprintf(handle, "</VTKFile>\n");
+
+    long bytes = ftell(handle);
+    fclose(handle);
+    return bytes;
+}
+
+long VTKParticles::WriteParticles(float* position, float* velocity, float* density, float* pressure, int* ids, int N) {
+    ParallelBounds pBounds = ParallelBounds(_nrOfPieces, N);
+    long bytes = 0;
+
+    #pragma omp parallel for num_threads(_nrOfPieces) reduction(+:bytes)
+    for (int piece = 0; piece < _nrOfPieces; piece++) {
+        bytes += this->WritePiece(piece, pBounds.lower(piece), pBounds.upper(piece),
+            position, velocity, density, pressure, ids);
+    }
+
+    char* filename = new char[255];
+    sprintf(filename, "%sparticles_%i.pvtp", _path.c_str(), _count);
+    FILE* handle = fopen(filename, "w");
+    delete[] filename;
+
+    this->WriteFileAttributes(handle, "PPolyData");
+    fprintf(handle, "<PPolyData GhostLevel=\"0\">\n");
+    fprintf(handle, "<PPoints>\n");
+    fprintf(handle, "<PDataArray type=\"Float32\" NumberOfComponents=\"3\"/>\n");
+    fprintf(handle, "</PPoints>\n");
+    fprintf(handle, "<PPointData Scalars=\"density\" Vectors=\"velocity\">\n");
+    fprintf(handle, "<PDataArray type=\"Float32\" Name=\"velocity\" NumberOfComponents=\"3\"/>\n");
+    fprintf(handle, "<PDataArray type=\"Float32\" Name=\"density\" NumberOfComponents=\"1\"/>\n");
+    fprintf(handle, "<PDataArray type=\"Float32\" Name=\"pressure\" NumberOfComponents=\"1\"/>\n");
+    fprintf(handle, "<PDataArray type=\"Int32\" Name=\"id\" NumberOfComponents=\"1\"/>\n");
+    fprintf(handle, "</PPointData>\n");
+
+    // the pieces are referenced relative to the index file
+    for (int piece = 0; piece < _nrOfPieces; piece++) {
+        fprintf(handle, "<Piece Source=\"particles_%i_%i.vtp\"/>\n", _count, piece);
+    }
+
+    fprintf(handle, "</PPolyData>\n");
+    fprintf(handle, "</VTKFile>\n");
+
+    bytes += ftell(handle);
+    fclose(handle);
+
+    _count++;
+    return bytes;
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/// Writes the particles as VTK PolyData in the XML format with the data
+/// appended in binary, which ParaView reads much faster than ASCII. The
+/// particles are split into pieces, which are written in parallel to their
+/// own .vtp files and tied together by a .pvtp file per call.
+class VTKParticles {
+public:
+    /// Constructor. Creates a new instance saving the output in the given
+    /// path.
+    ///
+    /// @param path string Where the output will be saved. The path should
+    ///   end with a slash if a directory is targeted, as no directory detection
+    ///   takes place.
+    /// @param nrOfPieces int The number of pieces and threads writing them
+    /// @param compress bool If the data is compressed with zlib. Is ignored
+    ///   with a warning if the program was built without zlib.
+    VTKParticles(string path, int nrOfPieces, bool compress);
+
+    /// Writes the particles out as a .pvtp file and a .vtp file for each
+    /// piece.
+    ///
+    /// @param position float* The particle positions
+    /// @param velocity float* The particle velocities
+    /// @param density float* The particle densities
+    /// @param pressure float* The particle pressures
+    /// @param ids int* The particle IDs
+    /// @param N int The number of particles
+    /// @return long The number of bytes written
+    long WriteParticles(float* position, float* velocity, float* density, float* pressure, int* ids, int N);
+
+    /// Sets the number in the names of the next files, so a restarted run
+    /// does not overwrite the files of the run before.
+    ///
+    /// @param count int The number of the next files
+    void SetCount(int count) {_count = count;}
+
+private:
+    /// An array of the appended data, encoded with the header the VTK
+    /// reader expects in front of it.
+    struct AppendedArray {
+        /// @var name const char* The name of the array, or NULL for the
+        ///   points and cells, which have no name
+        const char* name;
+
+        /// @var type const char* The VTK type of the values
+        const char* type;
+
+        /// @var components int The number of components of each value
+        int components;
+
+        /// @var header std::vector<uint64_t> The header in front of the data
+        std::vector<uint64_t> header;
+
+        /// @var data const char* The uncompressed data, or NULL if the data
+        ///   is compressed
+        const char* data;
+
+        /// @var bytes uint64_t The number of bytes of the uncompressed data
+        uint64_t bytes;
+
+        /// @var compressed std::vector<unsigned char> The compressed blocks
+        std::vector<unsigned char> compressed;
+
+        /// Returns the number of bytes the array takes in the appended data.
+        ///
+        /// @return uint64_t The size of the header and the data
+        uint64_t size() {
+            return header.size() * sizeof(uint64_t) + (data != NULL ? bytes : compressed.size());
+        }
+    };
+
+    /// Encodes the given values as an appended array. The data must stay
+    /// valid until the array is written, as uncompressed data is not copied.
+    ///
+    /// @param name const char* The name of the array
+    /// @param type const char* The VTK type of the values
+    /// @param components int The number of components of each value
+    /// @param data const void* The values
+    /// @param bytes uint64_t The number of bytes of the values
+    /// @return AppendedArray The encoded array
+    AppendedArray Encode(const char* name, const char* type, int components, const void* data, uint64_t bytes);
+
+    /// Writes the .vtp file of a piece with the given particles.
+    ///
+    /// @param piece int The number of the piece
+    /// @param lower int The first particle of the piece
+    /// @param upper int The particle after the last one of the piece
+    /// @param position float* The particle positions
+    /// @param velocity float* The particle velocities
+    /// @param density float* The particle densities
+    /// @param pressure float* The particle pressures
+    /// @param ids int* The particle IDs
+    /// @return long The number of bytes written
+    long WritePiece(int piece, int lower, int upper, float* position, float* velocity,
+        float* density, float* pressure, int* ids);
+
+    /// Writes the attributes of the VTKFile element, which are the same for
+    /// the pieces and the index.
+    ///
+    /// @param handle FILE* The file to write to
+    /// @param type const char* The type of the data set
+    void WriteFileAttributes(FILE* handle, const char* type);
+
+    /// @var _path string The path where the files are saved
+    string _path;
+
+    /// @var _count int Counts up since construction and increments on each
+    ///   call of WriteParticles, so the particles of each call are saved in
+    ///   files of incrementing names.
+    int _count;
+
+    /// @var _nrOfPieces int The number of pieces
+    int _nrOfPieces;
+
+    /// @var _compress bool If the data is compressed with zlib
+    bool _compress;
+};
@@ -1,48 +1,93 @@
 #include <cmath>
 #include <cstdio>
+#include <cstdlib>
 #include "simulation/compute.h"
 #include "simulation/initialization.h"
+#include "kernel/poly_6.h"
+#include "kernel/spiky.h"
+#include "kernel/wendland.h"
+#include "kernel/tabulated_kernel.h"
 #include "util/misc_math.h"
+#include "util/morton.h"
+#include "util/checkpoint.h"
+#include <algorithm>
 #include <string>
 #include <omp.h>
 
 Compute::Compute(YAML::Node& param, Kernel* kernel_d, Kernel* kernel_p, Kernel* kernel_v) {
     _isFirstStep = true;
+    _stepCount = 0;
+    _lastReorderStep = -param["reorder_interval"].as<int>();
+    _totalStepTime = 0.0;
+    _time = 0.0;
+    _dt = param["dt"].as<float>();
+    _previousDt = _dt;
     int N = param["N"].as<int>();
     float h = param["h"].as<float>();
 
+    // the hash is taken before N is changed to the number of particles
+    // actually created, so it is the same for each run with these parameters
+    _paramHash = hashParameters(param);
+
     _param = param;
     _kernel_density = kernel_d;
     _kernel_pressure = kernel_p;
     _kernel_viscosity = kernel_v;
 
-    // We don't necessarily create all N particles,
-    // so we need to reduce N to the actual number created
+    // A restart takes the particles from the checkpoint, which is much faster
+    // than creating them again for the more elaborate distributions
     Initialization init = Initialization(_param);
-    float* tmp = new float[3 * N];
+    CheckpointReader checkpoint;
+    bool restart = param["restart"].as<bool>() && this->OpenCheckpoint(checkpoint);
 
-    int nrCreated = init.InitPosition(tmp);
-    if (nrCreated < N) {
-        printf("We wanted %d particles but only created %d\n", N, nrCreated);
+    int nrCreated = 0;
+    float* tmp = NULL;
+    if (restart) {
+        size_t bytes = 0;
+        checkpoint.find("position", bytes);
+        nrCreated = bytes / (3 * sizeof(float));
+    } else {
+        // We don't necessarily create all N particles,
+        // so we need to reduce N to the actual number created
+        tmp = new float[3 * N];
+        nrCreated = init.InitPosition(tmp);
+        if (nrCreated < N) {
+            printf("We wanted %d particles but only created %d\n", N, nrCreated);
+        }
     }
     _param["N"] = std::to_string(nrCreated);
     N = nrCreated;
 
+    // the kernels interpolate over all particles for the output
+    kernel_d->SetN(N);
+    kernel_p->SetN(N);
+    kernel_v->SetN(N);
+
     // copy over positions
     _position = new float[3 * N];
-    for (int i = 0; i < 3 * N; i++) {
-        _position[i] = tmp[i];
+    if (tmp != NULL) {
+        for (int i = 0; i < 3 * N; i++) {
+            _position[i] = tmp[i];
+        }
+        delete[] tmp;
     }
-    delete[] tmp;
 
-    _dr = new float[3];
-    _fod = new float[3];
     _matr1 = new float[9];
     _velocity_halfs = new float[3 * N];
     _velocity = new float[3 * N];
     _force = new float[3 * N];
     _density = new float[N];
     _pressure = new float[N];
+    _ids = new int[N];
+    _reorderBuffer = new float[3 * N];
+    _reorderIds = new int[N];
+    _reorderKeys = std::vector<std::pair<uint64_t, int>>(N);
+    _cost = new float[N];
+
+    for (int i = 0; i < N; i++) {
+        _ids[i] = i;
+        _cost[i] = 1.f;
+    }
 
     float* tmp2 = new float[6];
     tmp2[0] = param["bbox_x_lower"].as<float>();
@@ -52,15 +97,167 @@ Compute::Compute(YAML::Node& param, Kernel* kernel_d, Kernel* kernel_p, Kernel*
     tmp2[4] = param["bbox_y_upper"].as<float>();
     tmp2[5] = param["bbox_z_upper"].as<float>();
 
-    _neighbors = new Neighbors(h, N, tmp2);
+    // With Verlet lists the grid is used to find all particles within the
+    // smoothing length plus the skin, so the cells must be that large
+    float skin = param["verlet_skin"].as<float>();
+
+    // The cell pair traversal works on the grid directly, so it can not be
+    // combined with Verlet lists
+    _useCellPairs = param["traversal"].as<std::string>() == "cell_pairs";
+    if (_useCellPairs && skin > 0.f) {
+        printf("Verlet lists are not used with the cell pair traversal\n");
+        skin = 0.f;
+    }
+
+    _neighbors = new Neighbors(
+        h + skin,
+        N,
+        tmp2,
+        param["neighbor_grid"].as<std::string>() == "hashed"
+    );
     delete[] tmp2;
 
+    _verlet = NULL;
+    if (skin > 0.f) {
+        _verlet = new VerletList(h, skin, N);
+    }
+
+    // The density and force loops are compiled for this combination of
+    // kernels with the kernel functions inlined, other kernels use the
+    // generic loops with virtual calls
+    _kernelCombination = KERNELS_GENERIC;
+    if (dynamic_cast<Poly6*>(kernel_d) != NULL
+            && dynamic_cast<Spiky*>(kernel_p) != NULL
+            && dynamic_cast<Wendland*>(kernel_v) != NULL) {
+        _kernelCombination = KERNELS_POLY6_SPIKY_WENDLAND;
+    } else if (dynamic_cast<TabulatedKernel*>(kernel_d) != NULL
+            && dynamic_cast<TabulatedKernel*>(kernel_p) != NULL
+            && dynamic_cast<TabulatedKernel*>(kernel_v) != NULL) {
+        _kernelCombination = KERNELS_TABULATED;
+    }
+
+    // The vectorized kernels have the kernel functions built in, so they are
+    // only used for the same kernels
+    std::string simdMode = param["simd"].as<std::string>();
+    if (simdMode != "off" && _kernelCombination != KERNELS_POLY6_SPIKY_WENDLAND) {
+        printf("Vectorized kernels are only available for Poly6, Spiky and Wendland\n");
+        simdMode = "off";
+    }
+
+    // With the continuity density the density change is calculated in the
+    // pair loop of the forces, which the vectorized kernels do not do
+    _continuityDensity = param["density_mode"].as<std::string>() == "continuity";
+    if (simdMode != "off" && _continuityDensity) {
+        printf("Vectorized kernels are not used with the continuity density\n");
+        simdMode = "off";
+    }
+    _simd = new SimdKernels(
+        simdMode,
+        h,
+        param["mass"].as<float>(),
+        param["mu"].as<float>(),
+        param["epsilon"].as<float>()
+    );
+    printf("Vectorized kernels: %s\n", _simd->GetLevelName());
+
     _bounds = new ParallelBounds(param["nr_of_threads"].as<int>(), N);
 
+    // The costs are the neighbor candidates counted in the density loop,
+    // which the cell pair traversal does not count for each particle, and
+    // which only runs every few steps with the continuity density
+    _balanceCosts = param["load_balancing"].as<std::string>() == "cost";
+    if (_balanceCosts && (_useCellPairs || _continuityDensity)) {
+        printf("Cost load balancing is not used with the cell pair traversal "
+            "or the continuity density\n");
+        _balanceCosts = false;
+    }
+
+    // The implicit pressure solver needs some more data per particle, which
+    // is only kept during a time step
+    _implicitPressure = param["pressure_model"].as<std::string>() == "P_IMPLICIT";
+    _pressureGuess = NULL;
+    _advectionDensity = NULL;
+    _diagonal = NULL;
+    _advectionVelocity = NULL;
+    _displacement = NULL;
+    _pressureAcceleration = NULL;
+    _totalPressureIterations = 0;
+    if (_implicitPressure) {
+        _pressureGuess = new float[N];
+        _advectionDensity = new float[N];
+        _diagonal = new float[N];
+        _advectionVelocity = new float[3 * N];
+        _displacement = new float[3 * N];
+        _pressureAcceleration = new float[3 * N];
+        _threadErrors = std::vector<double>(_bounds->getNrOfThreads());
+    }
+
+    // Only the part of each buffer after the range of the thread is ever
+    // used and cleared, so the rest is never touched
+    _threadForces = new float[(size_t)_bounds->getNrOfThreads() * 3 * N];
+    _threadForceEnd = std::vector<int>(_bounds->getNrOfThreads());
+    _threadBusyTime = std::vector<double>(_bounds->getNrOfThreads());
+
+    _densityRate = NULL;
+    _threadDensityRates = NULL;
+    if (_continuityDensity) {
+        _densityRate = new float[N];
+        _threadDensityRates = new float[(size_t)_bounds->getNrOfThreads() * N];
+    }
+    _threadMaxima = std::vector<float>(3 * _bounds->getNrOfThreads());
+
+    // With individual time steps the forces of a particle are only
+    // calculated as often as its own step requires. This needs the forces
+    // of each particle to be calculated from its neighbors alone, so it
+    // does not work with the cell pair traversal and the continuity density,
+    // and not with the implicit pressure, which is solved for all particles
+    _timestepLevels = std::max(1, param["timestep_levels"].as<int>());
+    if (_timestepLevels > 1 && (_useCellPairs || _continuityDensity || _implicitPressure)) {
+        printf("Individual time steps are not used with the cell pair traversal, "
+            "the continuity density or the implicit pressure\n");
+        _timestepLevels = 1;
+    }
+    if (_timestepLevels > 1 && param["adaptive_dt"].as<bool>()) {
+        printf("Adaptive time steps are replaced by the individual time steps\n");
+    }
+
+    _particleDt = NULL;
+    _activeCount = N;
+    if (_timestepLevels > 1) {
+        _dt = param["dt"].as<float>() / (1 << (_timestepLevels - 1));
+        _previousDt = _dt;
+        _particleDt = new float[N];
+        for (int i = 0; i < N; i++) {
+            _particleDt[i] = param["dt"].as<float>();
+        }
+    }
+
+    // Sleeping particles are skipped like inactive ones with individual time
+    // steps, so the same restrictions apply
+    _sleepSteps = std::max(0, param["sleep_steps"].as<int>());
+    if (_sleepSteps > 0 && (_useCellPairs || _continuityDensity || _implicitPressure)) {
+        printf("Sleeping particles are not used with the cell pair traversal, "
+            "the continuity density or the implicit pressure\n");
+        _sleepSteps = 0;
+    }
+
+    _quietSteps = NULL;
+    _disturbed = NULL;
+    if (_sleepSteps > 0) {
+        _quietSteps = new float[N];
+        _disturbed = new char[N];
+        std::fill(_quietSteps, _quietSteps + N, 0.f);
+        std::fill(_disturbed, _disturbed + N, 0);
+    }
+
     init.InitVelocity(_velocity);
     init.InitPressure(_pressure);
     init.InitForce(_force);
     init.InitDensity(_density);
+
+    if (restart) {
+        this->RestoreCheckpoint(checkpoint);
+    }
 }
 
 Compute::~Compute() {
@@ -70,225 +267,1290 @@ Compute::~Compute() {
     delete[] _force;
     delete[] _density;
     delete[] _pressure;
-    delete[] _dr;
-    delete[] _fod;
+    delete[] _ids;
+    delete[] _reorderBuffer;
+    delete[] _reorderIds;
+    delete[] _cost;
+    delete[] _particleDt;
+    delete[] _quietSteps;
+    delete[] _disturbed;
+    delete[] _densityRate;
+    delete[] _threadDensityRates;
+    delete[] _pressureGuess;
+    delete[] _advectionDensity;
+    delete[] _diagonal;
+    delete[] _advectionVelocity;
+    delete[] _displacement;
+    delete[] _pressureAcceleration;
+    delete[] _threadForces;
     delete[] _matr1;
     delete _neighbors;
+    delete _verlet;
+    delete _simd;
     delete _bounds;
 }
+/// Returns the value of the kernel at the given squared distance.
+///
+/// @param kernel K* The kernel
+/// @param r2 float The squared distance
+/// @return float The value of the kernel
+template <typename K>
+inline float kernelValueOfSquared(K* kernel, float r2) {
+    return kernel->ValueOf(fastSqrt2(r2));
+}
+
+/// Tabulated kernels are indexed by the squared distance, so they do not
+/// need the square root.
+inline float kernelValueOfSquared(TabulatedKernel* kernel, float r2) {
+    return kernel->ValueOfSquared(r2);
+}
+
 void Compute::CalculateDensity() {
+    #pragma omp parallel
+    this->CalculateDensityInRegion(omp_get_thread_num());
+}
+
+void Compute::CalculateDensityInRegion(int threadNum) {
+    if (_kernelCombination == KERNELS_POLY6_SPIKY_WENDLAND) {
+        this->CalculateDensityWith(static_cast<Poly6*>(_kernel_density), threadNum);
+    } else if (_kernelCombination == KERNELS_TABULATED) {
+        this->CalculateDensityWith(static_cast<TabulatedKernel*>(_kernel_density), threadNum);
+    } else {
+        this->CalculateDensityWith(_kernel_density, threadNum);
+    }
+}
+
+template <typename KD>
+void Compute::CalculateDensityWith(KD* kernel, int threadNum) {
     float mass = _param["mass"].as<float>();
     float h = _param["h"].as<float>();
 
-    #pragma omp parallel
-    {
-        int threadNum = omp_get_thread_num();
+    if (_useCellPairs) {
+        // Each pair contributes to the density of both particles, so we
+        // start with the contribution of each particle to itself
+        float selfDensity = mass * kernel->ValueOf(0.f);
 
         for (int i = _bounds->lower(threadNum); i < _bounds->upper(threadNum); i++) {
-            float sum = 0.0;
-            float distance = 0.0;
-
-            std::vector<int> candidates = std::vector<int>();
-            _neighbors->getNeighbors(i, candidates);
-            for (uint k = 0; k < candidates.size(); k++) {
-                int j = candidates.at(k);
-
-                distance = fastSqrt2(
-                    (_position[i * 3] - _position[j * 3]) * (_position[i * 3] - _position[j * 3])
-                    + (_position[i * 3 + 1] - _position[j * 3 + 1]) * (_position[i * 3 + 1] - _position[j * 3 + 1])
-                    + (_position[i * 3 + 2] - _position[j * 3 + 2]) * (_position[i * 3 + 2] - _position[j * 3 + 2])
-                );
-                if (distance <= h) sum += mass * _kernel_density->ValueOf(distance);
-            }
+            _density[i] = selfDensity;
+        }
+
+        #pragma omp barrier
+
+        double start = omp_get_wtime();
+        auto pairDensity = [&](int i, int j) {
+            float contribution = this->DensityContribution(kernel, i, j, mass, h);
+            _density[i] += contribution;
+            _density[j] += contribution;
+        };
+        _neighbors->forEachPair(threadNum, _bounds->getNrOfThreads(), pairDensity);
+        _threadBusyTime[threadNum] += omp_get_wtime() - start;
+
+        return;
+    }
+
+    std::vector<int> candidates = std::vector<int>();
+    int* list;
+    int nrOfCandidates;
+    double start = omp_get_wtime();
+
+    for (int i = _bounds->lower(threadNum); i < _bounds->upper(threadNum); i++) {
+        float sum = 0.0;
 
-            _density[i] = sum;
+        // the density of inactive particles is kept from their last active
+        // step, as it is only needed for the forces
+        if (!this->IsActive(i)) {
+            _cost[i] = 1.f;
+            continue;
+        }
+
+        this->GetCandidates(i, candidates, list, nrOfCandidates);
+
+        // the work on a particle in the density and force loops grows with
+        // its number of neighbor candidates
+        _cost[i] = 1.f + nrOfCandidates;
+
+        if (_simd->IsEnabled()) {
+            _density[i] = _simd->DensitySum(_position, i, list, nrOfCandidates);
+            continue;
+        }
+
+        for (int k = 0; k < nrOfCandidates; k++) {
+            sum += this->DensityContribution(kernel, i, list[k], mass, h);
+        }
+
+        _density[i] = sum;
+    }
+
+    _threadBusyTime[threadNum] += omp_get_wtime() - start;
+}
+
+template <typename KD>
+float Compute::DensityContribution(KD* kernel, int i, int j, float mass, float h) {
+    float dx = _position[i * 3] - _position[j * 3];
+    float dy = _position[i * 3 + 1] - _position[j * 3 + 1];
+    float dz = _position[i * 3 + 2] - _position[j * 3 + 2];
+    float r2 = dx * dx + dy * dy + dz * dz;
+
+    if (r2 > h * h) {
+        return 0.f;
+    }
+
+    return mass * kernelValueOfSquared(kernel, r2);
+}
+
+void Compute::GetCandidates(int idx, std::vector<int>& candidates, int*& list, int& nrOfCandidates) {
+    if (_verlet != NULL) {
+        list = _verlet->getNeighbors(idx);
+        nrOfCandidates = _verlet->getNrOfNeighbors(idx);
+    } else {
+        candidates.clear();
+        _neighbors->getNeighbors(idx, candidates);
+        list = candidates.data();
+        nrOfCandidates = candidates.size();
+    }
+}
+
+void Compute::UpdateNeighbors() {
+    #pragma omp parallel
+    this->UpdateNeighborsInRegion(omp_get_thread_num());
+}
+
+void Compute::UpdateNeighborsInRegion(int threadNum) {
+    // With Verlet lists we only need to search for neighbors once a particle
+    // might have moved into the range of another particle, which is
+    // not listed as its neighbor. Reordering invalidates the lists, so we
+    // only reorder when the lists are built anyway
+    if (_verlet != NULL && !_verlet->needsRebuildInRegion(_position, *_bounds, threadNum)) {
+        #pragma omp master
+        if (_param["verlet_statistics"].as<bool>()) {
+            printf("Verlet lists reused (%d builds in %d steps); ",
+                _verlet->getNrOfBuilds(), _verlet->getNrOfChecks());
+        }
+        return;
+    }
+
+    // all threads see the same step counts, so they all take part in the
+    // reordering. the last reorder step is only changed once all of them
+    // passed the barriers of the reordering
+    int reorderInterval = _param["reorder_interval"].as<int>();
+    if (reorderInterval > 0 && _stepCount - _lastReorderStep >= reorderInterval) {
+        this->ReorderParticlesInRegion(threadNum);
+
+        #pragma omp master
+        _lastReorderStep = _stepCount;
+    }
+
+    _neighbors->sortParticlesIntoGridInRegion(_position, *_bounds, threadNum);
+
+    if (_verlet != NULL) {
+        _verlet->buildInRegion(_position, *_neighbors, *_bounds, threadNum);
+
+        #pragma omp master
+        if (_param["verlet_statistics"].as<bool>()) {
+            printf("Verlet lists built (%d builds in %d steps); ",
+                _verlet->getNrOfBuilds(), _verlet->getNrOfChecks());
         }
     }
 }
 
 void Compute::Timestep() {
-    _neighbors->sortParticlesIntoGrid(_position, *_bounds);
+    // the costs are the neighbor counts of the last step, which change only
+    // slowly as the particles move
+    if (_balanceCosts) {
+        _bounds->balance(_cost);
+    }
+
+    // With the continuity density, the density is only summed up in the
+    // first step and then every few steps to correct the drift
+    int resummationInterval = _param["density_resummation_interval"].as<int>();
+    bool sumDensity = !_continuityDensity || _isFirstStep
+        || (resummationInterval > 0 && _stepCount % resummationInterval == 0);
+
+    std::fill(_threadBusyTime.begin(), _threadBusyTime.end(), 0.0);
+    double start = omp_get_wtime();
+
+    if (_param["parallel_regions"].as<std::string>() == "phases") {
+        this->UpdateNeighbors();
+
+        if (sumDensity) {
+            this->CalculateDensity();
+        }
+        this->CalculatePressure();
+        this->CalculateForces();
+        this->ChooseTimestep();
+        if (_implicitPressure) {
+            this->SolvePressure();
+        }
+        this->VelocityIntegration(_isFirstStep);
+        this->PositionIntegration();
+
+    } else {
+        // One parallel region for the whole timestep, so the threads are
+        // only started once. The phases synchronize with barriers where a
+        // thread reads data that other threads wrote in the phase before
+        #pragma omp parallel
+        {
+            int threadNum = omp_get_thread_num();
+
+            this->UpdateNeighborsInRegion(threadNum);
+
+            // the pressure of a particle needs its complete density, which
+            // other threads add to in the cell pair traversal
+            if (sumDensity) {
+                this->CalculateDensityInRegion(threadNum);
+                #pragma omp barrier
+            }
 
-    this->CalculateDensity();
-    this->CalculatePressure();
-    this->CalculateForces();
-    this->VelocityIntegration(_isFirstStep);
-    this->PositionIntegration();
+            // the forces start with a barrier after which all pressures are
+            // known, but the integration must wait for the other threads to
+            // stop reading the velocities
+            this->CalculatePressureInRegion(threadNum);
+            this->CalculateForcesInRegion(threadNum);
+            #pragma omp barrier
+
+            #pragma omp single
+            this->ChooseTimestep();
+
+            if (_implicitPressure) {
+                this->SolvePressureInRegion(threadNum);
+            }
+
+            this->VelocityIntegrationInRegion(_isFirstStep, threadNum);
+            this->PositionIntegrationInRegion(threadNum);
+        }
+    }
+
+    if (_param["timing"].as<bool>()) {
+        double elapsed = omp_get_wtime() - start;
+        _totalStepTime += elapsed;
+        printf("Step time: %.3f ms (average %.3f ms); ",
+            elapsed * 1000.0, _totalStepTime * 1000.0 / (_stepCount + 1));
+        this->PrintBusyTimes();
+    }
 
     _isFirstStep = false;
+    _stepCount++;
+    _time += _dt;
+
+    int checkpointInterval = _param["checkpoint_interval"].as<int>();
+    if (checkpointInterval > 0 && _stepCount % checkpointInterval == 0) {
+        this->WriteCheckpoint();
+    }
+}
+
+template <typename F>
+void Compute::ForEachCheckpointSection(F section) {
+    int N = _bounds->getN();
+
+    // everything the following steps depend on, including the data that is
+    // kept from earlier steps for inactive particles and the costs that
+    // decide the split among the threads, so a restart continues the run
+    // exactly
+    section("position", _position, 3 * N * sizeof(float));
+    section("velocity", _velocity, 3 * N * sizeof(float));
+    section("velocity_halfs", _velocity_halfs, 3 * N * sizeof(float));
+    section("force", _force, 3 * N * sizeof(float));
+    section("density", _density, N * sizeof(float));
+    section("pressure", _pressure, N * sizeof(float));
+    section("ids", _ids, N * sizeof(int));
+    section("cost", _cost, N * sizeof(float));
+    section("step_count", &_stepCount, sizeof(int));
+    section("last_reorder_step", &_lastReorderStep, sizeof(int));
+    section("is_first_step", &_isFirstStep, sizeof(bool));
+    section("time", &_time, sizeof(double));
+    section("dt", &_dt, sizeof(float));
+    section("previous_dt", &_previousDt, sizeof(float));
+    section("pressure_iterations", &_totalPressureIterations, sizeof(int));
+
+    if (_particleDt != NULL) {
+        section("particle_dt", _particleDt, N * sizeof(float));
+    }
+    if (_quietSteps != NULL) {
+        section("quiet_steps", _quietSteps, N * sizeof(float));
+    }
+}
+
+void Compute::WriteCheckpoint() {
+    std::string filename = _param["checkpoint_file"].as<std::string>();
+    CheckpointWriter writer = CheckpointWriter(_paramHash);
+
+    this->ForEachCheckpointSection([&](const char* name, void* data, size_t bytes) {
+        writer.add(name, data, bytes);
+    });
+    if (_verlet != NULL) {
+        _verlet->saveTo(writer);
+    }
+
+    if (writer.write(filename)) {
+        printf("Wrote checkpoint %s; ", filename.c_str());
+    } else {
+        printf("Could not write checkpoint %s; ", filename.c_str());
+    }
+}
+
+bool Compute::OpenCheckpoint(CheckpointReader& checkpoint) {
+    std::string filename = _param["checkpoint_file"].as<std::string>();
+
+    if (!checkpoint.open(filename)) {
+        printf("No valid checkpoint %s, starting from the initial state\n", filename.c_str());
+        return false;
+    }
+
+    // continuing with other parameters would not give the same results
+    if (checkpoint.getParamHash() != _paramHash) {
+        printf("Checkpoint %s was written with other parameters\n", filename.c_str());
+        exit(1);
+    }
+
+    return true;
+}
+
+void Compute::RestoreCheckpoint(CheckpointReader& checkpoint) {
+    std::string filename = _param["checkpoint_file"].as<std::string>();
+    bool complete = true;
+
+    this->ForEachCheckpointSection([&](const char* name, void* data, size_t bytes) {
+        if (!checkpoint.read(name, data, bytes)) {
+            printf("Checkpoint %s has no valid section %s\n", filename.c_str(), name);
+            complete = false;
+        }
+    });
+    if (_verlet != NULL && !_verlet->loadFrom(checkpoint)) {
+        printf("Checkpoint %s has no valid Verlet lists\n", filename.c_str());
+        complete = false;
+    }
+
+    if (!complete) {
+        exit(1);
+    }
+
+    printf("Restarted from checkpoint %s at step %d, time %f\n", filename.c_str(), _stepCount, _time);
+}
+
+void Compute::SolvePressure() {
+    #pragma omp parallel
+    this->SolvePressureInRegion(omp_get_thread_num());
+}
+
+void Compute::SolvePressureInRegion(int threadNum) {
+    // The density change is predicted with the gradient of the density
+    // kernel, so it matches the density calculated in the next step. The
+    // pressure forces must then use the same gradient
+    if (_kernelCombination == KERNELS_POLY6_SPIKY_WENDLAND) {
+        this->SolvePressureWith(static_cast<Poly6*>(_kernel_density), threadNum);
+    } else if (_kernelCombination == KERNELS_TABULATED) {
+        this->SolvePressureWith(static_cast<TabulatedKernel*>(_kernel_density), threadNum);
+    } else {
+        this->SolvePressureWith(_kernel_density, threadNum);
+    }
+}
+
+template <typename KD>
+void Compute::SolvePressureWith(KD* kernel, int threadNum) {
+    float mass = _param["mass"].as<float>();
+    float h = _param["h"].as<float>();
+    float rho0 = _param["rho0"].as<float>();
+    float tolerance = _param["pressure_tolerance"].as<float>();
+    float omega = _param["pressure_relaxation"].as<float>();
+    int maxIterations = _param["pressure_max_iterations"].as<int>();
+    int N = _bounds->getN();
+    int lower = _bounds->lower(threadNum);
+    int upper = _bounds->upper(threadNum);
+    float grad[3];
+
+    // The half step velocities change by kick times the acceleration, see
+    // VelocityIntegration, and the positions by dt times the half step
+    // velocities. So a pressure acceleration moves a particle by dt * kick
+    // times the acceleration, where the original method has dt squared
+    float kick = _isFirstStep ? 0.5f * _dt : 0.5f * (_previousDt + _dt);
+    float dt2 = _dt * kick;
+    float* velocity = _isFirstStep ? _velocity : _velocity_halfs;
+    float lowerBound[3] = {
+        _param["bbox_x_lower"].as<float>(),
+        _param["bbox_y_lower"].as<float>(),
+        _param["bbox_z_lower"].as<float>()
+    };
+    float upperBound[3] = {
+        _param["bbox_x_upper"].as<float>(),
+        _param["bbox_y_upper"].as<float>(),
+        _param["bbox_z_upper"].as<float>()
+    };
+
+    std::vector<int> candidates = std::vector<int>();
+    int* list;
+    int nrOfCandidates;
+
+    // the velocities without pressure and the displacement of each particle
+    // by its own pressure
+    for (int i = lower; i < upper; i++) {
+        float factor = -dt2 * mass / (_density[i] * _density[i]);
+        float d[3] = {0.f, 0.f, 0.f};
+
+        this->GetCandidates(i, candidates, list, nrOfCandidates);
+        for (int k = 0; k < nrOfCandidates; k++) {
+            if (!this->KernelGradient(kernel, i, list[k], h, grad)) {
+                continue;
+            }
+            d[0] += factor * grad[0];
+            d[1] += factor * grad[1];
+            d[2] += factor * grad[2];
+        }
+
+        for (int c = 0; c < 3; c++) {
+            float v = velocity[i * 3 + c] + kick * _force[i * 3 + c] / mass;
+
+            // the walls reflect particles that would leave the bounding
+            // box, so they do not move further in this direction
+            float x = _position[i * 3 + c] + _dt * v;
+            if (x < lowerBound[c] || x > upperBound[c]) {
+                v = 0.f;
+            }
+
+            _advectionVelocity[i * 3 + c] = v;
+            _displacement[i * 3 + c] = d[c];
+        }
+    }
+
+    #pragma omp barrier
+
+    // the density after moving with the velocities without pressure and the
+    // diagonal of the system, which is the density change of a particle
+    // by its own pressure
+    for (int i = lower; i < upper; i++) {
+        float factor = dt2 * mass / (_density[i] * _density[i]);
+        float* vi = _advectionVelocity + i * 3;
+        float* di = _displacement + i * 3;
+        float density = _density[i];
+        float diagonal = 0.f;
+
+        this->GetCandidates(i, candidates, list, nrOfCandidates);
+        for (int k = 0; k < nrOfCandidates; k++) {
+            int j = list[k];
+            if (!this->KernelGradient(kernel, i, j, h, grad)) {
+                continue;
+            }
+            float* vj = _advectionVelocity + j * 3;
+
+            density += _dt * mass * ((vi[0] - vj[0]) * grad[0]
+                + (vi[1] - vj[1]) * grad[1]
+                + (vi[2] - vj[2]) * grad[2]);
+
+            // the displacement of j by the pressure of i is factor * grad
+            diagonal += mass * ((di[0] - factor * grad[0]) * grad[0]
+                + (di[1] - factor * grad[1]) * grad[1]
+                + (di[2] - factor * grad[2]) * grad[2]);
+        }
+
+        _advectionDensity[i] = density;
+        _diagonal[i] = diagonal;
+        _pressure[i] = 0.5f * _pressureGuess[i];
+    }
+
+    // relaxed Jacobi iterations. the error is the average compression of
+    // the fluid, expansion is not counted as the pressure can not be
+    // negative. every thread finds the same error, so all of them do the
+    // same number of iterations
+    int iteration = 0;
+    float error = 0.f;
+
+    do {
+        #pragma omp barrier
+
+        this->CalculatePressureAccelerations(kernel, threadNum, mass, h);
+
+        #pragma omp barrier
+
+        double threadError = 0.0;
+        for (int i = lower; i < upper; i++) {
+            float* ai = _pressureAcceleration + i * 3;
+            float change = 0.f;
+
+            this->GetCandidates(i, candidates, list, nrOfCandidates);
+            for (int k = 0; k < nrOfCandidates; k++) {
+                int j = list[k];
+                if (!this->KernelGradient(kernel, i, j, h, grad)) {
+                    continue;
+                }
+                float* aj = _pressureAcceleration + j * 3;
+
+                change += mass * ((ai[0] - aj[0]) * grad[0]
+                    + (ai[1] - aj[1]) * grad[1]
+                    + (ai[2] - aj[2]) * grad[2]);
+            }
+
+            float residual = rho0 - _advectionDensity[i] - dt2 * change;
+            threadError += std::max(0.f, -residual);
+
+            if (_diagonal[i] != 0.f) {
+                _pressure[i] = std::max(0.f, _pressure[i] + omega * residual / _diagonal[i]);
+            } else {
+                _pressure[i] = 0.f;
+            }
+        }
+
+        _threadErrors[threadNum] = threadError;
+
+        #pragma omp barrier
+
+        double sum = 0.0;
+        for (int t = 0; t < _bounds->getNrOfThreads(); t++) {
+            sum += _threadErrors[t];
+        }
+        error = (float)(sum / N / rho0);
+        iteration++;
+
+    } while ((iteration < 2 || error > tolerance) && iteration < maxIterations);
+
+    // the pressure accelerations of the final pressure are added to the
+    // other forces
+    this->CalculatePressureAccelerations(kernel, threadNum, mass, h);
+    for (int i = lower * 3; i < upper * 3; i++) {
+        _force[i] += mass * _pressureAcceleration[i];
+    }
+
+    #pragma omp master
+    {
+        _totalPressureIterations += iteration;
+        printf("Pressure solver: %d iterations, density error %.3f%%, %.0f iterations per simulated second; ",
+            iteration, error * 100.f, _totalPressureIterations / (_time + _dt));
+    }
+
+    // the integration moves the particles, which other threads might still
+    // read above
+    #pragma omp barrier
+}
+
+template <typename KD>
+void Compute::CalculatePressureAccelerations(KD* kernel, int threadNum, float mass, float h) {
+    std::vector<int> candidates = std::vector<int>();
+    int* list;
+    int nrOfCandidates;
+    float grad[3];
+
+    for (int i = _bounds->lower(threadNum); i < _bounds->upper(threadNum); i++) {
+        float pi = _pressure[i] / (_density[i] * _density[i]);
+        float a[3] = {0.f, 0.f, 0.f};
+
+        this->GetCandidates(i, candidates, list, nrOfCandidates);
+        for (int k = 0; k < nrOfCandidates; k++) {
+            int j = list[k];
+            if (!this->KernelGradient(kernel, i, j, h, grad)) {
+                continue;
+            }
+
+            float tmp = mass * (pi + _pressure[j] / (_density[j] * _density[j]));
+            a[0] -= tmp * grad[0];
+            a[1] -= tmp * grad[1];
+            a[2] -= tmp * grad[2];
+        }
+
+        _pressureAcceleration[i * 3] = a[0];
+        _pressureAcceleration[i * 3 + 1] = a[1];
+        _pressureAcceleration[i * 3 + 2] = a[2];
+    }
+}
+
+template <typename KD>
+bool Compute::KernelGradient(KD* kernel, int i, int j, float h, float* grad) {
+    float dx = _position[i * 3] - _position[j * 3];
+    float dy = _position[i * 3 + 1] - _position[j * 3 + 1];
+    float dz = _position[i * 3 + 2] - _position[j * 3 + 2];
+    float r2 = dx * dx + dy * dy + dz * dz;
+
+    if (i == j || r2 >= h * h) {
+        return false;
+    }
+
+    kernel->FOD(dx, dy, dz, fastSqrt2(r2), grad);
+    return true;
+}
+
+float Compute::GetDt() {
+    return _dt;
+}
+
+double Compute::GetTime() {
+    return _time;
+}
+
+int Compute::GetStepCount() {
+    return _stepCount;
+}
+
+int Compute::GetActiveCount() {
+    return _activeCount;
+}
+
+void Compute::PrintBusyTimes() {
+    int T = _bounds->getNrOfThreads();
+    double maximum = 0.0, sum = 0.0;
+
+    printf("Busy time per thread:");
+    for (int t = 0; t < T; t++) {
+        printf(" %.3f", _threadBusyTime[t] * 1000.0);
+        maximum = std::max(maximum, _threadBusyTime[t]);
+        sum += _threadBusyTime[t];
+    }
+
+    // the slowest thread sets the pace, so the ratio of its time to the
+    // average is the factor lost to imbalance
+    printf(" ms (imbalance %.2f); ", sum > 0.0 ? maximum * T / sum : 1.0);
+}
+
+void Compute::ReorderParticles() {
+    #pragma omp parallel
+    this->ReorderParticlesInRegion(omp_get_thread_num());
+}
+
+void Compute::ReorderParticlesInRegion(int threadNum) {
+    float h = _param["h"].as<float>();
+    float lx = _param["bbox_x_lower"].as<float>();
+    float ly = _param["bbox_y_lower"].as<float>();
+    float lz = _param["bbox_z_lower"].as<float>();
+
+    // The keys are calculated on cells of the size of the smoothing length,
+    // the same as the neighbor grid uses. Particles outside of the bounding
+    // box are clamped to the outermost cells
+    float invh = 1.f / h;
+
+    for (int i = _bounds->lower(threadNum); i < _bounds->upper(threadNum); i++) {
+        int cx = std::max(0, (int)std::floor((_position[i * 3] - lx) * invh));
+        int cy = std::max(0, (int)std::floor((_position[i * 3 + 1] - ly) * invh));
+        int cz = std::max(0, (int)std::floor((_position[i * 3 + 2] - lz) * invh));
+        _reorderKeys[i] = std::make_pair(mortonKey(cx, cy, cz), i);
+    }
+
+    #pragma omp barrier
+
+    // the index is part of the sort key, so the order is deterministic
+    #pragma omp single
+    std::sort(_reorderKeys.begin(), _reorderKeys.end());
+
+    this->PermuteArrayInRegion(_position, 3, threadNum);
+    this->PermuteArrayInRegion(_velocity, 3, threadNum);
+    this->PermuteArrayInRegion(_velocity_halfs, 3, threadNum);
+    this->PermuteArrayInRegion(_force, 3, threadNum);
+    this->PermuteArrayInRegion(_density, 1, threadNum);
+    this->PermuteArrayInRegion(_pressure, 1, threadNum);
+    this->PermuteArrayInRegion(_cost, 1, threadNum);
+    if (_particleDt != NULL) {
+        this->PermuteArrayInRegion(_particleDt, 1, threadNum);
+    }
+    if (_quietSteps != NULL) {
+        this->PermuteArrayInRegion(_quietSteps, 1, threadNum);
+    }
+
+    for (int i = _bounds->lower(threadNum); i < _bounds->upper(threadNum); i++) {
+        _reorderIds[i] = _ids[_reorderKeys[i].second];
+    }
+
+    #pragma omp barrier
+
+    #pragma omp single
+    std::swap(_ids, _reorderIds);
+}
+
+void Compute::PermuteArrayInRegion(float* data, int components, int threadNum) {
+    for (int i = _bounds->lower(threadNum); i < _bounds->upper(threadNum); i++) {
+        int j = _reorderKeys[i].second;
+        for (int c = 0; c < components; c++) {
+            _reorderBuffer[i * components + c] = data[j * components + c];
+        }
+    }
+
+    #pragma omp barrier
+
+    for (int i = _bounds->lower(threadNum) * components; i < _bounds->upper(threadNum) * components; i++) {
+        data[i] = _reorderBuffer[i];
+    }
+
+    // the next array may have a different number of components, so the
+    // ranges of the threads in the buffer differ
+    #pragma omp barrier
 }
 
 void Compute::CalculatePressure() {
+    #pragma omp parallel
+    this->CalculatePressureInRegion(omp_get_thread_num());
+}
+
+void Compute::CalculatePressureInRegion(int threadNum) {
     float rho0 = _param["rho0"].as<float>(),
         k = _param["k"].as<float>(),
         gamma = _param["gamma"].as<float>(),
         k_mod = k * rho0 / gamma;
     std::string model = _param["pressure_model"].as<std::string>();
 
-    #pragma omp parallel
-    {
-        int threadNum = omp_get_thread_num();
+    if (model == "P_GAMMA_ELASTIC") {
+        for (int i = _bounds->lower(threadNum); i < _bounds->upper(threadNum); i++) {
+            _pressure[i] = (float)(k_mod * (pow(_density[i] / rho0, gamma) - 1.f));
+            _pressure[i] = _pressure[i] * (_pressure[i] > 0);
+        }
 
-        if (model == "P_GAMMA_ELASTIC") {
-            for (int i = _bounds->lower(threadNum); i < _bounds->upper(threadNum); i++) {
-                _pressure[i] = (float)(k_mod * (pow(_density[i] / rho0, gamma) - 1.f));
-                _pressure[i] = _pressure[i] * (_pressure[i] > 0);
-            }
+    } else if (model == "P_DIFFERENCE") {
+        for (int i = _bounds->lower(threadNum); i < _bounds->upper(threadNum); i++) {
+            _pressure[i] = k * (_density[i] - rho0);
+            _pressure[i] = _pressure[i] * (_pressure[i] > 0);
+        }
 
-        } else if (model == "P_DIFFERENCE") {
-            for (int i = _bounds->lower(threadNum); i < _bounds->upper(threadNum); i++) {
-                _pressure[i] = k * (_density[i] - rho0);
-                _pressure[i] = _pressure[i] * (_pressure[i] > 0);
-            }
+    } else if (model == "P_IMPLICIT") {
+        // The forces are first calculated without pressure, the pressure
+        // is then solved for in SolvePressure. The last pressure is kept as
+        // the initial guess
+        for (int i = _bounds->lower(threadNum); i < _bounds->upper(threadNum); i++) {
+            _pressureGuess[i] = _pressure[i];
+            _pressure[i] = 0.f;
         }
     }
 }
 
 void Compute::CalculateForces() {
-    float distance = 0.0;
-    float tmp = 0.0;
-    float dvx = 0.0, dvy = 0.0, dvz = 0.0;
-    float kinNrg = 0.0;
+    #pragma omp parallel
+    this->CalculateForcesInRegion(omp_get_thread_num());
+}
+
+void Compute::CalculateForcesInRegion(int threadNum) {
+    if (_kernelCombination == KERNELS_POLY6_SPIKY_WENDLAND) {
+        this->CalculateForcesWith(
+            static_cast<Poly6*>(_kernel_density),
+            static_cast<Spiky*>(_kernel_pressure),
+            static_cast<Wendland*>(_kernel_viscosity),
+            threadNum
+        );
+    } else if (_kernelCombination == KERNELS_TABULATED) {
+        this->CalculateForcesWith(
+            static_cast<TabulatedKernel*>(_kernel_density),
+            static_cast<TabulatedKernel*>(_kernel_pressure),
+            static_cast<TabulatedKernel*>(_kernel_viscosity),
+            threadNum
+        );
+    } else {
+        this->CalculateForcesWith(_kernel_density, _kernel_pressure, _kernel_viscosity, threadNum);
+    }
+}
+
+template <typename KD, typename KP, typename KV>
+void Compute::CalculateForcesWith(KD* kernelD, KP* kernelP, KV* kernelV, int threadNum) {
     float mass = _param["mass"].as<float>();
     float g = _param["g"].as<float>();
     float epsilon = _param["epsilon"].as<float>();
     float h = _param["h"].as<float>();
     float mu = _param["mu"].as<float>();
+    float dtMax = _param["dt"].as<float>();
+    float cflFactor = _param["dt_cfl_factor"].as<float>();
+    float forceFactor = _param["dt_force_factor"].as<float>();
+    int N = _bounds->getN();
+    int nrOfThreads = _bounds->getNrOfThreads();
+
+    int lower = _bounds->lower(threadNum);
+    int upper = _bounds->upper(threadNum);
+    float threadKinNrg = 0.0;
+
+    #pragma omp single
+    _kineticEnergy = 0.0;
 
     // Reset force. This cannot be done in the main particle loop because
     // we'd be overwriting already calculated forces on a particle when
     // the iteration is done for the particle, due to the force symmetry
-    #pragma omp parallel
-    {
-        int threadNum = omp_get_thread_num();
+    for (int i = lower; i < upper; i++) {
+        // calculate kinetic energy for debugging purposes
+        threadKinNrg += 0.5 * mass * (_velocity[i * 3] * _velocity[i * 3]
+            + _velocity[i * 3 + 1] * _velocity[i * 3 + 1]
+            + _velocity[i * 3 + 2] * _velocity[i * 3 + 2]);
 
-        for (int i = _bounds->lower(threadNum); i < _bounds->upper(threadNum); i++) {
-            _force[i * 3] = 0.0;
-            _force[i * 3 + 1] = 0.0;
-            _force[i * 3 + 2] = 0.0;
+        // inactive particles keep their forces from their last active step
+        if (!this->IsActive(i)) {
+            continue;
         }
+
+        // 1-body forces, currently only gravity
+        _force[i * 3] = 0.0;
+        _force[i * 3 + 1] = mass * g;
+        _force[i * 3 + 2] = 0.0;
     }
 
-    // now iterate over the particles and calculate the forces. we only do so
-    // for other particles in the neighborhood with j > i and then apply the
-    // forces to both particles in opposite directions. this uses the force
-    // symmetry to improve performance
-    #pragma omp parallel
-    {
-        int threadNum = omp_get_thread_num();
-        int ix = _bounds->lower(threadNum) * 3;
-        int iy = ix + 1;
-        int iz = ix + 2;
+    if (_continuityDensity) {
+        std::fill(_densityRate + lower, _densityRate + upper, 0.f);
+    }
 
-        for (int i = _bounds->lower(threadNum); i < _bounds->upper(threadNum); i++) {
-            // calculate kinetic energy for debugging purposes
-            kinNrg += 0.5 * mass * (_velocity[ix] * _velocity[ix]
-                + _velocity[iy] * _velocity[iy]
-                + _velocity[iz] * _velocity[iz]);
+    #pragma omp atomic
+    _kineticEnergy += threadKinNrg;
 
-            // 1-body forces, currently only gravity
-            _force[iy] += mass * g;
+    #pragma omp barrier
 
-            // 2-body forces
-            std::vector<int> candidates = std::vector<int>();
-            _neighbors->getNeighbors(i, candidates);
-            int jx, jy, jz;
+    double start = omp_get_wtime();
 
-            for (uint k = 0; k < candidates.size(); k++) {
-                int j = candidates.at(k);
+    if (_particleDt != NULL || _quietSteps != NULL) {
+        // With individual time steps or sleeping particles the forces are
+        // calculated only for the active particles, each from all of its
+        // neighbors. Inactive neighbors contribute with their current
+        // positions and velocities, but their densities and pressures of
+        // their last active step. The forces on the neighbors are left out
+        std::vector<int> candidates = std::vector<int>();
+        int* list;
+        int nrOfCandidates;
+        int active = 0;
+
+        for (int i = lower; i < upper; i++) {
+            if (!this->IsActive(i)) {
+                continue;
+            }
+            active++;
+
+            this->GetCandidates(i, candidates, list, nrOfCandidates);
+
+            if (_simd->IsEnabled()) {
+                _simd->AddForces(_position, _velocity, _density, _pressure,
+                    i, list, nrOfCandidates, _force + i * 3);
+            } else {
+                for (int k = 0; k < nrOfCandidates; k++) {
+                    if (list[k] != i) {
+                        this->AddPairForces(kernelD, kernelP, kernelV, i, list[k], NULL, NULL,
+                            mass, h, mu, epsilon);
+                    }
+                }
+            }
+
+            if (_particleDt != NULL) {
+                this->UpdateParticleTimestep(i, mass, h, dtMax, cflFactor, forceFactor);
+            }
+        }
+
+        #pragma omp single
+        _activeCount = 0;
+
+        #pragma omp atomic
+        _activeCount += active;
+
+        #pragma omp barrier
+
+        #pragma omp master
+        printf("Active particles: %d of %d; ", _activeCount, N);
+
+    } else if (_useCellPairs) {
+        // The cell pair traversal visits each pair exactly once and never
+        // lets two threads touch the same particle at the same time, so
+        // the forces can be applied to both particles directly
+        auto pairForces = [&](int i, int j) {
+            this->AddPairForces(kernelD, kernelP, kernelV, i, j, _force, _densityRate, mass, h, mu, epsilon);
+        };
+        _neighbors->forEachPair(threadNum, nrOfThreads, pairForces);
+
+    } else if (_simd->IsEnabled()) {
+        // The vectorized kernels calculate the forces on each particle
+        // from all of its neighbors, so each pair is calculated twice but
+        // each thread only writes to its own particles
+        std::vector<int> candidates = std::vector<int>();
+        int* list;
+        int nrOfCandidates;
+
+        for (int i = lower; i < upper; i++) {
+            this->GetCandidates(i, candidates, list, nrOfCandidates);
+            _simd->AddForces(_position, _velocity, _density, _pressure,
+                i, list, nrOfCandidates, _force + i * 3);
+        }
+
+    } else {
+        // now iterate over the particles and calculate the forces. we
+        // only do so for other particles in the neighborhood with j > i
+        // and then apply the forces to both particles in opposite
+        // directions. this uses the force symmetry to improve performance.
+        // forces on particles of other threads go into a buffer of this
+        // thread instead. as j > i, these are all after the range of this
+        // thread, so we only clear and later add up the buffer from the
+        // end of the range up to the highest such particle
+        float* buffer = _threadForces + (size_t)threadNum * 3 * N;
+        float* rateBuffer = _continuityDensity ? _threadDensityRates + (size_t)threadNum * N : NULL;
+        int bufferEnd = upper;
+        std::vector<int> candidates = std::vector<int>();
+        int* list;
+        int nrOfCandidates;
+
+        for (int i = lower; i < upper; i++) {
+            this->GetCandidates(i, candidates, list, nrOfCandidates);
+
+            for (int k = 0; k < nrOfCandidates; k++) {
+                int j = list[k];
 
                 if (j <= i) {
                     continue;
                 }
 
-                jx = j * 3;
-                jy = j * 3 + 1;
-                jz = j * 3 + 2;
-
-                // Calculate distance vector
-                _dr[0] = _position[ix] - _position[jx];
-                _dr[1] = _position[iy] - _position[jy];
-                _dr[2] = _position[iz] - _position[jz];
-                distance = fastSqrt2(_dr[0] * _dr[0] + _dr[1] * _dr[1] + _dr[2] * _dr[2]);
-
-                // Pressure force
-                _kernel_pressure->FOD(_dr[0], _dr[1], _dr[2], distance, _fod);
-                tmp = mass * mass * (_pressure[i] / (_density[i] * _density[i])
-                    + _pressure[j] / (_density[j] * _density[j]));
-
-                _force[ix] -= tmp * _fod[0];
-                _force[iy] -= tmp * _fod[1];
-                _force[iz] -= tmp * _fod[2];
-
-                _force[jx] += tmp * _fod[0];
-                _force[jy] += tmp * _fod[1];
-                _force[jz] += tmp * _fod[2];
-
-                // Viscosity force
-                _kernel_viscosity->FOD(_dr[0], _dr[1], _dr[2], distance, _fod);
-                dvx = _velocity[ix] - _velocity[jx];
-                dvy = _velocity[iy] - _velocity[jy];
-                dvz = _velocity[iz] - _velocity[jz];
-                tmp = 2.f * mass * mass * mu / _density[j] / (
-                    _dr[0] * _dr[0] + _dr[1] * _dr[1] + _dr[2] * _dr[2]
-                    + epsilon * h * h
-                );
-
-                _force[ix] += tmp * dvx * (_dr[0] * _fod[0]);
-                _force[iy] += tmp * dvy * (_dr[1] * _fod[1]);
-                _force[iz] += tmp * dvz * (_dr[2] * _fod[2]);
-
-                _force[jx] -= tmp * dvx * (_dr[0] * _fod[0]);
-                _force[jy] -= tmp * dvy * (_dr[1] * _fod[1]);
-                _force[jz] -= tmp * dvz * (_dr[2] * _fod[2]);
+                if (j < upper) {
+                    this->AddPairForces(kernelD, kernelP, kernelV, i, j, _force, _densityRate, mass, h, mu, epsilon);
+                    continue;
+                }
+
+                if (j >= bufferEnd) {
+                    std::fill(buffer + bufferEnd * 3, buffer + (j + 1) * 3, 0.f);
+                    if (rateBuffer != NULL) {
+                        std::fill(rateBuffer + bufferEnd, rateBuffer + j + 1, 0.f);
+                    }
+                    bufferEnd = j + 1;
+                }
+
+                this->AddPairForces(kernelD, kernelP, kernelV, i, j, buffer, rateBuffer, mass, h, mu, epsilon);
             }
+        }
 
-            ix += 3; iy += 3; iz += 3;
+        _threadForceEnd[threadNum] = bufferEnd;
+        _threadBusyTime[threadNum] += omp_get_wtime() - start;
+        start = omp_get_wtime();
+
+        #pragma omp barrier
+
+        // add up the buffers of the preceding threads for the particles
+        // of this thread
+        for (int t = 0; t < threadNum; t++) {
+            float* other = _threadForces + (size_t)t * 3 * N;
+            int from = std::max(lower, _bounds->upper(t));
+            int to = std::min(upper, _threadForceEnd[t]);
+
+            for (int k = from * 3; k < to * 3; k++) {
+                _force[k] += other[k];
+            }
+
+            if (_continuityDensity) {
+                float* otherRates = _threadDensityRates + (size_t)t * N;
+                for (int k = from; k < to; k++) {
+                    _densityRate[k] += otherRates[k];
+                }
+            }
+        }
+    }
+
+    _threadBusyTime[threadNum] += omp_get_wtime() - start;
+
+    if (_quietSteps != NULL) {
+        this->UpdateSleepingInRegion(threadNum, mass, h);
+    }
+
+    // the forces on the particles of this thread are complete now, so the
+    // maxima for the timestep control can be taken
+    if (_param["adaptive_dt"].as<bool>()) {
+        float maxSpeed2 = 0.f, maxForce2 = 0.f, maxDensity = 0.f;
+
+        for (int i = lower; i < upper; i++) {
+            maxSpeed2 = std::max(maxSpeed2, _velocity[i * 3] * _velocity[i * 3]
+                + _velocity[i * 3 + 1] * _velocity[i * 3 + 1]
+                + _velocity[i * 3 + 2] * _velocity[i * 3 + 2]);
+            maxForce2 = std::max(maxForce2, _force[i * 3] * _force[i * 3]
+                + _force[i * 3 + 1] * _force[i * 3 + 1]
+                + _force[i * 3 + 2] * _force[i * 3 + 2]);
+            maxDensity = std::max(maxDensity, _density[i]);
+        }
+
+        _threadMaxima[threadNum * 3] = std::sqrt(maxSpeed2);
+        _threadMaxima[threadNum * 3 + 1] = std::sqrt(maxForce2) / mass;
+        _threadMaxima[threadNum * 3 + 2] = maxDensity;
+    }
+
+    #pragma omp master
+    printf("Kinetic energy: %f;", _kineticEnergy);
+}
+
+void Compute::ChooseTimestep() {
+    // individual time steps choose the step of each particle instead, the
+    // global step is always the smallest one
+    if (_particleDt != NULL) {
+        return;
+    }
+
+    _previousDt = _dt;
+    _dt = _param["dt"].as<float>();
+
+    if (!_param["adaptive_dt"].as<bool>()) {
+        return;
+    }
+
+    float maxSpeed = 0.f, maxAcceleration = 0.f, maxDensity = 0.f;
+    for (int t = 0; t < _bounds->getNrOfThreads(); t++) {
+        maxSpeed = std::max(maxSpeed, _threadMaxima[t * 3]);
+        maxAcceleration = std::max(maxAcceleration, _threadMaxima[t * 3 + 1]);
+        maxDensity = std::max(maxDensity, _threadMaxima[t * 3 + 2]);
+    }
+
+    float h = _param["h"].as<float>(),
+        rho0 = _param["rho0"].as<float>(),
+        mu = _param["mu"].as<float>();
+
+    // the sound speed is largest at the largest density
+    float soundSpeed = this->SoundSpeed(maxDensity);
+
+    // information must not travel further than a fraction of the smoothing
+    // length per step, neither by the particles nor by sound waves
+    if (soundSpeed + maxSpeed > 0.f) {
+        _dt = std::min(_dt, _param["dt_cfl_factor"].as<float>() * h / (soundSpeed + maxSpeed));
+    }
+
+    if (maxAcceleration > 0.f) {
+        _dt = std::min(_dt, _param["dt_force_factor"].as<float>() * std::sqrt(h / maxAcceleration));
+    }
+
+    if (mu > 0.f) {
+        _dt = std::min(_dt, _param["dt_viscous_factor"].as<float>() * h * h * rho0 / mu);
+    }
+}
+
+float Compute::SoundSpeed(float density) {
+    float k = _param["k"].as<float>(),
+        rho0 = _param["rho0"].as<float>(),
+        gamma = _param["gamma"].as<float>();
+
+    // the sound speed is the square root of the derivative of the pressure
+    // by the density. the implicit pressure keeps the fluid incompressible,
+    // so there are no sound waves
+    if (_implicitPressure) {
+        return 0.f;
+    } else if (_param["pressure_model"].as<std::string>() == "P_GAMMA_ELASTIC") {
+        return std::sqrt(k * (float)pow(density / rho0, gamma - 1.f));
+    }
+
+    return std::sqrt(k);
+}
+
+inline bool Compute::IsAsleep(int i) {
+    return _quietSteps != NULL && _quietSteps[i] >= _sleepSteps;
+}
+
+inline bool Compute::IsActive(int i) {
+    if (this->IsAsleep(i)) {
+        return false;
+    }
+
+    if (_particleDt == NULL) {
+        return true;
+    }
+
+    int period = (int)(_particleDt[i] / _dt + 0.5f);
+    return _stepCount % period == 0;
+}
+
+void Compute::UpdateParticleTimestep(int i, float mass, float h, float dtMax, float cflFactor,
+        float forceFactor) {
+    float speed = std::sqrt(_velocity[i * 3] * _velocity[i * 3]
+        + _velocity[i * 3 + 1] * _velocity[i * 3 + 1]
+        + _velocity[i * 3 + 2] * _velocity[i * 3 + 2]);
+    float acceleration = std::sqrt(_force[i * 3] * _force[i * 3]
+        + _force[i * 3 + 1] * _force[i * 3 + 1]
+        + _force[i * 3 + 2] * _force[i * 3 + 2]) / mass;
+    float soundSpeed = this->SoundSpeed(_density[i]);
+
+    // the same criteria as for adaptive time steps, but for this particle
+    float limit = dtMax;
+    if (soundSpeed + speed > 0.f) {
+        limit = std::min(limit, cflFactor * h / (soundSpeed + speed));
+    }
+    if (acceleration > 0.f) {
+        limit = std::min(limit, forceFactor * std::sqrt(h / acceleration));
+    }
+
+    // A smaller step can be taken right away, as the smaller steps are in
+    // sync with the larger ones. A larger step only once the current step
+    // is in sync with it
+    float step = _particleDt[i];
+    while (step > _dt && step > limit) {
+        step *= 0.5f;
+    }
+
+    while (step < dtMax && 2.f * step <= limit
+            && _stepCount % (int)(2.f * step / _dt + 0.5f) == 0) {
+        step *= 2.f;
+    }
+
+    _particleDt[i] = step;
+}
+
+void Compute::UpdateSleepingInRegion(int threadNum, float mass, float h) {
+    float sleepSpeed2 = _param["sleep_velocity"].as<float>() * _param["sleep_velocity"].as<float>(),
+        sleepForce2 = _param["sleep_acceleration"].as<float>() * _param["sleep_acceleration"].as<float>()
+            * mass * mass,
+        wakeSpeed2 = _param["wake_velocity"].as<float>() * _param["wake_velocity"].as<float>(),
+        wakeForce2 = _param["wake_acceleration"].as<float>() * _param["wake_acceleration"].as<float>()
+            * mass * mass;
+    int lower = _bounds->lower(threadNum);
+    int upper = _bounds->upper(threadNum);
+
+    // First flag the awake particles that disturb their neighbors, so the
+    // sleeping particles can look at them while their own state changes
+    for (int i = lower; i < upper; i++) {
+        float speed2 = _velocity[i * 3] * _velocity[i * 3]
+            + _velocity[i * 3 + 1] * _velocity[i * 3 + 1]
+            + _velocity[i * 3 + 2] * _velocity[i * 3 + 2];
+        float force2 = _force[i * 3] * _force[i * 3]
+            + _force[i * 3 + 1] * _force[i * 3 + 1]
+            + _force[i * 3 + 2] * _force[i * 3 + 2];
+
+        _disturbed[i] = !this->IsAsleep(i) && (speed2 > wakeSpeed2 || force2 > wakeForce2);
+
+        if (!this->IsAsleep(i)) {
+            _quietSteps[i] = speed2 < sleepSpeed2 && force2 < sleepForce2 ? _quietSteps[i] + 1.f : 0.f;
         }
     }
 
-    printf("Kinetic energy: %f;", kinNrg);
+    #pragma omp barrier
+
+    std::vector<int> candidates = std::vector<int>();
+    int* list;
+    int nrOfCandidates;
+
+    for (int i = lower; i < upper; i++) {
+        if (!this->IsAsleep(i)) {
+            continue;
+        }
+
+        // Particles that just fell asleep come to rest, so they do not
+        // drift with their last velocity once they wake up
+        if (_quietSteps[i] == _sleepSteps) {
+            _quietSteps[i] += 1.f;
+            for (int k = i * 3; k < i * 3 + 3; k++) {
+                _velocity[k] = 0.f;
+                _velocity_halfs[k] = 0.f;
+                _force[k] = 0.f;
+            }
+        }
+
+        this->GetCandidates(i, candidates, list, nrOfCandidates);
+
+        for (int k = 0; k < nrOfCandidates; k++) {
+            int j = list[k];
+            float dx = _position[i * 3] - _position[j * 3];
+            float dy = _position[i * 3 + 1] - _position[j * 3 + 1];
+            float dz = _position[i * 3 + 2] - _position[j * 3 + 2];
+
+            if (_disturbed[j] && dx * dx + dy * dy + dz * dz < h * h) {
+                _quietSteps[i] = 0.f;
+                break;
+            }
+        }
+    }
+
+    #pragma omp barrier
+}
+
+template <typename KD, typename KP, typename KV>
+void Compute::AddPairForces(KD* kernelD, KP* kernelP, KV* kernelV, int i, int j, float* forceJ,
+        float* densityRateJ, float mass, float h, float mu, float epsilon) {
+    int ix = i * 3, iy = i * 3 + 1, iz = i * 3 + 2;
+    int jx = j * 3, jy = j * 3 + 1, jz = j * 3 + 2;
+    float dr[3], fod[3];
+
+    // Calculate distance vector
+    dr[0] = _position[ix] - _position[jx];
+    dr[1] = _position[iy] - _position[jy];
+    dr[2] = _position[iz] - _position[jz];
+    float r2 = dr[0] * dr[0] + dr[1] * dr[1] + dr[2] * dr[2];
+
+    // The kernels vanish beyond the smoothing length
+    if (r2 >= h * h) {
+        return;
+    }
+
+    float distance = fastSqrt2(r2);
+
+    // Pressure force
+    kernelP->FOD(dr[0], dr[1], dr[2], distance, fod);
+    float tmp = mass * mass * (_pressure[i] / (_density[i] * _density[i])
+        + _pressure[j] / (_density[j] * _density[j]));
+
+    _force[ix] -= tmp * fod[0];
+    _force[iy] -= tmp * fod[1];
+    _force[iz] -= tmp * fod[2];
+
+    if (forceJ != NULL) {
+        forceJ[jx] += tmp * fod[0];
+        forceJ[jy] += tmp * fod[1];
+        forceJ[jz] += tmp * fod[2];
+    }
+
+    // Density change by the relative velocity, which is the same for both
+    // particles, as both the velocity difference and the gradient change
+    // their sign. It uses the gradient of the density kernel, so it stays
+    // close to the summed up density
+    if (densityRateJ != NULL) {
+        kernelD->FOD(dr[0], dr[1], dr[2], distance, fod);
+        float rate = mass * ((_velocity[ix] - _velocity[jx]) * fod[0]
+            + (_velocity[iy] - _velocity[jy]) * fod[1]
+            + (_velocity[iz] - _velocity[jz]) * fod[2]);
+        _densityRate[i] += rate;
+        densityRateJ[j] += rate;
+    }
+
+    // Viscosity force
+    kernelV->FOD(dr[0], dr[1], dr[2], distance, fod);
+    float dvx = _velocity[ix] - _velocity[jx];
+    float dvy = _velocity[iy] - _velocity[jy];
+    float dvz = _velocity[iz] - _velocity[jz];
+    tmp = 2.f * mass * mass * mu / _density[j] / (r2 + epsilon * h * h);
+
+    _force[ix] += tmp * dvx * (dr[0] * fod[0]);
+    _force[iy] += tmp * dvy * (dr[1] * fod[1]);
+    _force[iz] += tmp * dvz * (dr[2] * fod[2]);
+
+    if (forceJ != NULL) {
+        forceJ[jx] -= tmp * dvx * (dr[0] * fod[0]);
+        forceJ[jy] -= tmp * dvy * (dr[1] * fod[1]);
+        forceJ[jz] -= tmp * dvz * (dr[2] * fod[2]);
+    }
 }
 
 void Compute::VelocityIntegration(bool firstStep) {
+    #pragma omp parallel
+    this->VelocityIntegrationInRegion(firstStep, omp_get_thread_num());
+}
+
+void Compute::VelocityIntegrationInRegion(bool firstStep, int threadNum) {
     float inv_mass = 1.f / _param["mass"].as<float>();
-    float dt = _param["dt"].as<float>();
-    float factor1 = dt * inv_mass * 0.5f,
-        factor2 = dt * inv_mass;
+    // with changing time steps the half step velocities are kicked from
+    // the middle of the last step to the middle of this one
+    float factor1 = _dt * inv_mass * 0.5f,
+        factor2 = 0.5f * (_previousDt + _dt) * inv_mass;
 
-    #pragma omp parallel
-    {
-        int threadNum = omp_get_thread_num();
-        int ix = _bounds->lower(threadNum) * 3;
-        int iy = ix + 1;
-        int iz = ix + 2;
-
-        if (firstStep) {
-            for (int i = _bounds->lower(threadNum); i < _bounds->upper(threadNum); i++) {
-                _velocity_halfs[ix] = _velocity[ix] +  factor1 * _force[ix];
-                _velocity_halfs[iy] = _velocity[iy] +  factor1 * _force[iy];
-                _velocity_halfs[iz] = _velocity[iz] +  factor1 * _force[iz];
+    int ix = _bounds->lower(threadNum) * 3;
+    int iy = ix + 1;
+    int iz = ix + 2;
+
+    if (firstStep) {
+        for (int i = _bounds->lower(threadNum); i < _bounds->upper(threadNum); i++) {
+            if (this->IsAsleep(i)) {
                 ix += 3; iy += 3; iz += 3;
+                continue;
             }
 
-        } else {
-            for (int i = _bounds->lower(threadNum); i < _bounds->upper(threadNum); i++) {
-                _velocity_halfs[ix] += factor2 * _force[ix];
-                _velocity_halfs[iy] += factor2 * _force[iy];
-                _velocity_halfs[iz] += factor2 * _force[iz];
-
-                _velocity[ix] = _velocity_halfs[ix] + factor1 * _force[ix];
-                _velocity[iy] = _velocity_halfs[iy] + factor1 * _force[iy];
-                _velocity[iz] = _velocity_halfs[iz] + factor1 * _force[iz];
+            _velocity_halfs[ix] = _velocity[ix] +  factor1 * _force[ix];
+            _velocity_halfs[iy] = _velocity[iy] +  factor1 * _force[iy];
+            _velocity_halfs[iz] = _velocity[iz] +  factor1 * _force[iz];
+            ix += 3; iy += 3; iz += 3;
+        }
 
+    } else {
+        for (int i = _bounds->lower(threadNum); i < _bounds->upper(threadNum); i++) {
+            // sleeping particles are at rest
+            if (this->IsAsleep(i)) {
                 ix += 3; iy += 3; iz += 3;
+                continue;
             }
+
+            _velocity_halfs[ix] += factor2 * _force[ix];
+            _velocity_halfs[iy] += factor2 * _force[iy];
+            _velocity_halfs[iz] += factor2 * _force[iz];
+
+            _velocity[ix] = _velocity_halfs[ix] + factor1 * _force[ix];
+            _velocity[iy] = _velocity_halfs[iy] + factor1 * _force[iy];
+            _velocity[iz] = _velocity_halfs[iz] + factor1 * _force[iz];
+
+            ix += 3; iy += 3; iz += 3;
         }
     }
 }
 
 void Compute::PositionIntegration() {
-    float dt = _param["dt"].as<float>();
+    #pragma omp parallel
+    this->PositionIntegrationInRegion(omp_get_thread_num());
+}
+
+void Compute::PositionIntegrationInRegion(int threadNum) {
+    float dt = _dt;
     float lx = _param["bbox_x_lower"].as<float>();
     float ly = _param["bbox_y_lower"].as<float>();
     float lz = _param["bbox_z_lower"].as<float>();
@@ -308,69 +1570,76 @@ void Compute::PositionIntegration() {
     // direction
     // @todo in fact, the reflection is too crude, since the kernel seemingly
     // extends into the wall, but should be "squished" against it
-    #pragma omp parallel
-    {
-        int threadNum = omp_get_thread_num();
-        int ix = _bounds->lower(threadNum) * 3;
-        int iy = ix + 1;
-        int iz = ix + 2;
-        float newval = 0.0;
-        float dampening = _param["dampening"].as<float>();
+    int ix = _bounds->lower(threadNum) * 3;
+    int iy = ix + 1;
+    int iz = ix + 2;
+    float newval = 0.0;
+    float dampening = _param["dampening"].as<float>();
 
+    if (_continuityDensity) {
         for (int i = _bounds->lower(threadNum); i < _bounds->upper(threadNum); i++) {
-            bool damp = false;
-
-            // Reflection of x component
-            newval = _position[ix] + _velocity_halfs[ix] * dt;
-            if (newval < lx) {
-                damp = true;
-                _position[ix] = lx + fabs(lx - newval);
-                _velocity_halfs[ix] = -_velocity_halfs[ix];
-            } else if (newval > ux) {
-                damp = true;
-                _position[ix] = ux - fabs(newval - ux);
-                _velocity_halfs[ix] = -_velocity_halfs[ix];
-            } else {
-                _position[ix] = newval;
-            }
+            _density[i] += dt * _densityRate[i];
+        }
+    }
 
-            // Reflection of y component
-            newval = _position[iy] + _velocity_halfs[iy] * dt;
-            if (newval < ly) {
-                damp = true;
-                _position[iy] = ly + fabs(ly - newval);
-                _velocity_halfs[iy] = -_velocity_halfs[iy];
-            } else if (newval > uy) {
-                damp = true;
-                _position[iy] = uy - fabs(newval - uy);
-                _velocity_halfs[iy] = -_velocity_halfs[iy];
-            } else {
-                _position[iy] = newval;
-            }
+    for (int i = _bounds->lower(threadNum); i < _bounds->upper(threadNum); i++) {
+        bool damp = false;
 
-            // Reflection of z component
-            newval = _position[iz] + _velocity_halfs[iz] * dt;
-            if (newval < lz) {
-                damp = true;
-                _position[iz] = lz + fabs(lz - newval);
-                _velocity_halfs[iz] = -_velocity_halfs[iz];
-            } else if (newval > uz) {
-                damp = true;
-                _position[iz] = uz - fabs(newval - uz);
-                _velocity_halfs[iz] = -_velocity_halfs[iz];
-            } else {
-                _position[iz] = newval;
-            }
+        if (this->IsAsleep(i)) {
+            ix += 3; iy += 3; iz += 3;
+            continue;
+        }
 
-            // Dampening
-            if (damp) {
-                _velocity_halfs[ix] *= dampening;
-                _velocity_halfs[iy] *= dampening;
-                _velocity_halfs[iz] *= dampening;
-            }
+        // Reflection of x component
+        newval = _position[ix] + _velocity_halfs[ix] * dt;
+        if (newval < lx) {
+            damp = true;
+            _position[ix] = lx + fabs(lx - newval);
+            _velocity_halfs[ix] = -_velocity_halfs[ix];
+        } else if (newval > ux) {
+            damp = true;
+            _position[ix] = ux - fabs(newval - ux);
+            _velocity_halfs[ix] = -_velocity_halfs[ix];
+        } else {
+            _position[ix] = newval;
+        }
 
-            ix += 3; iy += 3; iz += 3;
+        // Reflection of y component
+        newval = _position[iy] + _velocity_halfs[iy] * dt;
+        if (newval < ly) {
+            damp = true;
+            _position[iy] = ly + fabs(ly - newval);
+            _velocity_halfs[iy] = -_velocity_halfs[iy];
+        } else if (newval > uy) {
+            damp = true;
+            _position[iy] = uy - fabs(newval - uy);
+            _velocity_halfs[iy] = -_velocity_halfs[iy];
+        } else {
+            _position[iy] = newval;
         }
+
+        // Reflection of z component
+        newval = _position[iz] + _velocity_halfs[iz] * dt;
+        if (newval < lz) {
+            damp = true;
+            _position[iz] = lz + fabs(lz - newval);
+            _velocity_halfs[iz] = -_velocity_halfs[iz];
+        } else if (newval > uz) {
+            damp = true;
+            _position[iz] = uz - fabs(newval - uz);
+            _velocity_halfs[iz] = -_velocity_halfs[iz];
+        } else {
+            _position[iz] = newval;
+        }
+
+        // Dampening
+        if (damp) {
+            _velocity_halfs[ix] *= dampening;
+            _velocity_halfs[iy] *= dampening;
+            _velocity_halfs[iz] *= dampening;
+        }
+
+        ix += 3; iy += 3; iz += 3;
     }
 }
 
@@ -378,6 +1647,10 @@ float* Compute::GetPosition() {
     return _position;
 }
 
+float* Compute::GetVelocity() {
+    return _velocity;
+}
+
 float* Compute::GetDensity() {
     return _density;
 }
@@ -385,3 +1658,7 @@ float* Compute::GetDensity() {
 float* Compute::GetPressure() {
     return _pressure;
 }
+
+int* Compute::GetParticleIds() {
+    return _ids;
+}
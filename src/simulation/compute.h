@@ -1,9 +1,28 @@
 #pragma once
 
 #include "kernel/kernel.h"
+#include "kernel/simd_kernels.h"
 #include "data/neighbors.h"
+#include "data/verlet_list.h"
 #include "util/parallel_bounds.h"
+#include "util/checkpoint.h"
 #include <yaml-cpp/yaml.h>
+#include <vector>
+#include <utility>
+#include <cstdint>
+
+/// The combinations of kernel types for which the density and force loops
+/// are compiled with the kernel functions inlined. Other combinations use
+/// the generic loops with virtual calls.
+enum KernelCombination {
+    KERNELS_GENERIC,
+
+    /// Poly6 for density, Spiky for pressure and Wendland for viscosity
+    KERNELS_POLY6_SPIKY_WENDLAND,
+
+    /// Tabulated kernels for all three
+    KERNELS_TABULATED
+};
 
 class Compute {
 public:
@@ -29,6 +48,14 @@ public:
     /// Calculates the pressure at the particle positions.
     void CalculatePressure();
 
+    /// Solves for the pressure that keeps the fluid incompressible after the
+    /// next time step with relaxed Jacobi iterations, as in implicit
+    /// incompressible SPH, and adds the pressure forces to the other forces.
+    /// Used with the pressure model P_IMPLICIT after the forces without
+    /// pressure are calculated and the time step is chosen. The pressure
+    /// forces use the density kernel instead of the pressure kernel.
+    void SolvePressure();
+
     /// Calculates the forces that act on the particles. This consists of
     /// multiple factors like gravity, pressure and viscosity.
     void CalculateForces();
@@ -45,10 +72,24 @@ public:
     /// are the unit box that is infinitely extended towards the positive z axis.
     void PositionIntegration();
 
+    /// Reorders all particle data along a Morton (Z-order) curve over the
+    /// cells of the neighbor grid, so that particles close to each other in
+    /// space are also close to each other in memory. The original index of
+    /// each particle is kept in the particle IDs.
+    void ReorderParticles();
+
+    /// Updates the neighbor search structures for the current particle
+    /// positions. Without Verlet lists this sorts the particles into the
+    /// grid. With Verlet lists the lists are only built again, if a particle
+    /// moved far enough since the last build. Reordering of the particles
+    /// happens here as well, if it is due.
+    void UpdateNeighbors();
+
     /// Calculates one timestep of the fluid simulations, which includes
     /// calculating the forces on each particles, enforcing boundary
     /// conditions, then integrating the particle velocities and positions
-    /// to the next state.
+    /// to the next state. Depending on the parameters all phases run in one
+    /// parallel region or each phase starts its own.
     void Timestep();
 
     /// Returns the particle positions as consecutive x, y and z components,
@@ -57,6 +98,12 @@ public:
     /// @return float* The particle positions
     float* GetPosition();
 
+    /// Returns the particle velocities as consecutive x, y and z components,
+    /// for an overall number of 3*N floats.
+    ///
+    /// @return float* The particle velocities
+    float* GetVelocity();
+
     /// Returns the particle densities as consecutive values for each particle.
     /// 
     /// @return float* The particle densities
@@ -67,6 +114,37 @@ public:
     /// @return float* The particle pressure
     float* GetPressure();
 
+    /// Returns the original index of each particle, which stays the same
+    /// while the particle data is reordered.
+    ///
+    /// @return int* The particle IDs
+    int* GetParticleIds();
+
+    /// Returns the length of the last time step, which is the parameter dt
+    /// unless the time step is chosen adaptively.
+    ///
+    /// @return float The length of the last time step
+    float GetDt();
+
+    /// Returns the simulated time so far, which continues from the
+    /// checkpoint after a restart.
+    ///
+    /// @return double The simulated time
+    double GetTime();
+
+    /// Returns the number of time steps done so far, which continues from
+    /// the checkpoint after a restart.
+    ///
+    /// @return int The number of time steps
+    int GetStepCount();
+
+    /// Returns the number of particles whose forces were calculated in the
+    /// last time step, which are all particles unless individual time steps
+    /// or sleeping particles are used.
+    ///
+    /// @return int The number of active particles
+    int GetActiveCount();
+
 private:
     /// @var _param YAML::Node The parameter object containing the values
     /// of all necessary parameters.
@@ -84,6 +162,26 @@ private:
     /// @var _neighbors Neighbors* A class used to get the neighbors of a particle
     Neighbors* _neighbors;
 
+    /// @var _verlet VerletList* The neighbor lists of the particles, which
+    ///     are reused over multiple time steps. Is NULL if no skin is set, in
+    ///     which case the neighbors are taken from the grid directly.
+    VerletList* _verlet;
+
+    /// @var _useCellPairs bool Flag if the density and forces are calculated
+    ///     by traversing pairs of cells instead of iterating over the
+    ///     neighbors of each particle.
+    bool _useCellPairs;
+
+    /// @var _kernelCombination KernelCombination The combination of kernel
+    ///     types, which selects the instantiation of the density and force
+    ///     loops.
+    KernelCombination _kernelCombination;
+
+    /// @var _simd SimdKernels* The vectorized density and force calculation,
+    ///     which replaces the per pair kernel calls of the particle traversal
+    ///     if enabled.
+    SimdKernels* _simd;
+
     /// @var _bounds ParallelBounds A helper class to get the iteration bounds
     ///     in case of parallel execution, where each thread covers only part
     ///     of all particles
@@ -93,11 +191,105 @@ private:
     ///     step, which requires special handling.
     bool _isFirstStep;
 
-    /// @var _dr float* A temporary 3D vector used in calculations.
-    float* _dr;
+    /// @var _stepCount int The number of time steps done so far.
+    int _stepCount;
+
+    /// @var _lastReorderStep int The time step of the last reordering.
+    int _lastReorderStep;
 
-    /// @var _fod float* A temporary 3D vector used in calculations.
-    float* _fod;
+    /// @var _totalStepTime double The wall clock time of all time steps so
+    ///     far in seconds, for the timing output.
+    double _totalStepTime;
+
+    /// @var _paramHash uint64_t The hash of the parameters, which is stored
+    ///     in checkpoints so they are only restored with the same parameters.
+    uint64_t _paramHash;
+
+    /// @var _time double The simulated time so far.
+    double _time;
+
+    /// @var _dt float The length of the current time step.
+    float _dt;
+
+    /// @var _previousDt float The length of the previous time step.
+    float _previousDt;
+
+    /// @var _timestepLevels int The number of different time steps of the
+    ///     particles. Each is half as long as the one before, starting with
+    ///     the parameter dt. Is 1 if all particles use the same time step.
+    int _timestepLevels;
+
+    /// @var _particleDt float* The time step of each particle, which is the
+    ///     parameter dt divided by a power of two. The forces of a particle
+    ///     are calculated when the simulated time is a multiple of its time
+    ///     step. Is NULL if all particles use the same time step.
+    float* _particleDt;
+
+    /// @var _activeCount int The number of particles whose forces were
+    ///     calculated in the current time step.
+    int _activeCount;
+
+    /// @var _sleepSteps int The number of steps a particle must stay below
+    ///     the sleep thresholds before it falls asleep. 0 if particles never
+    ///     sleep.
+    int _sleepSteps;
+
+    /// @var _quietSteps float* The number of consecutive steps each particle
+    ///     stayed below the sleep thresholds. A particle is asleep if this
+    ///     reached _sleepSteps. Stored as float so it is permuted like the
+    ///     other particle data. Is NULL if particles never sleep.
+    float* _quietSteps;
+
+    /// @var _disturbed char* Flag for each particle that is awake and moves
+    ///     or accelerates enough to wake up its sleeping neighbors.
+    char* _disturbed;
+
+    /// @var _threadMaxima std::vector<float> The largest speed, acceleration
+    ///     and density of the particles of each thread, which are reduced to
+    ///     the global maxima for the timestep control.
+    std::vector<float> _threadMaxima;
+
+    /// @var _implicitPressure bool Flag if the pressure is solved for with
+    ///     the pressure model P_IMPLICIT. The following fields are only
+    ///     allocated in this case.
+    bool _implicitPressure;
+
+    /// @var _pressureGuess float* The pressure of the last time step, which
+    ///     is the initial guess of the solver.
+    float* _pressureGuess;
+
+    /// @var _advectionDensity float* The density each particle would have
+    ///     after the time step without pressure forces.
+    float* _advectionDensity;
+
+    /// @var _diagonal float* The change of the density of each particle by
+    ///     its own pressure, which is the diagonal of the linear system.
+    float* _diagonal;
+
+    /// @var _advectionVelocity float* The velocity of each particle during
+    ///     the time step without pressure forces, in x, y and z components.
+    float* _advectionVelocity;
+
+    /// @var _displacement float* The displacement of each particle by its
+    ///     own pressure per unit of pressure, in x, y and z components.
+    float* _displacement;
+
+    /// @var _pressureAcceleration float* The acceleration of each particle
+    ///     by the pressure of the current iteration, in x, y and z
+    ///     components.
+    float* _pressureAcceleration;
+
+    /// @var _threadErrors std::vector<double> The sum of the density errors
+    ///     of the particles of each thread in the current iteration.
+    std::vector<double> _threadErrors;
+
+    /// @var _totalPressureIterations int The number of iterations of the
+    ///     pressure solver over all time steps.
+    int _totalPressureIterations;
+
+    /// @var _kineticEnergy float The kinetic energy of the fluid, summed up
+    ///     by the threads during the force calculation.
+    float _kineticEnergy;
 
     /// @var _matr1 float* A temporary 3x3 matrix used in calculations. The
     ///     matrix is indexed row by row.
@@ -116,10 +308,270 @@ private:
     ///     y and z components.
     float* _force;
 
+    /// @var _threadForces float* A force buffer of 3*N floats for each
+    ///     thread, which holds the forces a thread calculated for particles
+    ///     of other threads until they are added up.
+    float* _threadForces;
+
+    /// @var _threadForceEnd std::vector<int> The particle after the last
+    ///     one in use in the force buffer of each thread.
+    std::vector<int> _threadForceEnd;
+
     /// @var _density float* The density of the fluid particles.
     float* _density;
 
+    /// @var _continuityDensity bool Flag if the density is integrated from
+    ///     the density change calculated with the forces instead of summed
+    ///     up over the neighbors in each time step.
+    bool _continuityDensity;
+
+    /// @var _densityRate float* The change of the density of each particle
+    ///     per time. Only allocated with the continuity density.
+    float* _densityRate;
+
+    /// @var _threadDensityRates float* A buffer of N floats for each thread,
+    ///     which holds the density changes a thread calculated for particles
+    ///     of other threads, like _threadForces.
+    float* _threadDensityRates;
+
     /// @var _pressure float* The pressure of the fluid particles themselves,
     ///     as opposed to the pressure acting on them by other particles.
     float* _pressure;
+
+    /// @var _ids int* The original index of each particle.
+    int* _ids;
+
+    /// @var _reorderKeys std::vector<std::pair<uint64_t, int>> The Morton
+    ///     keys and indices of the particles, sorted during reordering.
+    std::vector<std::pair<uint64_t, int>> _reorderKeys;
+
+    /// @var _reorderBuffer float* A temporary buffer for 3*N floats used to
+    ///     permute the particle data during reordering.
+    float* _reorderBuffer;
+
+    /// @var _reorderIds int* A temporary buffer for the particle IDs used
+    ///     during reordering.
+    int* _reorderIds;
+
+    /// @var _cost float* The estimated cost of each particle in the density
+    ///     and force loops, which is the number of its neighbor candidates
+    ///     in the last step. Used to balance the ranges of the threads.
+    float* _cost;
+
+    /// @var _balanceCosts bool Flag if the ranges of the threads are
+    ///     balanced by the costs of the particles in each time step.
+    bool _balanceCosts;
+
+    /// @var _threadBusyTime std::vector<double> The time each thread spent
+    ///     in the density and force loops during the current time step, in
+    ///     seconds. With the cell pair traversal this includes the waiting
+    ///     between the colours.
+    std::vector<double> _threadBusyTime;
+
+    /// Returns the neighbor candidates of the given particle, either from its
+    /// Verlet list or from the grid. In the latter case the candidates are
+    /// collected in the given vector.
+    ///
+    /// @param idx int The index of the particle
+    /// @param candidates std::vector<int>& Storage for candidates from the grid
+    /// @param list int*& Is set to the first candidate
+    /// @param nrOfCandidates int& Is set to the number of candidates
+    void GetCandidates(int idx, std::vector<int>& candidates, int*& list, int& nrOfCandidates);
+
+    /// The following methods do the same as the public ones of the same
+    /// name without the suffix, but must be called by all threads of an
+    /// enclosing parallel region instead of starting their own. They only
+    /// synchronize the threads where they need data of other threads, so
+    /// the results of one method are not necessarily complete for all
+    /// threads when it returns, see Timestep.
+    ///
+    /// @param threadNum int The thread number of the calling thread
+    void CalculateDensityInRegion(int threadNum);
+    void CalculatePressureInRegion(int threadNum);
+    void CalculateForcesInRegion(int threadNum);
+    void VelocityIntegrationInRegion(bool firstStep, int threadNum);
+    void PositionIntegrationInRegion(int threadNum);
+    void SolvePressureInRegion(int threadNum);
+
+    /// Same as CalculateDensityInRegion etc., but the results are complete
+    /// for all threads when they return.
+    ///
+    /// @param threadNum int The thread number of the calling thread
+    void ReorderParticlesInRegion(int threadNum);
+    void UpdateNeighborsInRegion(int threadNum);
+
+    /// Calculates the densities with the given density kernel. Instantiated
+    /// for the final kernel classes, so the kernel function is inlined, and
+    /// for Kernel itself as the generic fallback with virtual calls. Must be
+    /// called by all threads of a parallel region.
+    ///
+    /// @param kernel KD* The density kernel
+    /// @param threadNum int The thread number of the calling thread
+    template <typename KD>
+    void CalculateDensityWith(KD* kernel, int threadNum);
+
+    /// Calculates the forces with the given pressure and viscosity kernels.
+    /// The density kernel is used for the continuity density. Instantiated
+    /// like CalculateDensityWith. Must be called by all threads of a
+    /// parallel region.
+    ///
+    /// @param kernelD KD* The density kernel
+    /// @param kernelP KP* The pressure kernel
+    /// @param kernelV KV* The viscosity kernel
+    /// @param threadNum int The thread number of the calling thread
+    template <typename KD, typename KP, typename KV>
+    void CalculateForcesWith(KD* kernelD, KP* kernelP, KV* kernelV, int threadNum);
+
+    /// Solves for the pressure with the given density kernel, see
+    /// SolvePressure. Instantiated like CalculateDensityWith. Must be called
+    /// by all threads of a parallel region.
+    ///
+    /// @param kernel KD* The density kernel
+    /// @param threadNum int The thread number of the calling thread
+    template <typename KD>
+    void SolvePressureWith(KD* kernel, int threadNum);
+
+    /// Calculates the accelerations of the particles of the calling thread
+    /// by the current pressure.
+    ///
+    /// @param kernel KD* The kernel of the pressure gradient
+    /// @param threadNum int The thread number of the calling thread
+    /// @param mass float The particle mass
+    /// @param h float The smoothing length
+    template <typename KD>
+    void CalculatePressureAccelerations(KD* kernel, int threadNum, float mass, float h);
+
+    /// Calculates the gradient of the given kernel for the given pair of
+    /// particles.
+    ///
+    /// @param kernel KD* The kernel
+    /// @param i int The index of the first particle
+    /// @param j int The index of the second particle
+    /// @param h float The smoothing length
+    /// @param grad float* Is set to the gradient
+    /// @return bool False if the particles are the same or not within the
+    ///     smoothing length, in which case the gradient is not set
+    template <typename KD>
+    bool KernelGradient(KD* kernel, int i, int j, float h, float* grad);
+
+    /// Returns the contribution of particle j to the density of particle i,
+    /// which is the same as the contribution of i to the density of j.
+    ///
+    /// @param kernel KD* The density kernel
+    /// @param i int The index of the first particle
+    /// @param j int The index of the second particle
+    /// @param mass float The particle mass
+    /// @param h float The smoothing length
+    /// @return float The density contribution
+    template <typename KD>
+    float DensityContribution(KD* kernel, int i, int j, float mass, float h);
+
+    /// Adds the pressure and viscosity forces between the two given particles
+    /// to the forces of both particles in opposite directions. With the
+    /// continuity density, also adds the density change of the pair. The force on
+    /// the second particle is added to the given force array, so it can be
+    /// collected in a buffer if the particle belongs to another thread.
+    ///
+    /// @param kernelD KD* The density kernel
+    /// @param kernelP KP* The pressure kernel
+    /// @param kernelV KV* The viscosity kernel
+    /// @param i int The index of the first particle
+    /// @param j int The index of the second particle
+    /// @param forceJ float* The force array for the second particle, or
+    ///     NULL if only the first particle needs its forces
+    /// @param densityRateJ float* The array of density changes for the
+    ///     second particle, or NULL if the density is not integrated
+    /// @param mass float The particle mass
+    /// @param h float The smoothing length
+    /// @param mu float The viscosity parameter
+    /// @param epsilon float The parameter to avoid division by zero
+    template <typename KD, typename KP, typename KV>
+    void AddPairForces(KD* kernelD, KP* kernelP, KV* kernelV, int i, int j, float* forceJ,
+        float* densityRateJ, float mass, float h, float mu, float epsilon);
+
+    /// Chooses the length of the next time step. With adaptive time steps
+    /// this is the largest one that satisfies the CFL, force and viscous
+    /// conditions for the maxima found in the last force calculation, but
+    /// at most the parameter dt.
+    void ChooseTimestep();
+
+    /// Returns the sound speed at the given density for the pressure model.
+    ///
+    /// @param density float The density
+    /// @return float The sound speed
+    float SoundSpeed(float density);
+
+    /// Returns if the forces of the given particle are calculated in the
+    /// current time step, which is always the case without individual time
+    /// steps.
+    ///
+    /// @param i int The index of the particle
+    /// @return bool If the particle is active
+    bool IsActive(int i);
+
+    /// Returns if the given particle is asleep, so its density, forces and
+    /// position are not updated.
+    ///
+    /// @param i int The index of the particle
+    /// @return bool If the particle is asleep
+    bool IsAsleep(int i);
+
+    /// Lets the particles of the thread that stayed quiet long enough fall
+    /// asleep and wakes up sleeping particles next to disturbed ones. Must
+    /// be called by all threads of a parallel region after the forces are
+    /// calculated.
+    ///
+    /// @param threadNum int The number of the calling thread
+    /// @param mass float The particle mass
+    /// @param h float The smoothing length
+    void UpdateSleepingInRegion(int threadNum, float mass, float h);
+
+    /// Chooses the time step of the given active particle from its
+    /// velocity, acceleration and sound speed, with the criteria of the
+    /// adaptive time steps.
+    ///
+    /// @param i int The index of the particle
+    /// @param mass float The particle mass
+    /// @param h float The smoothing length
+    /// @param dtMax float The largest time step, which is the dt parameter
+    /// @param cflFactor float The factor of the CFL condition
+    /// @param forceFactor float The factor of the force condition
+    void UpdateParticleTimestep(int i, float mass, float h, float dtMax, float cflFactor,
+        float forceFactor);
+
+    /// Calls the given function with the name, data and size in bytes of
+    /// each part of the state that is stored in a checkpoint.
+    ///
+    /// @param section F The function
+    template <typename F>
+    void ForEachCheckpointSection(F section);
+
+    /// Writes the state of the simulation to the checkpoint file.
+    void WriteCheckpoint();
+
+    /// Opens the checkpoint file for a restart. Exits if the checkpoint was
+    /// written with other parameters.
+    ///
+    /// @param checkpoint CheckpointReader& The reader to open the file with
+    /// @return bool If there is a valid checkpoint
+    bool OpenCheckpoint(CheckpointReader& checkpoint);
+
+    /// Restores the state of the simulation from the given checkpoint.
+    /// Exits if any part of the state is missing.
+    ///
+    /// @param checkpoint CheckpointReader& The opened checkpoint
+    void RestoreCheckpoint(CheckpointReader& checkpoint);
+
+    /// Prints the busy time of each thread in the current time step and the
+    /// ratio of the largest to the average busy time.
+    void PrintBusyTimes();
+
+    /// Permutes the given particle data in place into the order of the last
+    /// call of ReorderParticles. Must be called by all threads of a parallel
+    /// region.
+    ///
+    /// @param data float* The particle data
+    /// @param components int The number of values per particle
+    /// @param threadNum int The thread number of the calling thread
+    void PermuteArrayInRegion(float* data, int components, int threadNum);
 };
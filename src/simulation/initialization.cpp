@@ -9,6 +9,8 @@
 #include "distribution/spherePacking.h"
 #include "distribution/volumeGrid.h"
 #include "distribution/whiteNoise.h"
+#include <cstdio>
+#include <omp.h>
 #include <string>
 
 Initialization::Initialization(YAML::Node& param) {
@@ -28,10 +30,44 @@ int Initialization::InitPosition(float* position) {
     }
 
     Domain dom = Domain(type, _param);
+    SignedDistanceField* field = NULL;
 
     if (_param["domain_type"].as<std::string>() == "mesh") {
         m.loadMeshFromOBJFile(_param["mesh_file"].as<std::string>());
         dom.setMesh(&m);
+
+        int resolution = _param["sdf_resolution"].as<int>();
+        if (resolution > 0) {
+            field = new SignedDistanceField(&m, resolution);
+
+            // the fields are cached under the hash of the mesh and the
+            // resolution, so a changed mesh gets a new one
+            char filename[512];
+            snprintf(
+                filename, sizeof(filename), "%ssdf_%016llx.bin",
+                _param["sdf_cache_path"].as<std::string>().c_str(),
+                (unsigned long long)field->getKey()
+            );
+
+            double start = omp_get_wtime();
+            bool loaded = field->load(filename);
+            if (!loaded) {
+                field->build(_param["nr_of_threads"].as<int>());
+            }
+
+            int* points = field->getNrOfPoints();
+            printf(
+                "%s signed distance field of %dx%dx%d points in %f s, using %f MB\n",
+                loaded ? "Loaded" : "Built", points[0], points[1], points[2],
+                omp_get_wtime() - start, field->getMemory() / (1024.0 * 1024.0)
+            );
+
+            if (!loaded && !field->save(filename)) {
+                printf("Can't write signed distance field to %s\n", filename);
+            }
+
+            dom.setDistanceField(field);
+        }
     }
 
     int nrCreated = 0;
@@ -89,6 +125,8 @@ int Initialization::InitPosition(float* position) {
         }
     }
 
+    delete field;
+
     return nrCreated;
 }
 
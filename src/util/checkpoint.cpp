@@ -0,0 +1,209 @@
+#include "util/checkpoint.h"
+#include "util/hash.h"
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace {
+
+/// The first bytes of each checkpoint file.
+const char MAGIC[8] = {'S', 'P', 'H', 'C', 'K', 'P', 'T', '\0'};
+
+/// The alignment of the data of each section in the file.
+const uint64_t ALIGNMENT = 64;
+
+struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t nrOfSections;
+    uint64_t paramHash;
+    uint64_t reserved;
+};
+
+struct SectionEntry {
+    char name[32];
+    uint64_t offset;
+    uint64_t bytes;
+};
+
+}
+
+uint64_t hashParameters(YAML::Node& param) {
+    // the parameters are sorted by name, so the order in the file does not
+    // matter
+    std::map<std::string, std::string> values;
+    for (YAML::const_iterator it = param.begin(); it != param.end(); ++it) {
+        std::string name = it->first.as<std::string>();
+
+        if (name == "tend" || name == "restart" || name.compare(0, 11, "checkpoint_") == 0
+                || name.compare(0, 6, "write_") == 0 || name.compare(0, 7, "camera_") == 0
+                || name.compare(0, 4, "vtk_") == 0
+                || name.compare(0, 4, "vtp_") == 0 || name.compare(0, 11, "trajectory_") == 0
+                || name.compare(0, 8, "surface_") == 0 || name == "output_buffers"
+                || name == "output_threads"
+                || name == "sdf_cache_path"
+                || name == "r_width" || name == "r_height" || name == "timing"
+                || name == "verlet_statistics") {
+            continue;
+        }
+
+        values[name] = it->second.IsScalar() ? it->second.Scalar() : YAML::Dump(it->second);
+    }
+
+    uint64_t hash = FNV1A_OFFSET_BASIS;
+    for (std::map<std::string, std::string>::iterator it = values.begin(); it != values.end(); ++it) {
+        // the terminating zeros separate names and values
+        hash = fnv1a(it->first.c_str(), it->first.size() + 1, hash);
+        hash = fnv1a(it->second.c_str(), it->second.size() + 1, hash);
+    }
+
+    return hash;
+}
+
+CheckpointWriter::CheckpointWriter(uint64_t paramHash) {
+    this->paramHash = paramHash;
+    this->sections = std::vector<Section>();
+}
+
+void CheckpointWriter::add(const char* name, const void* data, size_t bytes) {
+    Section section;
+    section.name = name;
+    section.data = data;
+    section.bytes = bytes;
+    this->sections.push_back(section);
+}
+
+bool CheckpointWriter::write(std::string filename) {
+    FileHeader header;
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = CHECKPOINT_VERSION;
+    header.nrOfSections = this->sections.size();
+    header.paramHash = this->paramHash;
+    header.reserved = 0;
+
+    std::vector<SectionEntry> table = std::vector<SectionEntry>(this->sections.size());
+    uint64_t offset = sizeof(FileHeader) + table.size() * sizeof(SectionEntry);
+
+    for (size_t k = 0; k < this->sections.size(); k++) {
+        memset(table[k].name, 0, sizeof(table[k].name));
+        strncpy(table[k].name, this->sections[k].name.c_str(), sizeof(table[k].name) - 1);
+        offset = (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+        table[k].offset = offset;
+        table[k].bytes = this->sections[k].bytes;
+        offset += this->sections[k].bytes;
+    }
+
+    std::string temporary = filename + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if (file == NULL) {
+        return false;
+    }
+
+    bool ok = fwrite(&header, sizeof(FileHeader), 1, file) == 1
+        && fwrite(table.data(), sizeof(SectionEntry), table.size(), file) == table.size();
+
+    // the gaps before the aligned sections are filled with zeros
+    static const char padding[ALIGNMENT] = {0};
+    uint64_t position = sizeof(FileHeader) + table.size() * sizeof(SectionEntry);
+
+    for (size_t k = 0; k < this->sections.size() && ok; k++) {
+        ok = fwrite(padding, 1, table[k].offset - position, file) == table[k].offset - position
+            && fwrite(this->sections[k].data, 1, table[k].bytes, file) == table[k].bytes;
+        position = table[k].offset + table[k].bytes;
+    }
+
+    ok = fclose(file) == 0 && ok;
+
+    if (!ok || rename(temporary.c_str(), filename.c_str()) != 0) {
+        remove(temporary.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+CheckpointReader::CheckpointReader() {
+    this->data = NULL;
+    this->size = 0;
+    this->paramHash = 0;
+    this->nrOfSections = 0;
+}
+
+CheckpointReader::~CheckpointReader() {
+    if (this->data != NULL) {
+        munmap(const_cast<char*>(this->data), this->size);
+    }
+}
+
+bool CheckpointReader::open(std::string filename) {
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat status;
+    if (fstat(fd, &status) != 0 || (size_t)status.st_size < sizeof(FileHeader)) {
+        close(fd);
+        return false;
+    }
+
+    // the mapping stays valid after closing the file
+    void* mapping = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+
+    this->data = static_cast<const char*>(mapping);
+    this->size = status.st_size;
+
+    FileHeader header;
+    memcpy(&header, this->data, sizeof(FileHeader));
+    if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != CHECKPOINT_VERSION
+            || sizeof(FileHeader) + (uint64_t)header.nrOfSections * sizeof(SectionEntry) > this->size) {
+        return false;
+    }
+
+    this->paramHash = header.paramHash;
+    this->nrOfSections = header.nrOfSections;
+
+    const SectionEntry* table = reinterpret_cast<const SectionEntry*>(this->data + sizeof(FileHeader));
+    for (uint32_t k = 0; k < this->nrOfSections; k++) {
+        if (table[k].offset > this->size || table[k].bytes > this->size - table[k].offset) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+const void* CheckpointReader::find(const char* name, size_t& bytes) {
+    if (this->data == NULL) {
+        return NULL;
+    }
+
+    const SectionEntry* table = reinterpret_cast<const SectionEntry*>(this->data + sizeof(FileHeader));
+    for (uint32_t k = 0; k < this->nrOfSections; k++) {
+        if (strncmp(table[k].name, name, sizeof(table[k].name)) == 0) {
+            bytes = table[k].bytes;
+            return this->data + table[k].offset;
+        }
+    }
+
+    return NULL;
+}
+
+bool CheckpointReader::read(const char* name, void* destination, size_t bytes) {
+    size_t found = 0;
+    const void* section = this->find(name, found);
+    if (section == NULL || found != bytes) {
+        return false;
+    }
+
+    memcpy(destination, section, bytes);
+    return true;
+}
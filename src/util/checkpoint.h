@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <yaml-cpp/yaml.h>
+
+/// The version of the checkpoint file format. Files of other versions are
+/// not read.
+const uint32_t CHECKPOINT_VERSION = 1;
+
+/// Returns a hash of the parameters that determine the simulation, so a
+/// checkpoint is only restored into a run with the same parameters. The
+/// parameters that only affect the end time, the checkpoints themselves or
+/// the output are left out, so they can be changed when restarting.
+///
+/// @param param YAML::Node& The parameter object
+/// @return uint64_t The hash of the parameters
+uint64_t hashParameters(YAML::Node& param);
+
+/// Writes a checkpoint file of named binary sections. The file starts with
+/// a header and a table of the sections, followed by their data, which is
+/// aligned so it can be used directly from a mapping of the file.
+class CheckpointWriter {
+private:
+    struct Section {
+        std::string name;
+        const void* data;
+        uint64_t bytes;
+    };
+
+    /// @var paramHash uint64_t The hash of the parameters of the run
+    uint64_t paramHash;
+
+    /// @var sections std::vector<Section> The sections added so far
+    std::vector<Section> sections;
+
+public:
+    /// Constructor.
+    ///
+    /// @param paramHash uint64_t The hash of the parameters of the run
+    CheckpointWriter(uint64_t paramHash);
+
+    /// Adds a section. The data is not copied, so it must not change until
+    /// the file is written.
+    ///
+    /// @param name const char* The name of the section, at most 31 characters
+    /// @param data const void* The data of the section
+    /// @param bytes size_t The size of the data in bytes
+    void add(const char* name, const void* data, size_t bytes);
+
+    /// Adds a section holding the given value.
+    ///
+    /// @param name const char* The name of the section
+    /// @param value const T& The value, which must stay valid until the
+    ///     file is written
+    template <typename T>
+    void addValue(const char* name, const T& value) {this->add(name, &value, sizeof(T));}
+
+    /// Writes all sections to the given file. The file is first written
+    /// under a temporary name and then renamed, so an existing checkpoint
+    /// is only replaced by a complete one.
+    ///
+    /// @param filename std::string The name of the file
+    /// @return bool If the file was written
+    bool write(std::string filename);
+};
+
+/// Reads a checkpoint file by mapping it into memory, so only the pages of
+/// the sections that are actually read are loaded.
+class CheckpointReader {
+private:
+    /// @var data const char* The mapping of the file, or NULL if not open
+    const char* data;
+
+    /// @var size size_t The size of the file in bytes
+    size_t size;
+
+    /// @var paramHash uint64_t The hash of the parameters of the run that
+    ///     wrote the file
+    uint64_t paramHash;
+
+    /// @var nrOfSections uint32_t The number of sections
+    uint32_t nrOfSections;
+
+public:
+    CheckpointReader();
+
+    ~CheckpointReader();
+
+    /// The mapping belongs to one reader only
+    CheckpointReader(const CheckpointReader&) = delete;
+    CheckpointReader& operator=(const CheckpointReader&) = delete;
+
+    /// Maps the given file into memory and checks its header and table of
+    /// sections.
+    ///
+    /// @param filename std::string The name of the file
+    /// @return bool If the file is a valid checkpoint of the current version
+    bool open(std::string filename);
+
+    /// Returns the data of the section with the given name.
+    ///
+    /// @param name const char* The name of the section
+    /// @param bytes size_t& Is set to the size of the section in bytes
+    /// @return const void* The data of the section, or NULL if there is no
+    ///     such section
+    const void* find(const char* name, size_t& bytes);
+
+    /// Copies the data of the section with the given name.
+    ///
+    /// @param name const char* The name of the section
+    /// @param destination void* Where to copy the data to
+    /// @param bytes size_t The expected size of the section in bytes
+    /// @return bool If the section exists and has the expected size
+    bool read(const char* name, void* destination, size_t bytes);
+
+    /// Copies the value of the section with the given name.
+    ///
+    /// @param name const char* The name of the section
+    /// @param value T& Where to copy the value to
+    /// @return bool If the section exists and has the size of the value
+    template <typename T>
+    bool readValue(const char* name, T& value) {return this->read(name, &value, sizeof(T));}
+
+    uint64_t getParamHash() {return this->paramHash;}
+};
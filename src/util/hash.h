@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/// The offset basis of the 64 bit FNV-1a hash, which is the hash of no data.
+const uint64_t FNV1A_OFFSET_BASIS = 0xcbf29ce484222325ull;
+
+/// The prime of the 64 bit FNV-1a hash.
+const uint64_t FNV1A_PRIME = 0x100000001b3ull;
+
+/// Returns the 64 bit FNV-1a hash of the given bytes. The hash of data that
+/// is split into several parts is found by passing the hash of the parts so
+/// far as the start value for the next part.
+///
+/// @param data const void* The data to hash
+/// @param bytes size_t The number of bytes of the data
+/// @param hash uint64_t The hash of the preceding data
+/// @return uint64_t The hash including the given data
+inline uint64_t fnv1a(const void* data, size_t bytes, uint64_t hash = FNV1A_OFFSET_BASIS)
+{
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < bytes; i++) {
+        hash ^= p[i];
+        hash *= FNV1A_PRIME;
+    }
+    return hash;
+}
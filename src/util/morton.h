@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+
+/// Spreads the lower 21 bits of the given value so that there are two zero
+/// bits between each of them.
+///
+/// @param x uint64_t The value to spread
+/// @return uint64_t The spread value
+inline uint64_t spreadBits3D(uint64_t x)
+{
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffffull;
+    x = (x | x << 16) & 0x1f0000ff0000ffull;
+    x = (x | x << 8) & 0x100f00f00f00f00full;
+    x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+    x = (x | x << 2) & 0x1249249249249249ull;
+    return x;
+}
+
+/// Returns the Morton (Z-order) key of the given cell coordinates, which
+/// interleaves the bits of the coordinates. Cells close to each other in
+/// space are mostly close to each other in the order of the keys. Only the
+/// lower 21 bits of each coordinate are used.
+///
+/// @param x uint32_t The x coordinate of the cell
+/// @param y uint32_t The y coordinate of the cell
+/// @param z uint32_t The z coordinate of the cell
+/// @return uint64_t The Morton key
+inline uint64_t mortonKey(uint32_t x, uint32_t y, uint32_t z)
+{
+    return spreadBits3D(x) | (spreadBits3D(y) << 1) | (spreadBits3D(z) << 2);
+}
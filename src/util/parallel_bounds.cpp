@@ -8,6 +8,7 @@ ParallelBounds::ParallelBounds(int nrOfThreads, int N) {
 
 void ParallelBounds::setNrOfThreads(int newVal) {
     this->nrOfThreads = newVal;
+    this->splits.clear();
 }
 
 int ParallelBounds::getNrOfThreads() {
@@ -16,18 +17,49 @@ int ParallelBounds::getNrOfThreads() {
 
 void ParallelBounds::setN(int newVal) {
     this->N = newVal;
+    this->splits.clear();
 }
 
 int ParallelBounds::getN() {
     return N;
 }
 
+void ParallelBounds::balance(const float* costs) {
+    double total = 0.0;
+    for (int i = 0; i < this->N; i++) {
+        total += costs[i];
+    }
+
+    this->splits.assign(this->nrOfThreads + 1, this->N);
+    this->splits[0] = 0;
+
+    // a thread starts at the first particle after the preceding threads
+    // got their share of the total cost
+    double sum = 0.0;
+    int t = 1;
+    for (int i = 0; i < this->N && t < this->nrOfThreads; i++) {
+        while (t < this->nrOfThreads && sum >= total * t / this->nrOfThreads) {
+            this->splits[t] = i;
+            t++;
+        }
+        sum += costs[i];
+    }
+}
+
 int ParallelBounds::lower(int threadNum) {
+    if (!this->splits.empty()) {
+        return this->splits[threadNum];
+    }
+
     int partial = std::floor(this->N / this->nrOfThreads);
     return threadNum * partial;
 }
 
 int ParallelBounds::upper(int threadNum) {
+    if (!this->splits.empty()) {
+        return this->splits[threadNum + 1];
+    }
+
     int partial = std::floor(this->N / this->nrOfThreads);
     if (threadNum == this->nrOfThreads - 1) {
         return this->N;
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <vector>
+
 class ParallelBounds {
 private:
     /// @var nrOfThreads int The total number of threads
@@ -8,6 +10,11 @@ private:
     /// @var N int The total number of particles
     int N;
 
+    /// @var splits std::vector<int> The first particle of each thread and
+    ///     N at the end, if the ranges were balanced by cost. Empty if the
+    ///     particles are split into ranges of equal size.
+    std::vector<int> splits;
+
 public:
     /// Constructor.
     ///
@@ -20,6 +27,14 @@ public:
     void setN(int newVal);
     int getN();
 
+    /// Splits the particles into contiguous ranges of about the same
+    /// overall cost instead of the same number of particles. Must not be
+    /// called while other threads use the bounds. Changing the number of
+    /// threads or particles goes back to ranges of equal size.
+    ///
+    /// @param costs const float* The estimated cost of each particle
+    void balance(const float* costs);
+
     /// Returns the lower bound (inclusive) of the particle indices
     /// the thread with the given thread number should cover. This method
     /// is supposed to be used in for loops.